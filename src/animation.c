@@ -0,0 +1,325 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if HAVE_SYS_TIMERFD_H
+# include <sys/timerfd.h>
+#endif
+
+#include "libbs_private.h"
+
+/* Interpolation is done with the position between two keyframes as 16.16
+ * fixed point, so rendering is integer only.
+ * Frame n of a clock is due at start + n / fps seconds, computed from the
+ * frame number every time so rounding never adds up to drift. */
+
+#define FRACTION_ONE (1u << 16)
+#define NS_PER_SEC 1000000000ull
+
+typedef struct timeline_t {
+    uint16_t offset;
+    uint16_t count;
+    bool loop;
+    size_t keyframes;
+    bs_keyframe_t* keyframe;  /* Sorted by time */
+} timeline_t;
+
+struct bs_animation_t {
+    uint16_t leds;
+    size_t timelines;
+    timeline_t* timeline;  /* Later ones are drawn over earlier ones */
+};
+
+struct bs_clock_t {
+    unsigned int fps;
+    int64_t start_ns;  /* Time of frame 0 */
+    uint64_t next;  /* Frame returned by the next bs_clock_wait() */
+    uint64_t missed;
+    int fd;  /* timerfd armed for frame next, -1 if not used */
+};
+
+bs_animation_t* bs_animation_new(uint16_t leds, bs_error_t* error) {
+    bs_animation_t* animation;
+    if (leds == 0) {
+        if (error) *error = BS_ERROR_INVALID_PARAM;
+        return NULL;
+    }
+    animation = calloc(1, sizeof(bs_animation_t));
+    if (!animation) {
+        if (error) *error = BS_ERROR_NO_MEM;
+        return NULL;
+    }
+    animation->leds = leds;
+    return animation;
+}
+
+void bs_animation_free(bs_animation_t* animation) {
+    size_t i;
+    if (!animation) return;
+    for (i = 0; i < animation->timelines; i++) {
+        free(animation->timeline[i].keyframe);
+    }
+    free(animation->timeline);
+    free(animation);
+}
+
+bool bs_animation_add(bs_animation_t* animation, uint16_t offset,
+                      uint16_t count, const bs_keyframe_t* keyframe,
+                      size_t keyframes, bool loop, bs_error_t* error) {
+    timeline_t* timeline;
+    bs_keyframe_t* copy;
+    size_t i, j;
+    if (count == 0 || keyframes == 0 ||
+        (size_t)offset + count > animation->leds) {
+        if (error) *error = BS_ERROR_INVALID_PARAM;
+        return false;
+    }
+    copy = malloc(keyframes * sizeof(bs_keyframe_t));
+    if (!copy) {
+        if (error) *error = BS_ERROR_NO_MEM;
+        return false;
+    }
+    /* Insertion sort, keyframes with the same time keep their order */
+    for (i = 0; i < keyframes; i++) {
+        for (j = i; j > 0 && copy[j - 1].time_ms > keyframe[i].time_ms; j--) {
+            copy[j] = copy[j - 1];
+        }
+        copy[j] = keyframe[i];
+    }
+    if (loop && copy[keyframes - 1].time_ms == 0) {
+        free(copy);
+        if (error) *error = BS_ERROR_INVALID_PARAM;
+        return false;
+    }
+    timeline = realloc(animation->timeline,
+                       (animation->timelines + 1) * sizeof(timeline_t));
+    if (!timeline) {
+        free(copy);
+        if (error) *error = BS_ERROR_NO_MEM;
+        return false;
+    }
+    animation->timeline = timeline;
+    timeline += animation->timelines++;
+    timeline->offset = offset;
+    timeline->count = count;
+    timeline->loop = loop;
+    timeline->keyframes = keyframes;
+    timeline->keyframe = copy;
+    return true;
+}
+
+uint32_t bs_animation_duration(const bs_animation_t* animation) {
+    uint32_t duration = 0;
+    size_t i;
+    for (i = 0; i < animation->timelines; i++) {
+        const timeline_t* timeline = animation->timeline + i;
+        const bs_keyframe_t* last = timeline->keyframe +
+            timeline->keyframes - 1;
+        if (!timeline->loop && last->time_ms > duration) {
+            duration = last->time_ms;
+        }
+    }
+    return duration;
+}
+
+/* Apply ease to a 16.16 position between two keyframes */
+static uint32_t ease(bs_ease_t ease, uint32_t f) {
+    uint32_t inv;
+    switch (ease) {
+    case BS_EASE_LINEAR:
+        break;
+    case BS_EASE_IN:
+        return ((uint64_t)f * f) >> 16;
+    case BS_EASE_OUT:
+        inv = FRACTION_ONE - f;
+        return FRACTION_ONE - (uint32_t)(((uint64_t)inv * inv) >> 16);
+    case BS_EASE_IN_OUT:
+        /* Smoothstep, 3f^2 - 2f^3 */
+        return (((uint64_t)f * f >> 16) * (3 * FRACTION_ONE - 2 * f)) >> 16;
+    case BS_EASE_STEP:
+        return 0;
+    }
+    return f;
+}
+
+static uint8_t mix(uint8_t a, uint8_t b, uint32_t f) {
+    return (a * (FRACTION_ONE - f) + b * f + FRACTION_ONE / 2) >> 16;
+}
+
+/* Color of timeline at time_us */
+static bs_color_t timeline_color(const timeline_t* timeline,
+                                 uint64_t time_us) BS_NONULL;
+
+bs_color_t timeline_color(const timeline_t* timeline, uint64_t time_us) {
+    const bs_keyframe_t* keyframe = timeline->keyframe;
+    const size_t last = timeline->keyframes - 1;
+    const uint32_t time_ms = timeline->loop ?
+        (time_us / 1000) % keyframe[last].time_ms : time_us / 1000;
+    uint64_t start, length;
+    bs_color_t color;
+    uint32_t f;
+    size_t i = 0;
+    if (timeline->loop) {
+        time_us = (uint64_t)time_ms * 1000 + time_us % 1000;
+    }
+    if (time_ms < keyframe[0].time_ms) return keyframe[0].color;
+    if (time_ms >= keyframe[last].time_ms) return keyframe[last].color;
+    /* Last keyframe at or before time_ms, there is one after it */
+    while (keyframe[i + 1].time_ms <= time_ms) i++;
+    start = (uint64_t)keyframe[i].time_ms * 1000;
+    length = (uint64_t)keyframe[i + 1].time_ms * 1000 - start;
+    f = ease(keyframe[i].ease, ((time_us - start) << 16) / length);
+    color.red = mix(keyframe[i].color.red, keyframe[i + 1].color.red, f);
+    color.green = mix(keyframe[i].color.green, keyframe[i + 1].color.green,
+                      f);
+    color.blue = mix(keyframe[i].color.blue, keyframe[i + 1].color.blue, f);
+    return color;
+}
+
+void bs_animation_render(const bs_animation_t* animation, uint64_t time_us,
+                         bs_color_t* frame) {
+    size_t i, j;
+    memset(frame, 0, animation->leds * sizeof(bs_color_t));
+    for (i = 0; i < animation->timelines; i++) {
+        const timeline_t* timeline = animation->timeline + i;
+        const bs_color_t color = timeline_color(timeline, time_us);
+        bs_color_t* led = frame + timeline->offset;
+        for (j = 0; j < timeline->count; j++) led[j] = color;
+    }
+}
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/* Time of frame relative to the start of clock, exact */
+static uint64_t frame_ns(const bs_clock_t* clock, uint64_t frame) BS_NONULL;
+
+uint64_t frame_ns(const bs_clock_t* clock, uint64_t frame) {
+    return (frame / clock->fps) * NS_PER_SEC +
+        (frame % clock->fps) * NS_PER_SEC / clock->fps;
+}
+
+/* Last frame due at ns after the start of clock */
+static uint64_t frame_at(const bs_clock_t* clock, uint64_t ns) BS_NONULL;
+
+uint64_t frame_at(const bs_clock_t* clock, uint64_t ns) {
+    return (ns / NS_PER_SEC) * clock->fps +
+        (ns % NS_PER_SEC) * clock->fps / NS_PER_SEC;
+}
+
+/* Arm the timerfd of clock for frame next, if there is one */
+static bool clock_arm(bs_clock_t* clock) BS_NONULL;
+
+bool clock_arm(bs_clock_t* clock) {
+#if HAVE_SYS_TIMERFD_H
+    struct itimerspec spec;
+    const uint64_t due = clock->start_ns + frame_ns(clock, clock->next);
+    if (clock->fd < 0) return true;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = due / NS_PER_SEC;
+    spec.it_value.tv_nsec = due % NS_PER_SEC;
+    return timerfd_settime(clock->fd, TFD_TIMER_ABSTIME, &spec, NULL) == 0;
+#else
+    (void)clock;
+    return true;
+#endif
+}
+
+bs_clock_t* bs_clock_new(unsigned int fps, bs_error_t* error) {
+    bs_clock_t* clock;
+    if (fps == 0 || fps > 1000) {
+        if (error) *error = BS_ERROR_INVALID_PARAM;
+        return NULL;
+    }
+    clock = calloc(1, sizeof(bs_clock_t));
+    if (!clock) {
+        if (error) *error = BS_ERROR_NO_MEM;
+        return NULL;
+    }
+    clock->fps = fps;
+    clock->start_ns = now_ns();
+#if HAVE_SYS_TIMERFD_H
+    clock->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (clock->fd < 0 || !clock_arm(clock)) {
+        if (clock->fd >= 0) close(clock->fd);
+        free(clock);
+        if (error) *error = BS_ERROR_IO;
+        return NULL;
+    }
+#else
+    clock->fd = -1;
+#endif
+    return clock;
+}
+
+void bs_clock_free(bs_clock_t* clock) {
+    if (!clock) return;
+    if (clock->fd >= 0) close(clock->fd);
+    free(clock);
+}
+
+/* Sleep until due, an absolute CLOCK_MONOTONIC time */
+static bool clock_sleep(bs_clock_t* clock, int64_t due) BS_NONULL;
+
+bool clock_sleep(bs_clock_t* clock, int64_t due) {
+    struct timespec ts;
+    int ret;
+    if (clock->fd >= 0) {
+        uint64_t expirations;
+        while (read(clock->fd, &expirations, sizeof(expirations)) < 0) {
+            if (errno != EINTR) return false;
+        }
+        return true;
+    }
+    ts.tv_sec = due / NS_PER_SEC;
+    ts.tv_nsec = due % NS_PER_SEC;
+    /* Returns the error instead of setting errno */
+    do {
+        ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    } while (ret == EINTR);
+    return ret == 0;
+}
+
+bool bs_clock_wait(bs_clock_t* clock, bs_tick_t* tick, bs_error_t* error) {
+    const int64_t due = clock->start_ns + frame_ns(clock, clock->next);
+    int64_t now = now_ns();
+    uint64_t frame;
+    if (now < due) {
+        if (!clock_sleep(clock, due)) {
+            if (error) *error = BS_ERROR_IO;
+            return false;
+        }
+        now = now_ns();
+    }
+    /* Skip to the last frame that is due instead of falling behind */
+    frame = frame_at(clock, now - clock->start_ns);
+    if (frame < clock->next) frame = clock->next;
+    tick->frame = frame;
+    tick->time_us = frame_ns(clock, frame) / 1000;
+    tick->late_us = (now - clock->start_ns - frame_ns(clock, frame)) / 1000;
+    tick->missed = frame - clock->next;
+    clock->missed += tick->missed;
+    clock->next = frame + 1;
+    if (!clock_arm(clock)) {
+        if (error) *error = BS_ERROR_IO;
+        return false;
+    }
+    return true;
+}
+
+uint64_t bs_clock_missed(const bs_clock_t* clock) {
+    return clock->missed;
+}
+
+int bs_clock_fd(const bs_clock_t* clock) {
+    return clock->fd;
+}
@@ -36,6 +36,8 @@ int main(int argc, char** argv) {
     if (!handle_args(argc, argv, &exitcode)) {
         return exitcode;
     }
+    /* Saves asking the device for its mode every time */
+    bs_set_caps_cache(true);
     if (glob.serial) {
         dev = bs_open_matching_serial(glob.serial, &error);
     } else {
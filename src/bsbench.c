@@ -0,0 +1,1044 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libbs.h"
+#include "extra_compiler_stuff.h"
+
+#if HAVE_GETOPT_LONG
+# include <getopt.h>
+#endif
+
+/* Every result is printed as one JSON object per line, see print_result() */
+
+static const uint8_t led_counts[] = { 1, 8, 16, 32, 64 };
+
+static struct {
+    const char* serial;
+    const char* only;
+    const char* trace;
+    bool emulated;
+    unsigned int iterations;
+    unsigned int latency_us;
+} glob;
+
+/* Latency of each call in a run of a benchmark */
+typedef struct samples_t {
+    uint64_t* ns;
+    size_t count;
+    size_t errors;
+    uint64_t start_ns;
+    uint64_t total_ns;  /* Wall time for the whole run */
+    size_t leds;  /* Leds per call, to also print time per led, or 0 */
+} samples_t;
+
+/* A device to run the per device benchmarks on */
+typedef struct target_t {
+    const char* name;
+    bool emulated;
+    uint16_t max_leds;
+} target_t;
+
+typedef void (*bench_t)(const target_t* target);
+
+static bool handle_args(int argc, char** argv, int* exitcode);
+static bool want(const char* bench);
+static uint64_t now_ns(void);
+static bs_device_t* open_target(const target_t* target, bs_error_t* error);
+static bs_device_t* open_emulated(unsigned int latency_us);
+static bool samples_init(samples_t* samples, size_t count);
+static void samples_start(samples_t* samples);
+static void samples_stop(samples_t* samples);
+static void print_string(const char* str);
+static void print_result(const char* bench, const char* device,
+                         const char* param, unsigned int value,
+                         samples_t* samples);
+static void fill_frame(bs_color_t* color, size_t count, unsigned int frame);
+
+static void bench_open(const target_t* target);
+static void bench_set_many(const target_t* target);
+static void bench_get_many(const target_t* target);
+static void bench_set_async(const target_t* target);
+static void bench_update(const target_t* target);
+static void bench_set_limited(const target_t* target);
+static void bench_enumerate(void);
+static void bench_group(void);
+static void bench_threads(void);
+static void bench_probe(void);
+static void bench_timeout(void);
+static void bench_pack(void);
+static void bench_animate(void);
+static void bench_effects(void);
+
+static const struct {
+    const char* name;
+    bench_t run;
+} device_benches[] = {
+    { "open", bench_open },
+    { "set_many", bench_set_many },
+    { "get_many", bench_get_many },
+    { "set_async", bench_set_async },
+    { "update", bench_update },
+    { "set_limited", bench_set_limited },
+};
+
+int main(int argc, char** argv) {
+    int exitcode;
+    target_t targets[2];
+    size_t count = 0, i, j;
+    bs_error_t error;
+    if (!handle_args(argc, argv, &exitcode)) {
+        return exitcode;
+    }
+    if (!bs_init(&error)) {
+        fprintf(stderr, "Error initializing libbs: %s\n", bs_error_str(error));
+        return EXIT_FAILURE;
+    }
+    if (glob.trace && !bs_trace_start(glob.trace, 0, &error)) {
+        fprintf(stderr, "Error tracing to %s: %s\n", glob.trace,
+                bs_error_str(error));
+        bs_shutdown();
+        return EXIT_FAILURE;
+    }
+    if (glob.emulated) {
+        targets[count].name = "emulated";
+        targets[count].emulated = true;
+        targets[count].max_leds = 64;
+        count++;
+    }
+    if (glob.serial) {
+        bs_device_t* dev = bs_open_matching_serial(glob.serial, &error);
+        if (!dev) {
+            fprintf(stderr, "Error opening BlinkStick %s: %s\n", glob.serial,
+                    error == BS_NO_ERROR ? "Not found" : bs_error_str(error));
+            bs_trace_stop(NULL);
+            bs_shutdown();
+            return EXIT_FAILURE;
+        }
+        targets[count].name = glob.serial;
+        targets[count].emulated = false;
+        /* The mode is left as it is, only led counts it allows are run */
+        targets[count].max_leds = bs_get_max_leds(dev);
+        bs_close(dev);
+        count++;
+    }
+    fputs("{\"bench\":\"info\",\"version\":\"" VERSION "\",\"kernel\":",
+          stdout);
+    print_string(bs_pixel_kernel());
+    fprintf(stdout, ",\"iterations\":%u,\"latency_us\":%u}\n",
+            glob.iterations, glob.latency_us);
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < sizeof(device_benches) / sizeof(device_benches[0]);
+             j++) {
+            if (want(device_benches[j].name)) {
+                device_benches[j].run(targets + i);
+            }
+        }
+    }
+    if (glob.serial && want("enumerate")) bench_enumerate();
+    /* These need many devices so they only run on emulated ones */
+    if (glob.emulated) {
+        if (want("group")) bench_group();
+        if (want("threads")) bench_threads();
+        if (want("probe")) bench_probe();
+        if (want("timeout")) bench_timeout();
+    }
+    if (want("pack")) bench_pack();
+    if (want("animate")) bench_animate();
+    bench_effects();
+    if (glob.trace) {
+        if (!bs_trace_stop(&error)) {
+            fprintf(stderr, "Error writing trace %s: %s\n", glob.trace,
+                    bs_error_str(error));
+        } else if (bs_trace_dropped() > 0) {
+            fprintf(stderr, "Trace %s is missing %lu requests\n", glob.trace,
+                    (unsigned long)bs_trace_dropped());
+        }
+    }
+    bs_shutdown();
+    return EXIT_SUCCESS;
+}
+
+bool want(const char* bench) {
+    return !glob.only || strcmp(glob.only, bench) == 0;
+}
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+bs_device_t* open_target(const target_t* target, bs_error_t* error) {
+    if (target->emulated) {
+        bs_device_t* dev = open_emulated(glob.latency_us);
+        if (error) *error = dev ? BS_NO_ERROR : BS_ERROR_NO_MEM;
+        return dev;
+    }
+    return bs_open_matching_serial(target->name, error);
+}
+
+bs_device_t* open_emulated(unsigned int latency_us) {
+    bs_emulated_config_t config;
+    bs_device_t* dev;
+    memset(&config, 0, sizeof(config));
+    config.type = BS_EMULATED_PRO;
+    config.latency_us = latency_us;
+    dev = bs_open_emulated(&config, NULL);
+    if (dev && !bs_set_mode(dev, BS_MODE_MULTI)) {
+        bs_close(dev);
+        return NULL;
+    }
+    return dev;
+}
+
+bool samples_init(samples_t* samples, size_t count) {
+    samples->ns = calloc(count ? count : 1, sizeof(uint64_t));
+    samples->count = 0;
+    samples->errors = 0;
+    samples->total_ns = 0;
+    samples->leds = 0;
+    if (!samples->ns) {
+        fputs("Out of memory\n", stderr);
+        return false;
+    }
+    return true;
+}
+
+void samples_start(samples_t* samples) {
+    samples->start_ns = now_ns();
+}
+
+void samples_stop(samples_t* samples) {
+    samples->total_ns = now_ns() - samples->start_ns;
+}
+
+static int compare_ns(const void* a, const void* b) {
+    const uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Latency below which permille of the samples are, samples must be sorted */
+static double percentile_us(const samples_t* samples, unsigned int permille) {
+    size_t i = (samples->count * permille + 999) / 1000;
+    if (samples->count == 0) return 0.0;
+    if (i > 0) i--;
+    return samples->ns[i] / 1000.0;
+}
+
+void print_string(const char* str) {
+    fputc('"', stdout);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', stdout);
+            fputc(*str, stdout);
+        } else if ((unsigned char)*str < 0x20) {
+            fprintf(stdout, "\\u%04x", (unsigned char)*str);
+        } else {
+            fputc(*str, stdout);
+        }
+    }
+    fputc('"', stdout);
+}
+
+void print_result(const char* bench, const char* device, const char* param,
+                  unsigned int value, samples_t* samples) {
+    qsort(samples->ns, samples->count, sizeof(uint64_t), compare_ns);
+    fputs("{\"bench\":", stdout);
+    print_string(bench);
+    fputs(",\"device\":", stdout);
+    print_string(device);
+    if (param) fprintf(stdout, ",\"%s\":%u", param, value);
+    fprintf(stdout, ",\"calls\":%lu,\"errors\":%lu,\"fps\":%.1f",
+            (unsigned long)samples->count, (unsigned long)samples->errors,
+            samples->total_ns ?
+            samples->count * 1e9 / samples->total_ns : 0.0);
+    fprintf(stdout, ",\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f",
+            percentile_us(samples, 500), percentile_us(samples, 990),
+            percentile_us(samples, 999));
+    if (samples->leds && samples->count) {
+        fprintf(stdout, ",\"ns_per_led\":%.3f",
+                (double)samples->total_ns / samples->count / samples->leds);
+    }
+    fprintf(stdout, ",\"max_us\":%.3f}\n",
+            samples->count ? samples->ns[samples->count - 1] / 1000.0 : 0.0);
+    fflush(stdout);
+    free(samples->ns);
+    samples->ns = NULL;
+}
+
+void fill_frame(bs_color_t* color, size_t count, unsigned int frame) {
+    size_t i;
+    for (i = 0; i < count; i++) {
+        color[i].red = (frame + i * 4) & 0xff;
+        color[i].green = (frame * 3 + i) & 0xff;
+        color[i].blue = (frame * 7 + i * 2) & 0xff;
+    }
+}
+
+void bench_open(const target_t* target) {
+    samples_t samples;
+    unsigned int i;
+    if (!samples_init(&samples, glob.iterations)) return;
+    samples_start(&samples);
+    for (i = 0; i < glob.iterations; i++) {
+        const uint64_t start = now_ns();
+        bs_device_t* dev = open_target(target, NULL);
+        if (dev) {
+            bs_close(dev);
+        } else {
+            samples.errors++;
+        }
+        samples.ns[samples.count++] = now_ns() - start;
+    }
+    samples_stop(&samples);
+    print_result("open", target->name, NULL, 0, &samples);
+}
+
+/* Run call for each led count the target supports */
+typedef bool (*leds_call_t)(bs_device_t* dev, uint8_t count,
+                            bs_color_t* color);
+
+static void bench_leds(const target_t* target, const char* bench,
+                       leds_call_t call) {
+    bs_color_t color[64];
+    bs_device_t* dev;
+    bs_error_t error;
+    size_t c;
+    dev = open_target(target, &error);
+    if (!dev) {
+        fprintf(stderr, "%s: Error opening %s: %s\n", bench, target->name,
+                bs_error_str(error));
+        return;
+    }
+    for (c = 0; c < sizeof(led_counts); c++) {
+        const uint8_t count = led_counts[c];
+        samples_t samples;
+        unsigned int i;
+        if (count > target->max_leds) break;
+        if (!samples_init(&samples, glob.iterations)) break;
+        samples_start(&samples);
+        for (i = 0; i < glob.iterations; i++) {
+            uint64_t start;
+            fill_frame(color, count, i);
+            start = now_ns();
+            if (!call(dev, count, color)) samples.errors++;
+            samples.ns[samples.count++] = now_ns() - start;
+        }
+        samples_stop(&samples);
+        print_result(bench, target->name, "leds", count, &samples);
+    }
+    bs_close(dev);
+}
+
+static bool call_set_many(bs_device_t* dev, uint8_t count,
+                          bs_color_t* color) {
+    return count == 1 ? bs_set(dev, color[0]) : bs_set_many(dev, count, color);
+}
+
+static bool call_get_many(bs_device_t* dev, uint8_t count,
+                          bs_color_t* color) {
+    return count == 1 ? bs_get(dev, color) : bs_get_many(dev, count, color);
+}
+
+void bench_set_many(const target_t* target) {
+    bench_leds(target, "set_many", call_set_many);
+}
+
+void bench_get_many(const target_t* target) {
+    bench_leds(target, "get_many", call_get_many);
+}
+
+/* Sample of an async request, stored when it completes */
+typedef struct async_t {
+    samples_t* samples;
+    uint64_t start_ns;
+} async_t;
+
+static void async_done(bs_device_t* device UNUSED, bs_error_t error,
+                       void* userdata) {
+    async_t* async = userdata;
+    if (error != BS_NO_ERROR) async->samples->errors++;
+    async->samples->ns[async->samples->count++] = now_ns() - async->start_ns;
+}
+
+void bench_set_async(const target_t* target) {
+    bs_color_t color[64];
+    bs_device_t* dev;
+    bs_error_t error;
+    async_t* async;
+    size_t c;
+    async = calloc(glob.iterations ? glob.iterations : 1, sizeof(async_t));
+    dev = async ? open_target(target, &error) : NULL;
+    if (!dev) {
+        fprintf(stderr, "set_async: Error opening %s: %s\n", target->name,
+                async ? bs_error_str(error) : "Out of memory");
+        free(async);
+        return;
+    }
+    for (c = 0; c < sizeof(led_counts); c++) {
+        const uint8_t count = led_counts[c];
+        samples_t samples;
+        unsigned int i;
+        if (count > target->max_leds) break;
+        if (!samples_init(&samples, glob.iterations)) break;
+        samples_start(&samples);
+        /* Latency here is from submit to completion, with as many requests
+         * in flight as the device allows */
+        for (i = 0; i < glob.iterations; i++) {
+            bool ok;
+            fill_frame(color, count, i);
+            async[i].samples = &samples;
+            while (true) {
+                async[i].start_ns = now_ns();
+                ok = count == 1 ?
+                    bs_set_async(dev, color[0], async_done, async + i) :
+                    bs_set_many_async(dev, count, color, async_done,
+                                      async + i);
+                if (ok || bs_error(dev) != BS_ERROR_BUSY) break;
+                bs_handle_events(-1, NULL);
+            }
+            if (!ok) {
+                samples.errors++;
+                samples.ns[samples.count++] = now_ns() - async[i].start_ns;
+            }
+        }
+        bs_flush(dev);
+        samples_stop(&samples);
+        print_result("set_async", target->name, "leds", count, &samples);
+    }
+    bs_close(dev);
+    free(async);
+}
+
+void bench_update(const target_t* target) {
+    bs_color_t previous[64], color[64];
+    bs_device_t* dev;
+    bs_error_t error;
+    samples_t samples;
+    const uint8_t count = target->max_leds > 64 ? 64 : target->max_leds;
+    unsigned int i;
+    if (count < 8) return;
+    dev = open_target(target, &error);
+    if (!dev) {
+        fprintf(stderr, "update: Error opening %s: %s\n", target->name,
+                bs_error_str(error));
+        return;
+    }
+    if (!samples_init(&samples, glob.iterations)) {
+        bs_close(dev);
+        return;
+    }
+    fill_frame(previous, count, 0);
+    bs_set_many(dev, count, previous);
+    samples_start(&samples);
+    /* Three leds spread over the strip change every frame */
+    for (i = 0; i < glob.iterations; i++) {
+        uint64_t start;
+        memcpy(color, previous, count * sizeof(bs_color_t));
+        color[(i * 7) % count].red ^= 0x80;
+        color[(i * 13 + count / 2) % count].green ^= 0x80;
+        color[count - 1 - (i % 4)].blue ^= 0x80;
+        start = now_ns();
+        if (!bs_update(dev, 0, count, previous, color)) samples.errors++;
+        samples.ns[samples.count++] = now_ns() - start;
+        memcpy(previous, color, count * sizeof(bs_color_t));
+    }
+    samples_stop(&samples);
+    print_result("update", target->name, "leds", count, &samples);
+    bs_close(dev);
+}
+
+void bench_set_limited(const target_t* target) {
+    bs_color_t color[64];
+    bs_device_t* dev;
+    bs_error_t error;
+    samples_t samples;
+    bs_power_t power;
+    const uint8_t count = target->max_leds > 64 ? 64 : target->max_leds;
+    unsigned int i;
+    if (count < 8) return;
+    dev = open_target(target, &error);
+    if (!dev) {
+        fprintf(stderr, "set_limited: Error opening %s: %s\n", target->name,
+                bs_error_str(error));
+        return;
+    }
+    /* Half of what the leds can draw so most frames are scaled */
+    power.led_ma = 20;
+    power.idle_ma = 1;
+    power.leds = count;
+    power.budget_ma = count * (1 + 30);
+    if (!samples_init(&samples, glob.iterations) ||
+        !bs_set_power_budget(dev, &power)) {
+        free(samples.ns);
+        bs_close(dev);
+        return;
+    }
+    samples_start(&samples);
+    for (i = 0; i < glob.iterations; i++) {
+        uint64_t start;
+        fill_frame(color, count, i);
+        start = now_ns();
+        if (!bs_set_many(dev, count, color)) samples.errors++;
+        samples.ns[samples.count++] = now_ns() - start;
+    }
+    samples_stop(&samples);
+    print_result("set_limited", target->name, "leds", count, &samples);
+    bs_close(dev);
+}
+
+/* Ways of finding devices compared by bench_enumerate() */
+typedef enum {
+    API_OPEN_ALL,
+    API_ENUMERATE,
+    API_ENUMERATE_FILTER,  /* Only devices starting with --serial */
+    API_OPEN_FIRST,
+    API_OPEN_SERIAL,
+} open_api_t;
+
+static bool close_found(bs_device_t* device, void* userdata UNUSED) {
+    bs_close(device);
+    return true;
+}
+
+/* Find and open devices using api, and close them again. Returns false if
+ * the api failed or found nothing */
+static bool open_with(open_api_t api) {
+    bs_filter_t filter;
+    bs_device_t** devs;
+    bs_device_t* dev = NULL;
+    size_t i;
+    switch (api) {
+    case API_OPEN_ALL:
+        devs = bs_open_all(0, NULL);
+        if (!devs) return false;
+        for (i = 0; devs[i]; i++) bs_close(devs[i]);
+        free(devs);
+        return i > 0;
+    case API_ENUMERATE:
+        return bs_enumerate(NULL, close_found, NULL, NULL);
+    case API_ENUMERATE_FILTER:
+        memset(&filter, 0, sizeof(filter));
+        filter.serial_prefix = glob.serial;
+        return bs_enumerate(&filter, close_found, NULL, NULL);
+    case API_OPEN_FIRST:
+        dev = bs_open_first(NULL);
+        break;
+    case API_OPEN_SERIAL:
+        dev = bs_open_matching_serial(glob.serial, NULL);
+        break;
+    }
+    if (!dev) return false;
+    bs_close(dev);
+    return true;
+}
+
+static void time_open(const char* bench, open_api_t api) {
+    samples_t samples;
+    unsigned int i;
+    /* Real USB enumeration is slow, a few runs are enough */
+    const unsigned int iterations = glob.iterations < 20 ? glob.iterations : 20;
+    if (!samples_init(&samples, iterations)) return;
+    samples_start(&samples);
+    for (i = 0; i < iterations; i++) {
+        const uint64_t start = now_ns();
+        if (!open_with(api)) samples.errors++;
+        samples.ns[samples.count++] = now_ns() - start;
+    }
+    samples_stop(&samples);
+    print_result(bench, "usb", NULL, 0, &samples);
+}
+
+void bench_enumerate(void) {
+    bs_error_t error;
+    time_open("open_all", API_OPEN_ALL);
+    time_open("enumerate", API_ENUMERATE);
+    time_open("enumerate_filter", API_ENUMERATE_FILTER);
+    time_open("open_first", API_OPEN_FIRST);
+    time_open("open_serial", API_OPEN_SERIAL);
+    /* The same lookups with the serials already known */
+    if (!bs_index_start(&error)) {
+        fprintf(stderr, "enumerate: Error starting device index: %s\n",
+                bs_error_str(error));
+        return;
+    }
+    time_open("enumerate_filter_index", API_ENUMERATE_FILTER);
+    time_open("open_first_index", API_OPEN_FIRST);
+    time_open("open_serial_index", API_OPEN_SERIAL);
+    bs_index_stop();
+}
+
+#define GROUP_SIZE 4
+
+void bench_group(void) {
+    bs_color_t color[64];
+    bs_group_t* group;
+    samples_t samples;
+    size_t i;
+    group = bs_group_new(NULL);
+    if (!group) return;
+    for (i = 0; i < GROUP_SIZE; i++) {
+        bs_device_t* dev = open_emulated(glob.latency_us);
+        if (!dev) break;
+        if (!bs_group_add(group, dev)) {
+            bs_close(dev);
+            break;
+        }
+    }
+    if (bs_group_size(group) == GROUP_SIZE &&
+        samples_init(&samples, glob.iterations)) {
+        samples_start(&samples);
+        for (i = 0; i < glob.iterations; i++) {
+            uint64_t start;
+            fill_frame(color, 64, i);
+            start = now_ns();
+            if (!bs_group_set_all(group, 64, color, NULL)) samples.errors++;
+            samples.ns[samples.count++] = now_ns() - start;
+        }
+        samples_stop(&samples);
+        print_result("group", "emulated", "devices", GROUP_SIZE, &samples);
+    }
+    for (i = 0; i < bs_group_size(group); i++) {
+        bs_close(bs_group_device(group, i));
+    }
+    bs_group_free(group);
+}
+
+/* One thread setting frames on its own device */
+typedef struct worker_t {
+    pthread_t thread;
+    bs_device_t* dev;
+    samples_t samples;
+} worker_t;
+
+static void* worker_run(void* arg) {
+    worker_t* worker = arg;
+    bs_color_t color[64];
+    unsigned int i;
+    for (i = 0; i < glob.iterations; i++) {
+        uint64_t start;
+        fill_frame(color, 64, i);
+        start = now_ns();
+        if (!bs_set_many(worker->dev, 64, color)) worker->samples.errors++;
+        worker->samples.ns[worker->samples.count++] = now_ns() - start;
+    }
+    return NULL;
+}
+
+void bench_threads(void) {
+    static const unsigned int thread_counts[] = { 1, 2, 4, 8 };
+    worker_t workers[8];
+    size_t c, t, started;
+    for (c = 0; c < sizeof(thread_counts) / sizeof(thread_counts[0]); c++) {
+        const size_t threads = thread_counts[c];
+        samples_t samples;
+        bool ok = samples_init(&samples, threads * glob.iterations);
+        for (t = 0; ok && t < threads; t++) {
+            workers[t].dev = open_emulated(glob.latency_us);
+            if (!workers[t].dev) {
+                ok = false;
+                break;
+            }
+            if (!samples_init(&workers[t].samples, glob.iterations)) {
+                bs_close(workers[t].dev);
+                ok = false;
+                break;
+            }
+        }
+        if (!ok) {
+            while (t-- > 0) {
+                free(workers[t].samples.ns);
+                bs_close(workers[t].dev);
+            }
+            free(samples.ns);
+            return;
+        }
+        samples_start(&samples);
+        for (started = 0; started < threads; started++) {
+            if (pthread_create(&workers[started].thread, NULL, worker_run,
+                               workers + started)) {
+                break;
+            }
+        }
+        for (t = 0; t < started; t++) pthread_join(workers[t].thread, NULL);
+        samples_stop(&samples);
+        for (t = 0; t < threads; t++) {
+            if (t < started) {
+                memcpy(samples.ns + samples.count, workers[t].samples.ns,
+                       workers[t].samples.count * sizeof(uint64_t));
+                samples.count += workers[t].samples.count;
+                samples.errors += workers[t].samples.errors;
+            }
+            free(workers[t].samples.ns);
+            bs_close(workers[t].dev);
+        }
+        print_result("threads", "emulated", "threads", threads, &samples);
+    }
+}
+
+#define PROBE_DEVICES 16
+
+void bench_probe(void) {
+    bs_device_t* devs[PROBE_DEVICES];
+    bs_health_t health[PROBE_DEVICES];
+    samples_t samples;
+    size_t i, count;
+    for (count = 0; count < PROBE_DEVICES; count++) {
+        devs[count] = open_emulated(glob.latency_us);
+        if (!devs[count]) break;
+    }
+    if (count == PROBE_DEVICES && samples_init(&samples, glob.iterations)) {
+        samples_start(&samples);
+        for (i = 0; i < glob.iterations; i++) {
+            const uint64_t start = now_ns();
+            /* Age 0 so every call probes all devices */
+            if (!bs_probe_many(devs, count, 0, health)) samples.errors++;
+            samples.ns[samples.count++] = now_ns() - start;
+        }
+        samples_stop(&samples);
+        print_result("probe", "emulated", "devices", PROBE_DEVICES, &samples);
+    }
+    for (i = 0; i < count; i++) bs_close(devs[i]);
+}
+
+#define TIMEOUT_MS 5
+
+void bench_timeout(void) {
+    bs_color_t color[8];
+    bs_device_t* dev;
+    samples_t samples;
+    unsigned int i;
+    /* Each call waits out the timeout, a few runs are enough */
+    const unsigned int iterations = glob.iterations < 50 ? glob.iterations
+        : 50;
+    /* Device much slower than the timeout, every call times out and the
+     * latency shows how close to the deadline calls fail */
+    dev = open_emulated(TIMEOUT_MS * 4 * 1000);
+    if (!dev) return;
+    if (!samples_init(&samples, iterations)) {
+        bs_close(dev);
+        return;
+    }
+    samples_start(&samples);
+    for (i = 0; i < iterations; i++) {
+        uint64_t start;
+        fill_frame(color, 8, i);
+        start = now_ns();
+        /* Success is the error here */
+        if (bs_set_many_timed(dev, 8, color, TIMEOUT_MS) ||
+            bs_error(dev) != BS_ERROR_TIMEOUT) {
+            samples.errors++;
+        }
+        samples.ns[samples.count++] = now_ns() - start;
+    }
+    samples_stop(&samples);
+    print_result("timeout", "emulated", "timeout_ms", TIMEOUT_MS, &samples);
+    bs_close(dev);
+}
+
+#define PACK_BATCH 1000
+
+void bench_pack(void) {
+    bs_color_t color[64];
+    uint8_t data[64 * 3];
+    samples_t samples;
+    unsigned int i, j;
+    volatile uint8_t sink = 0;
+    if (!samples_init(&samples, glob.iterations)) return;
+    samples.leds = 64;
+    fill_frame(color, 64, 0);
+    samples_start(&samples);
+    /* Each sample is a batch, one frame is too fast to time */
+    for (i = 0; i < glob.iterations; i++) {
+        const uint64_t start = now_ns();
+        for (j = 0; j < PACK_BATCH; j++) {
+            color[j & 63].red = j;
+            bs_pack_grb(data, color, 64);
+            sink ^= data[j % sizeof(data)];
+        }
+        samples.ns[samples.count++] = (now_ns() - start) / PACK_BATCH;
+    }
+    samples_stop(&samples);
+    /* fps is frames packed per second */
+    samples.total_ns /= PACK_BATCH;
+    print_result("pack", "cpu", "leds", 64, &samples);
+}
+
+#define ANIMATE_TIMELINES 8
+
+void bench_animate(void) {
+    static const bs_ease_t eases[] = {
+        BS_EASE_LINEAR, BS_EASE_IN, BS_EASE_OUT, BS_EASE_IN_OUT
+    };
+    bs_color_t color[64];
+    bs_keyframe_t keyframe[4];
+    bs_animation_t* animation;
+    samples_t samples;
+    unsigned int i, j;
+    volatile uint8_t sink = 0;
+    animation = bs_animation_new(64, NULL);
+    if (!animation) {
+        fputs("Out of memory\n", stderr);
+        return;
+    }
+    /* Eight ranges of eight leds with a looping timeline each */
+    for (i = 0; i < ANIMATE_TIMELINES; i++) {
+        for (j = 0; j < 4; j++) {
+            keyframe[j].time_ms = j * 250 + i * 10;
+            fill_frame(&keyframe[j].color, 1, i * 4 + j);
+            keyframe[j].ease = eases[(i + j) % 4];
+        }
+        keyframe[3].color = keyframe[0].color;
+        if (!bs_animation_add(animation, i * 8, 8, keyframe, 4, true, NULL)) {
+            fputs("Out of memory\n", stderr);
+            bs_animation_free(animation);
+            return;
+        }
+    }
+    if (!samples_init(&samples, glob.iterations)) {
+        bs_animation_free(animation);
+        return;
+    }
+    samples_start(&samples);
+    /* Each sample is a batch, one frame is too fast to time */
+    for (i = 0; i < glob.iterations; i++) {
+        const uint64_t start = now_ns();
+        for (j = 0; j < PACK_BATCH; j++) {
+            bs_animation_render(animation, (i * PACK_BATCH + j) * 997ull,
+                                color);
+            sink ^= color[j & 63].red;
+        }
+        samples.ns[samples.count++] = (now_ns() - start) / PACK_BATCH;
+    }
+    samples_stop(&samples);
+    /* fps is frames rendered per second */
+    samples.total_ns /= PACK_BATCH;
+    print_result("animate", "cpu", "leds", 64, &samples);
+    bs_animation_free(animation);
+}
+
+#define EFFECT_LEDS 256
+
+void bench_effects(void) {
+    static const struct {
+        const char* name;
+        bs_effect_t effect;
+    } effects[] = {
+        { "effect_rainbow", { BS_EFFECT_RAINBOW, 5000, { 0, 0, 0 }, 0, 0 } },
+        { "effect_breathe",
+          { BS_EFFECT_BREATHE, 3000, { 255, 128, 0 }, 0, 0 } },
+        { "effect_chase", { BS_EFFECT_CHASE, 1000, { 0, 255, 64 }, 8, 0 } },
+        { "effect_comet",
+          { BS_EFFECT_COMET, 2000, { 128, 0, 255 }, 32, 0 } },
+        { "effect_sparkle",
+          { BS_EFFECT_SPARKLE, 500, { 255, 255, 255 }, 100, 42 } },
+    };
+    bs_color_t color[EFFECT_LEDS];
+    samples_t samples;
+    unsigned int i, j;
+    size_t k;
+    volatile uint8_t sink = 0;
+    for (k = 0; k < sizeof(effects) / sizeof(effects[0]); k++) {
+        if (!want(effects[k].name)) continue;
+        if (!samples_init(&samples, glob.iterations)) return;
+        samples.leds = EFFECT_LEDS;
+        samples_start(&samples);
+        /* Each sample is a batch, one frame is too fast to time */
+        for (i = 0; i < glob.iterations; i++) {
+            const uint64_t start = now_ns();
+            for (j = 0; j < PACK_BATCH; j++) {
+                bs_effect_render(&effects[k].effect,
+                                 (i * PACK_BATCH + j) * 997ull, color,
+                                 EFFECT_LEDS);
+                sink ^= color[j % EFFECT_LEDS].red;
+            }
+            samples.ns[samples.count++] = (now_ns() - start) / PACK_BATCH;
+        }
+        samples_stop(&samples);
+        /* fps is frames rendered per second */
+        samples.total_ns /= PACK_BATCH;
+        print_result(effects[k].name, "cpu", "leds", EFFECT_LEDS, &samples);
+    }
+}
+
+static void print_usage(void) {
+    fputs("Usage: bsbench [OPTION]...\n", stdout);
+    fputs("Benchmark libbs and print one JSON object per result.\n", stdout);
+    fputs("\n", stdout);
+#if HAVE_GETOPT_LONG
+    fputs("  -s, --serial=SERIAL    ", stdout);
+#else
+    fputs("  -s SERIAL              ", stdout);
+#endif
+    fputs("also run on the BlinkStick with this SERIAL\n", stdout);
+#if HAVE_GETOPT_LONG
+    fputs("  -E, --no-emulated      ", stdout);
+#else
+    fputs("  -E                     ", stdout);
+#endif
+    fputs("do not run on emulated BlinkSticks\n", stdout);
+#if HAVE_GETOPT_LONG
+    fputs("  -b, --bench=NAME       ", stdout);
+#else
+    fputs("  -b NAME                ", stdout);
+#endif
+    fputs("only run benchmark NAME\n", stdout);
+#if HAVE_GETOPT_LONG
+    fputs("  -n, --iterations=N     ", stdout);
+#else
+    fputs("  -n N                   ", stdout);
+#endif
+    fputs("calls per result, default 1000\n", stdout);
+#if HAVE_GETOPT_LONG
+    fputs("  -l, --latency=US       ", stdout);
+#else
+    fputs("  -l US                  ", stdout);
+#endif
+    fputs("time each emulated request takes, default 0\n", stdout);
+#if HAVE_GETOPT_LONG
+    fputs("  -t, --trace=FILE       ", stdout);
+#else
+    fputs("  -t FILE                ", stdout);
+#endif
+    fputs("write all requests to FILE, for bsreplay\n", stdout);
+#if HAVE_GETOPT_LONG
+    fputs("  -V, --version          ", stdout);
+#else
+    fputs("  -V                     ", stdout);
+#endif
+    fputs("display version and exit\n", stdout);
+#if HAVE_GETOPT_LONG
+    fputs("  -h, --help             ", stdout);
+#else
+    fputs("  -h                     ", stdout);
+#endif
+    fputs("display this text and exit\n", stdout);
+    fputs("\n", stdout);
+    fputs("Benchmarks: open, set_many, get_many, set_async, update, ", stdout);
+    fputs("set_limited,\n", stdout);
+    fputs("enumerate (with --serial; open_all, enumerate, ", stdout);
+    fputs("enumerate_filter, open_first,\n", stdout);
+    fputs("open_serial, and the last three again with the index running), ",
+          stdout);
+    fputs("group,\n", stdout);
+    fputs("threads, probe, timeout (emulated), pack, animate,\n", stdout);
+    fputs("effect_rainbow, effect_breathe, effect_chase, effect_comet and ",
+          stdout);
+    fputs("effect_sparkle.\n", stdout);
+}
+
+/* Parse a positive number, return false if str is not one */
+static bool parse_uint(const char* str, unsigned int* value) {
+    char* end = NULL;
+    unsigned long tmp;
+    errno = 0;
+    tmp = strtoul(str, &end, 10);
+    if (errno || !end || *end || str[0] == '-' || tmp > 100000000) {
+        return false;
+    }
+    *value = tmp;
+    return true;
+}
+
+bool handle_args(int argc, char** argv, int* exitcode) {
+    const char* shortopts = "VhEs:b:n:l:t:";
+    bool error = false, usage = false, version = false;
+#if HAVE_GETOPT_LONG
+    static const struct option longopts[] = {
+        { "version",     no_argument,       NULL, 'V' },
+        { "help",        no_argument,       NULL, 'h' },
+        { "no-emulated", no_argument,       NULL, 'E' },
+        { "serial",      required_argument, NULL, 's' },
+        { "bench",       required_argument, NULL, 'b' },
+        { "iterations",  required_argument, NULL, 'n' },
+        { "latency",     required_argument, NULL, 'l' },
+        { "trace",       required_argument, NULL, 't' },
+        { NULL,          0,                 NULL,  0  }
+    };
+#endif
+    glob.emulated = true;
+    glob.iterations = 1000;
+    while (true) {
+        int c;
+#if HAVE_GETOPT_LONG
+        int index;
+        c = getopt_long(argc, argv, shortopts, longopts, &index);
+#else
+        c = getopt(argc, argv, shortopts);
+#endif
+        if (c == -1) break;
+        switch (c) {
+        case 'V':
+            version = true;
+            break;
+        case 'h':
+            usage = true;
+            break;
+        case 'E':
+            glob.emulated = false;
+            break;
+        case 's':
+            glob.serial = optarg;
+            break;
+        case 'b':
+            glob.only = optarg;
+            break;
+        case 'n':
+            if (!parse_uint(optarg, &glob.iterations) ||
+                glob.iterations == 0) {
+                fprintf(stderr, "Invalid iterations value: %s\n", optarg);
+                error = true;
+            }
+            break;
+        case 'l':
+            if (!parse_uint(optarg, &glob.latency_us)) {
+                fprintf(stderr, "Invalid latency value: %s\n", optarg);
+                error = true;
+            }
+            break;
+        case 't':
+            glob.trace = optarg;
+            break;
+        case '?':
+            error = true;
+            break;
+        }
+    }
+    if (!error && optind < argc) {
+        fputs("Unexpected arguments after options\n", stderr);
+        error = true;
+    }
+    if (!error && !glob.emulated && !glob.serial) {
+        fputs("Nothing to run on without emulated BlinkSticks or a serial\n",
+              stderr);
+        error = true;
+    }
+    if (usage) {
+        print_usage();
+        *exitcode = error ? EXIT_FAILURE : EXIT_SUCCESS;
+        return false;
+    }
+    if (error) {
+#if HAVE_GETOPT_LONG
+        fputs("Try `bsbench --help` for usage\n", stderr);
+#else
+        fputs("Try `bsbench -h` for usage\n", stderr);
+#endif
+        *exitcode = EXIT_FAILURE;
+        return false;
+    }
+    if (version) {
+        fputs("bsbench " VERSION " written by Joel Klinghed\n", stdout);
+        *exitcode = EXIT_SUCCESS;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,327 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libbs.h"
+
+#if HAVE_GETOPT_LONG
+# include <getopt.h>
+#endif
+
+/* Prints one JSON object per line, like bsbench, for the replayed requests
+ * and for the same requests as recorded */
+
+static struct {
+    const char* trace;
+    const char* serial;
+    const char* only;
+    bool timed;
+    unsigned int latency_us;
+} glob;
+
+/* Latency of each replayed request */
+typedef struct samples_t {
+    uint64_t* replayed;
+    uint64_t* recorded;
+    size_t count, size;
+    size_t errors;  /* Failed when replayed */
+    size_t recorded_errors;
+    size_t differ;  /* Result not the same as recorded */
+    uint64_t first_us, last_us;  /* Trace time of first and last request */
+    bool failed;  /* Out of memory */
+} samples_t;
+
+static bool handle_args(int argc, char** argv, int* exitcode);
+static void replay_done(const bs_replay_t* request, void* userdata);
+static void print_result(const char* bench, const char* device,
+                         uint64_t* us, size_t count, size_t errors,
+                         uint64_t total_us, samples_t* samples);
+
+int main(int argc, char** argv) {
+    int exitcode;
+    bs_device_t* dev;
+    samples_t samples;
+    bs_error_t error;
+    const char* name;
+    bool ok;
+    if (!handle_args(argc, argv, &exitcode)) {
+        return exitcode;
+    }
+    if (!bs_init(&error)) {
+        fprintf(stderr, "Error initializing libbs: %s\n", bs_error_str(error));
+        return EXIT_FAILURE;
+    }
+    if (glob.serial) {
+        dev = bs_open_matching_serial(glob.serial, &error);
+        name = glob.serial;
+    } else {
+        bs_emulated_config_t config;
+        memset(&config, 0, sizeof(config));
+        config.type = BS_EMULATED_PRO;
+        config.latency_us = glob.latency_us;
+        dev = bs_open_emulated(&config, &error);
+        name = "emulated";
+    }
+    if (!dev) {
+        fprintf(stderr, "Error opening BlinkStick: %s\n",
+                error == BS_NO_ERROR ? "Not found" : bs_error_str(error));
+        bs_shutdown();
+        return EXIT_FAILURE;
+    }
+    memset(&samples, 0, sizeof(samples));
+    ok = bs_replay(dev, glob.trace, glob.only, glob.timed, replay_done,
+                   &samples, &error);
+    bs_close(dev);
+    bs_shutdown();
+    if (!ok) {
+        fprintf(stderr, "Error replaying %s: %s\n", glob.trace,
+                bs_error_str(error));
+    } else if (samples.failed) {
+        fputs("Out of memory\n", stderr);
+        ok = false;
+    } else {
+        const uint64_t total = samples.last_us - samples.first_us;
+        print_result("replay", name, samples.replayed, samples.count,
+                     samples.errors, 0, &samples);
+        print_result("recorded", glob.only ? glob.only : "trace",
+                     samples.recorded, samples.count, samples.recorded_errors,
+                     total, NULL);
+    }
+    free(samples.replayed);
+    free(samples.recorded);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void replay_done(const bs_replay_t* request, void* userdata) {
+    samples_t* samples = userdata;
+    if (samples->failed) return;
+    if (samples->count == samples->size) {
+        const size_t size = samples->size ? samples->size * 2 : 1024;
+        uint64_t* replayed = realloc(samples->replayed,
+                                     size * sizeof(uint64_t));
+        uint64_t* recorded;
+        if (replayed) samples->replayed = replayed;
+        recorded = realloc(samples->recorded, size * sizeof(uint64_t));
+        if (recorded) samples->recorded = recorded;
+        if (!replayed || !recorded) {
+            samples->failed = true;
+            return;
+        }
+        samples->size = size;
+    }
+    if (samples->count == 0 || request->start_us < samples->first_us) {
+        samples->first_us = request->start_us;
+    }
+    if (request->start_us + request->recorded_us > samples->last_us) {
+        samples->last_us = request->start_us + request->recorded_us;
+    }
+    samples->replayed[samples->count] = request->latency_us;
+    samples->recorded[samples->count] = request->recorded_us;
+    samples->count++;
+    if (request->error != BS_NO_ERROR) samples->errors++;
+    if (request->recorded_error != BS_NO_ERROR) samples->recorded_errors++;
+    if (request->error != request->recorded_error) samples->differ++;
+}
+
+static int compare_us(const void* a, const void* b) {
+    const uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Latency below which permille of us are, us must be sorted */
+static uint64_t percentile_us(const uint64_t* us, size_t count,
+                              unsigned int permille) {
+    size_t i = (count * permille + 999) / 1000;
+    if (count == 0) return 0;
+    if (i > 0) i--;
+    return us[i];
+}
+
+static void print_string(const char* str) {
+    fputc('"', stdout);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', stdout);
+            fputc(*str, stdout);
+        } else if ((unsigned char)*str < 0x20) {
+            fprintf(stdout, "\\u%04x", (unsigned char)*str);
+        } else {
+            fputc(*str, stdout);
+        }
+    }
+    fputc('"', stdout);
+}
+
+/* samples is only given for the replay, to add what differs */
+void print_result(const char* bench, const char* device, uint64_t* us,
+                  size_t count, size_t errors, uint64_t total_us,
+                  samples_t* samples) {
+    uint64_t sum = 0;
+    size_t i;
+    for (i = 0; i < count; i++) sum += us[i];
+    qsort(us, count, sizeof(uint64_t), compare_us);
+    fputs("{\"bench\":", stdout);
+    print_string(bench);
+    fputs(",\"device\":", stdout);
+    print_string(device);
+    fputs(",\"trace\":", stdout);
+    print_string(glob.trace);
+    fprintf(stdout, ",\"timed\":%s,\"calls\":%lu,\"errors\":%lu",
+            glob.timed ? "true" : "false", (unsigned long)count,
+            (unsigned long)errors);
+    if (samples) {
+        fprintf(stdout, ",\"differ\":%lu", (unsigned long)samples->differ);
+    } else {
+        fprintf(stdout, ",\"duration_us\":%lu", (unsigned long)total_us);
+    }
+    fprintf(stdout, ",\"mean_us\":%.3f",
+            count ? (double)sum / count : 0.0);
+    fprintf(stdout, ",\"p50_us\":%lu,\"p99_us\":%lu,\"p999_us\":%lu",
+            (unsigned long)percentile_us(us, count, 500),
+            (unsigned long)percentile_us(us, count, 990),
+            (unsigned long)percentile_us(us, count, 999));
+    fprintf(stdout, ",\"max_us\":%lu}\n",
+            (unsigned long)(count ? us[count - 1] : 0));
+    fflush(stdout);
+}
+
+static void print_usage(void) {
+    fputs("Usage: bsreplay [OPTION]... TRACE\n", stdout);
+    fputs("Send the requests in TRACE, written by bs_trace_start(), to a "
+          "BlinkStick\n", stdout);
+    fputs("and print their latency as JSON, replayed and as recorded.\n",
+          stdout);
+    fputs("\n", stdout);
+#if HAVE_GETOPT_LONG
+    fputs("  -s, --serial=SERIAL    ", stdout);
+#else
+    fputs("  -s SERIAL              ", stdout);
+#endif
+    fputs("replay to the BlinkStick with this SERIAL instead of an\n",
+          stdout);
+    fputs("                         emulated one\n", stdout);
+#if HAVE_GETOPT_LONG
+    fputs("  -d, --device=SERIAL    ", stdout);
+#else
+    fputs("  -d SERIAL              ", stdout);
+#endif
+    fputs("only replay requests recorded for SERIAL\n", stdout);
+#if HAVE_GETOPT_LONG
+    fputs("  -f, --fast             ", stdout);
+#else
+    fputs("  -f                     ", stdout);
+#endif
+    fputs("send requests as fast as possible, not as recorded\n", stdout);
+#if HAVE_GETOPT_LONG
+    fputs("  -l, --latency=US       ", stdout);
+#else
+    fputs("  -l US                  ", stdout);
+#endif
+    fputs("time each emulated request takes, default 0\n", stdout);
+#if HAVE_GETOPT_LONG
+    fputs("  -V, --version          ", stdout);
+#else
+    fputs("  -V                     ", stdout);
+#endif
+    fputs("display version and exit\n", stdout);
+#if HAVE_GETOPT_LONG
+    fputs("  -h, --help             ", stdout);
+#else
+    fputs("  -h                     ", stdout);
+#endif
+    fputs("display this text and exit\n", stdout);
+    fputs("\n", stdout);
+}
+
+bool handle_args(int argc, char** argv, int* exitcode) {
+    const char* shortopts = "Vhfs:d:l:";
+    bool error = false, usage = false, version = false;
+#if HAVE_GETOPT_LONG
+    static const struct option longopts[] = {
+        { "version", no_argument,       NULL, 'V' },
+        { "help",    no_argument,       NULL, 'h' },
+        { "fast",    no_argument,       NULL, 'f' },
+        { "serial",  required_argument, NULL, 's' },
+        { "device",  required_argument, NULL, 'd' },
+        { "latency", required_argument, NULL, 'l' },
+        { NULL,      0,                 NULL,  0  }
+    };
+#endif
+    glob.timed = true;
+    while (true) {
+        int c;
+#if HAVE_GETOPT_LONG
+        int index;
+        c = getopt_long(argc, argv, shortopts, longopts, &index);
+#else
+        c = getopt(argc, argv, shortopts);
+#endif
+        if (c == -1) break;
+        switch (c) {
+        case 'V':
+            version = true;
+            break;
+        case 'h':
+            usage = true;
+            break;
+        case 'f':
+            glob.timed = false;
+            break;
+        case 's':
+            glob.serial = optarg;
+            break;
+        case 'd':
+            glob.only = optarg;
+            break;
+        case 'l': {
+            char* end = NULL;
+            unsigned long tmp;
+            errno = 0;
+            tmp = strtoul(optarg, &end, 10);
+            if (errno || !end || *end || optarg[0] == '-' ||
+                tmp > 100000000) {
+                fprintf(stderr, "Invalid latency value: %s\n", optarg);
+                error = true;
+            }
+            glob.latency_us = tmp;
+            break;
+        }
+        case '?':
+            error = true;
+            break;
+        }
+    }
+    if (!error && !usage && !version) {
+        if (optind + 1 == argc) {
+            glob.trace = argv[optind];
+        } else {
+            fputs("Expected one trace file after options\n", stderr);
+            error = true;
+        }
+    }
+    if (usage) {
+        print_usage();
+        *exitcode = error ? EXIT_FAILURE : EXIT_SUCCESS;
+        return false;
+    }
+    if (error) {
+#if HAVE_GETOPT_LONG
+        fputs("Try `bsreplay --help` for usage\n", stderr);
+#else
+        fputs("Try `bsreplay -h` for usage\n", stderr);
+#endif
+        *exitcode = EXIT_FAILURE;
+        return false;
+    }
+    if (version) {
+        fputs("bsreplay " VERSION " written by Joel Klinghed\n", stdout);
+        *exitcode = EXIT_SUCCESS;
+        return false;
+    }
+    return true;
+}
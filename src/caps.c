@@ -0,0 +1,135 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libbs_private.h"
+
+/* One file per device, named after its serial, in $XDG_RUNTIME_DIR/libbs.
+ * The runtime dir is emptied at logout and on reboot so entries never get
+ * very old, and the bus address changes every time the device is plugged in
+ * so an entry is only used for the same connection it was written for. */
+
+#define CAPS_FORMAT 1  /* First field of every entry */
+
+static struct {
+    pthread_mutex_t lock;
+    bool enabled;
+} caps = { PTHREAD_MUTEX_INITIALIZER, false };
+
+void bs_set_caps_cache(bool enable) {
+    pthread_mutex_lock(&caps.lock);
+    caps.enabled = enable;
+    pthread_mutex_unlock(&caps.lock);
+}
+
+static bool caps_enabled(void) {
+    bool enabled;
+    pthread_mutex_lock(&caps.lock);
+    enabled = caps.enabled;
+    pthread_mutex_unlock(&caps.lock);
+    return enabled;
+}
+
+/* Fill in path of the entry for serial, return false if there is nowhere
+ * to put it. Creates the directory if mkdirs */
+static bool caps_path(const char* serial, char* path, size_t size,
+                      bool mkdirs) BS_NONULL;
+
+bool caps_path(const char* serial, char* path, size_t size, bool mkdirs) {
+    const char* runtime;
+    int len;
+    runtime = getenv("XDG_RUNTIME_DIR");
+    if (!runtime || runtime[0] != '/') return false;
+    /* Serial comes from the device, do not let it escape the directory */
+    if (serial[0] == '\0' || serial[0] == '.' || strchr(serial, '/')) {
+        return false;
+    }
+    len = snprintf(path, size, "%s/libbs", runtime);
+    if (len < 0 || (size_t)len >= size) return false;
+    if (mkdirs && mkdir(path, 0700) != 0 && errno != EEXIST) return false;
+    len = snprintf(path, size, "%s/libbs/%s", runtime, serial);
+    return len >= 0 && (size_t)len < size;
+}
+
+/* Read the entry at path, return false if there is none for bus and
+ * address */
+static bool caps_read(const char* path, uint8_t bus, uint8_t address,
+                      bs_caps_t* entry) BS_NONULL;
+
+bool caps_read(const char* path, uint8_t bus, uint8_t address,
+               bs_caps_t* entry) {
+    unsigned int format, b, a, version, leds;
+    int mode;
+    FILE* fh;
+    int ret;
+    fh = fopen(path, "r");
+    if (!fh) return false;
+    ret = fscanf(fh, "%u %u %u %u %d %u", &format, &b, &a, &version, &mode,
+                 &leds);
+    fclose(fh);
+    if (ret != 6 || format != CAPS_FORMAT || b != bus || a != address ||
+        mode < 0 || mode > 0xff || leds > 0xffff) {
+        return false;
+    }
+    entry->version = (bs_version_t)version;
+    entry->mode = mode;
+    entry->leds = leds;
+    return true;
+}
+
+bool caps_load(const char* serial, uint8_t bus, uint8_t address,
+               bs_caps_t* entry) {
+    char path[512];
+    return caps_enabled() && caps_path(serial, path, sizeof(path), false) &&
+        caps_read(path, bus, address, entry);
+}
+
+void caps_store(const char* serial, uint8_t bus, uint8_t address,
+                const bs_caps_t* entry) {
+    char path[512], tmp[520];
+    const bool enabled = caps_enabled();
+    FILE* fh;
+    bool ok;
+    int fd;
+    if (!caps_path(serial, path, sizeof(path), enabled)) return;
+    if (!enabled) {
+        /* Other processes might use the cache, do not leave them an entry
+         * that is no longer true */
+        bs_caps_t old;
+        if (!entry || (caps_read(path, bus, address, &old) &&
+                       (old.version != entry->version ||
+                        old.mode != entry->mode ||
+                        old.leds != entry->leds))) {
+            unlink(path);
+        }
+        return;
+    }
+    if (!entry) {
+        unlink(path);
+        return;
+    }
+    /* Write a new file and replace the old one so readers in other
+     * processes never see half an entry. The name is unique so writers in
+     * other processes or threads never share it */
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0) return;
+    fh = fdopen(fd, "w");
+    if (!fh) {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    ok = fprintf(fh, "%u %u %u %u %d %u\n", CAPS_FORMAT, bus, address,
+                 (unsigned int)entry->version, entry->mode,
+                 entry->leds) > 0;
+    ok = fclose(fh) == 0 && ok;
+    if (!ok || rename(tmp, path) != 0) unlink(tmp);
+}
@@ -0,0 +1,236 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "libbs_private.h"
+
+/* Positions are 16 bit fractions of a cycle, or of a led as 8.8 fixed point,
+ * and levels are 0-255. Effects that need a level per led compute them for
+ * a chunk of leds at a time in 32 bit math without calls or divisions, which
+ * compilers can vectorize, before coloring the chunk. */
+
+static struct {
+    pthread_once_t once;
+    uint8_t wave[256];  /* (1 - cos) / 2 over one cycle */
+    bs_color_t hue[256];  /* Full saturation and value */
+} tables = { PTHREAD_ONCE_INIT, { 0 }, { { 0, 0, 0 } } };
+
+static void init_tables(void) {
+    size_t i;
+    for (i = 0; i < 256; i++) {
+        const double h = i * 6.0 / 256.0;
+        const int sector = (int)h;
+        const uint8_t up = lround((h - sector) * 255.0);
+        const uint8_t down = 255 - up;
+        bs_color_t* c = tables.hue + i;
+        tables.wave[i] = lround((1.0 - cos(i * 2.0 * M_PI / 256.0)) * 127.5);
+        /* Red to yellow, green, cyan, blue, magenta and back to red */
+        c->red = sector == 0 || sector == 5 ? 255 :
+            (sector == 1 ? down : (sector == 4 ? up : 0));
+        c->green = sector == 1 || sector == 2 ? 255 :
+            (sector == 0 ? up : (sector == 3 ? down : 0));
+        c->blue = sector == 3 || sector == 4 ? 255 :
+            (sector == 2 ? up : (sector == 5 ? down : 0));
+    }
+}
+
+/* Leds handled at a time by effects that compute a level per led */
+#define CHUNK 64
+
+/* c scaled by level, 255 keeps c as it is */
+static uint8_t scale(uint8_t c, uint32_t level) {
+    return (c * level + 255) >> 8;
+}
+
+/* Set count leds to color scaled by the level of each */
+static void apply(bs_color_t* frame, bs_color_t color, const uint8_t* level,
+                  size_t count) BS_NONULL;
+
+void apply(bs_color_t* frame, bs_color_t color, const uint8_t* level,
+           size_t count) {
+    size_t i;
+    for (i = 0; i < count; i++) {
+        frame[i].red = scale(color.red, level[i]);
+        frame[i].green = scale(color.green, level[i]);
+        frame[i].blue = scale(color.blue, level[i]);
+    }
+}
+
+static void render_rainbow(const bs_effect_t* effect, uint32_t phase,
+                           bs_color_t* frame, size_t count) BS_NONULL;
+
+void render_rainbow(const bs_effect_t* effect, uint32_t phase,
+                    bs_color_t* frame, size_t count) {
+    const size_t span = effect->size ? effect->size : count;
+    /* Hue step between leds as 16.8 fixed point */
+    const uint32_t step = (1u << 24) / span;
+    size_t i;
+    for (i = 0; i < count; i++) {
+        const uint32_t hue = (phase + ((i * step) >> 8)) & 0xffff;
+        frame[i] = tables.hue[hue >> 8];
+    }
+}
+
+static void render_breathe(const bs_effect_t* effect, uint32_t phase,
+                           bs_color_t* frame, size_t count) BS_NONULL;
+
+void render_breathe(const bs_effect_t* effect, uint32_t phase,
+                    bs_color_t* frame, size_t count) {
+    const uint32_t level = tables.wave[phase >> 8];
+    bs_color_t color;
+    size_t i;
+    color.red = scale(effect->color.red, level);
+    color.green = scale(effect->color.green, level);
+    color.blue = scale(effect->color.blue, level);
+    for (i = 0; i < count; i++) frame[i] = color;
+}
+
+static void render_chase(const bs_effect_t* effect, uint32_t phase,
+                         bs_color_t* frame, size_t count) BS_NONULL;
+
+void render_chase(const bs_effect_t* effect, uint32_t phase,
+                  bs_color_t* frame, size_t count) {
+    const size_t size = effect->size ? effect->size : 1;
+    /* Position of the lit led in each group of size, 8.8 fixed point */
+    const uint32_t pos = ((uint64_t)phase * size) >> 8;
+    const size_t lit = pos >> 8, next = (lit + 1) % size;
+    const uint32_t fraction = pos & 0xff;
+    bs_color_t first, second;
+    size_t i;
+    /* Split between the two leds closest to the position, with a size of
+     * one both are the same led */
+    first.red = scale(effect->color.red, 255 - fraction);
+    first.green = scale(effect->color.green, 255 - fraction);
+    first.blue = scale(effect->color.blue, 255 - fraction);
+    second.red = scale(effect->color.red, fraction);
+    second.green = scale(effect->color.green, fraction);
+    second.blue = scale(effect->color.blue, fraction);
+    if (size == 1) {
+        for (i = 0; i < count; i++) frame[i] = effect->color;
+        return;
+    }
+    memset(frame, 0, count * sizeof(bs_color_t));
+    for (i = 0; i < count; i += size) {
+        if (i + lit < count) frame[i + lit] = first;
+        if (i + next < count) frame[i + next] = second;
+    }
+}
+
+/* Length of the comet tail in leds, at least 1 and small enough to be
+ * shifted into 1/256 leds in an int32_t */
+static uint32_t comet_size(uint32_t size);
+
+uint32_t comet_size(uint32_t size) {
+    if (size == 0) return 1;
+    return size < (1u << 22) ? size : (1u << 22);
+}
+
+static void render_comet(const bs_effect_t* effect, uint32_t phase,
+                         bs_color_t* frame, size_t count) BS_NONULL;
+
+void render_comet(const bs_effect_t* effect, uint32_t phase,
+                  bs_color_t* frame, size_t count) {
+    const int64_t length = (int64_t)count << 8;
+    const int64_t head = ((uint64_t)phase * count) >> 8;
+    const int32_t tail = (int32_t)(comet_size(effect->size) << 8);
+    /* Level lost per 1/256 led behind the head, 16.16 fixed point */
+    const uint32_t fade = (255u << 16) / tail;
+    /* Distances are only compared to tail, so capping them keeps the math
+     * in 32 bits, which the compiler vectorizes, for any length */
+    const int32_t wrap = length < (1 << 30) ? length : (1 << 30);
+    uint8_t level[CHUNK];
+    size_t first;
+    for (first = 0; first < count; first += CHUNK) {
+        const size_t n = count - first < CHUNK ? count - first : CHUNK;
+        /* Distance behind the head of the first led in chunk */
+        int64_t start = head - ((int64_t)first << 8);
+        int32_t d0;
+        size_t i;
+        start += start < 0 ? length : 0;
+        d0 = start < (1 << 30) ? start : (1 << 30);
+        for (i = 0; i < n; i++) {
+            /* The comet wraps around */
+            int32_t d = d0 - (int32_t)(i << 8);
+            uint32_t l;
+            d += d < 0 ? wrap : 0;
+            l = d < tail ? 255 - (((uint32_t)d * fade) >> 16) : 0;
+            /* Squared so the tail fades out faster than it dims near the
+             * head */
+            level[i] = (l * l + 255) >> 8;
+        }
+        apply(frame + first, effect->color, level, n);
+    }
+}
+
+/* Mix of x to 32 random looking bits */
+static uint32_t hash(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+static void render_sparkle(const bs_effect_t* effect, uint64_t cycles,
+                           bs_color_t* frame, size_t count) BS_NONULL;
+
+void render_sparkle(const bs_effect_t* effect, uint64_t cycles,
+                    bs_color_t* frame, size_t count) {
+    const uint32_t chance = effect->size >= 1000 ? 0x10000 :
+        ((uint32_t)effect->size << 16) / 1000;
+    const uint32_t cycle = cycles >> 16, phase = cycles & 0xffff;
+    uint8_t level[CHUNK];
+    size_t first;
+    for (first = 0; first < count; first += CHUNK) {
+        const size_t n = count - first < CHUNK ? count - first : CHUNK;
+        uint32_t i;
+        for (i = 0; i < n; i++) {
+            const uint32_t id = hash(effect->seed ^
+                                     ((uint32_t)first + i) * 0x9e3779b9);
+            /* Each led starts its cycles at its own time so they do not
+             * all change together */
+            const uint32_t t = phase + (id & 0xffff);
+            const uint32_t roll = hash(id ^ (cycle + (t >> 16)));
+            const uint32_t l = 255 - ((t & 0xffff) >> 8);
+            level[i] = (roll & 0xffff) < chance ? (l * l + 255) >> 8 : 0;
+        }
+        apply(frame + first, effect->color, level, n);
+    }
+}
+
+void bs_effect_render(const bs_effect_t* effect, uint64_t time_us,
+                      bs_color_t* frame, size_t count) {
+    const uint64_t period_us = (uint64_t)effect->period_ms * 1000;
+    uint64_t cycles = 0;  /* Cycles since time 0, 48.16 fixed point */
+    uint32_t phase;
+    if (count == 0) return;
+    pthread_once(&tables.once, init_tables);
+    if (period_us > 0) {
+        cycles = ((time_us / period_us) << 16) +
+            ((time_us % period_us) << 16) / period_us;
+    }
+    phase = cycles & 0xffff;
+    switch (effect->type) {
+    case BS_EFFECT_RAINBOW:
+        render_rainbow(effect, phase, frame, count);
+        return;
+    case BS_EFFECT_BREATHE:
+        render_breathe(effect, phase, frame, count);
+        return;
+    case BS_EFFECT_CHASE:
+        render_chase(effect, phase, frame, count);
+        return;
+    case BS_EFFECT_COMET:
+        render_comet(effect, phase, frame, count);
+        return;
+    case BS_EFFECT_SPARKLE:
+        render_sparkle(effect, cycles, frame, count);
+        return;
+    }
+    memset(frame, 0, count * sizeof(bs_color_t));
+}
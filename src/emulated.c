@@ -0,0 +1,382 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "extra_compiler_stuff.h"
+#include "libbs_private.h"
+
+#include <libusb.h>
+
+typedef struct emulated_transfer_t emulated_transfer_t;
+typedef struct emulated_t emulated_t;
+
+struct emulated_t {
+    emulated_t* prev;  /* All emulated devices, protected by emul.lock */
+    emulated_t* next;
+    pthread_mutex_t lock;  /* Protects everything below */
+    emulated_transfer_t* queue;  /* Pending transfers ordered by due time */
+    bs_emulated_type_t type;
+    unsigned int latency_us;
+    unsigned int fail_every;
+    unsigned int fail_permille;
+    bs_error_t fail_error;
+    uint32_t rand;
+    unsigned long requests;
+    int64_t busy_until;  /* When the last queued request is done */
+    uint8_t mode;
+    uint8_t channels;
+    uint8_t leds;  /* Per channel */
+    bs_color_t color[3][64];
+};
+
+struct emulated_transfer_t {
+    bs_transfer_t* transfer;
+    emulated_transfer_t* next;
+    int64_t due;
+    bool cancelled;
+    bool timed_out;
+    bs_error_t error;
+};
+
+/* Each device has its own queue so threads using different devices never
+ * wait for each other, the list of devices is only needed when handling
+ * events for all devices */
+static struct {
+    pthread_mutex_t lock;
+    emulated_t* devices;
+    unsigned int serial;
+} emul = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+
+static const bs_transport_t emulated_transport;
+
+static void set_config(emulated_t* emu, const bs_emulated_config_t* config) {
+    emu->latency_us = config->latency_us;
+    emu->fail_every = config->fail_every;
+    emu->fail_permille = config->fail_permille;
+    emu->fail_error = config->fail_error == BS_NO_ERROR ?
+        BS_ERROR_IO : config->fail_error;
+    emu->rand = config->seed;
+}
+
+bs_device_t* bs_open_emulated(const bs_emulated_config_t* config,
+                              bs_error_t* error) {
+    char serial[32];
+    emulated_t* emu;
+    bs_device_t* dev;
+    switch (config->type) {
+    case BS_EMULATED_BASIC:
+    case BS_EMULATED_PRO:
+    case BS_EMULATED_STRIP:
+        break;
+    default:
+        if (error) *error = BS_ERROR_INVALID_PARAM;
+        return NULL;
+    }
+    emu = calloc(1, sizeof(emulated_t));
+    if (!emu) {
+        if (error) *error = BS_ERROR_NO_MEM;
+        return NULL;
+    }
+    emu->type = config->type;
+    set_config(emu, config);
+    switch (emu->type) {
+    case BS_EMULATED_BASIC:
+        emu->mode = BS_MODE_NORMAL;
+        emu->channels = 1;
+        emu->leds = 1;
+        break;
+    case BS_EMULATED_PRO:
+        emu->mode = BS_MODE_NORMAL;
+        emu->channels = 3;
+        emu->leds = 64;
+        break;
+    case BS_EMULATED_STRIP:
+        emu->mode = BS_MODE_MULTI;
+        emu->channels = 1;
+        emu->leds = 8;
+        break;
+    }
+    if (!config->serial) {
+        unsigned int num;
+        pthread_mutex_lock(&emul.lock);
+        num = ++emul.serial;
+        pthread_mutex_unlock(&emul.lock);
+        snprintf(serial, sizeof(serial), "BS%06u-%d.0", num, (int)emu->type);
+    }
+    dev = device_new(&emulated_transport, emu,
+                     config->serial ? config->serial : serial,
+                     (bs_version_t)emu->type);
+    if (!dev) {
+        free(emu);
+        if (error) *error = BS_ERROR_NO_MEM;
+        return NULL;
+    }
+    pthread_mutex_init(&emu->lock, NULL);
+    pthread_mutex_lock(&emul.lock);
+    emu->next = emul.devices;
+    if (emu->next) emu->next->prev = emu;
+    emul.devices = emu;
+    pthread_mutex_unlock(&emul.lock);
+    if (error) *error = BS_NO_ERROR;
+    return dev;
+}
+
+bool bs_emulated_configure(bs_device_t* device,
+                           const bs_emulated_config_t* config) {
+    emulated_t* emu = device->priv;
+    if (device->transport != &emulated_transport) {
+        device->last_error = BS_ERROR_NOT_SUPPORTED;
+        return false;
+    }
+    pthread_mutex_lock(&emu->lock);
+    set_config(emu, config);
+    pthread_mutex_unlock(&emu->lock);
+    return true;
+}
+
+static bool emulated_fail(emulated_t* emu) {
+    emu->requests++;
+    if (emu->fail_every && emu->requests % emu->fail_every == 0) return true;
+    if (emu->fail_permille) {
+        emu->rand = emu->rand * 1103515245 + 12345;
+        return (emu->rand >> 16) % 1000 < emu->fail_permille;
+    }
+    return false;
+}
+
+/* Handle request like the firmware would */
+static bs_error_t emulated_process(emulated_t* emu, bs_transfer_t* t) {
+    const bool in = t->request_type & LIBUSB_ENDPOINT_IN;
+    const uint8_t report = t->value & 0xff;
+    uint8_t* data = t->data;
+    uint8_t count;
+    bs_color_t* color;
+    if (emulated_fail(emu)) return emu->fail_error;
+    if (emu->type == BS_EMULATED_BASIC && report != 1) return BS_ERROR_PIPE;
+    switch (report) {
+    case 1:
+        if (t->length != 4) return BS_ERROR_PIPE;
+        color = &emu->color[0][0];
+        if (in) {
+            data[0] = 1;
+            data[1] = color->red;
+            data[2] = color->green;
+            data[3] = color->blue;
+        } else {
+            color->red = data[1];
+            color->green = data[2];
+            color->blue = data[3];
+        }
+        return BS_NO_ERROR;
+    case 4:
+        if (t->length != 2) return BS_ERROR_PIPE;
+        if (in) {
+            data[0] = 4;
+            data[1] = emu->mode;
+            return BS_NO_ERROR;
+        }
+        if (emu->type == BS_EMULATED_PRO ?
+            data[1] > BS_MODE_MULTI :
+            data[1] < BS_MODE_MULTI || data[1] > BS_MODE_REPEAT) {
+            return BS_ERROR_PIPE;
+        }
+        emu->mode = data[1];
+        return BS_NO_ERROR;
+    case 5:
+        if (in || t->length != 6) return BS_ERROR_PIPE;
+        if (data[1] >= emu->channels || data[2] >= emu->leds) {
+            return BS_ERROR_PIPE;
+        }
+        color = &emu->color[data[1]][data[2]];
+        color->red = data[3];
+        color->green = data[4];
+        color->blue = data[5];
+        return BS_NO_ERROR;
+    case 6:
+    case 7:
+    case 8:
+    case 9:
+        count = 8 << (report - 6);
+        if (t->length != 2 + count * 3) return BS_ERROR_PIPE;
+        if (in) {
+            data[0] = report;
+            data[1] = 0;
+            color = emu->color[0];
+            memset(data + 2, 0, count * 3);
+        } else {
+            if (data[1] >= emu->channels) return BS_ERROR_PIPE;
+            color = emu->color[data[1]];
+        }
+        if (count > emu->leds) count = emu->leds;
+        if (in) {
+            bs_pack_grb(data + 2, color, count);
+        } else {
+            bs_unpack_grb(color, data + 2, count);
+        }
+        return BS_NO_ERROR;
+    }
+    return BS_ERROR_PIPE;
+}
+
+static bool emulated_alloc(bs_device_t* device UNUSED, bs_transfer_t* t) {
+    emulated_transfer_t* et = malloc(sizeof(emulated_transfer_t) + t->length);
+    if (!et) return false;
+    et->transfer = t;
+    t->priv = et;
+    t->data = (uint8_t*)(et + 1);
+    return true;
+}
+
+static void emulated_free(bs_transfer_t* t) {
+    free(t->priv);
+}
+
+static bs_error_t emulated_submit(bs_device_t* device, bs_transfer_t* t) {
+    emulated_t* emu = device->priv;
+    emulated_transfer_t* et = t->priv;
+    emulated_transfer_t** pos;
+    int64_t now = bs_now_us();
+    /* Transfers owned by frames are submitted many times */
+    et->next = NULL;
+    et->cancelled = false;
+    et->timed_out = false;
+    pthread_mutex_lock(&emu->lock);
+    /* Requests are handled one at a time by the device */
+    et->due = (emu->busy_until > now ? emu->busy_until : now) +
+        emu->latency_us;
+    if (t->timeout_ms && et->due - now > (int64_t)t->timeout_ms * 1000) {
+        /* Give up before the device gets to it, like libusb would */
+        et->due = now + (int64_t)t->timeout_ms * 1000;
+        et->timed_out = true;
+    } else {
+        emu->busy_until = et->due;
+    }
+    for (pos = &emu->queue; *pos && (*pos)->due <= et->due;
+         pos = &(*pos)->next) {
+    }
+    et->next = *pos;
+    *pos = et;
+    pthread_mutex_unlock(&emu->lock);
+    return BS_NO_ERROR;
+}
+
+static void emulated_cancel(bs_device_t* device, bs_transfer_t* t) {
+    emulated_t* emu = device->priv;
+    emulated_transfer_t* et = t->priv;
+    emulated_transfer_t** pos;
+    pthread_mutex_lock(&emu->lock);
+    /* Move first in queue so it is completed on the next dispatch */
+    for (pos = &emu->queue; *pos; pos = &(*pos)->next) {
+        if (*pos == et) {
+            *pos = et->next;
+            et->cancelled = true;
+            et->due = 0;
+            et->next = emu->queue;
+            emu->queue = et;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&emu->lock);
+}
+
+static bool emulated_reconnect(bs_device_t* device UNUSED) {
+    /* Emulated devices are always plugged back in */
+    return true;
+}
+
+static void emulated_close(bs_device_t* device) {
+    emulated_t* emu = device->priv;
+    pthread_mutex_lock(&emul.lock);
+    if (emu->prev) {
+        emu->prev->next = emu->next;
+    } else {
+        emul.devices = emu->next;
+    }
+    if (emu->next) emu->next->prev = emu->prev;
+    pthread_mutex_unlock(&emul.lock);
+    pthread_mutex_destroy(&emu->lock);
+    free(emu);
+}
+
+int64_t emulated_next_due(bs_device_t* device) {
+    emulated_t* emu;
+    int64_t due = -1;
+    if (device) {
+        if (device->transport != &emulated_transport) return -1;
+        emu = device->priv;
+        pthread_mutex_lock(&emu->lock);
+        due = emu->queue ? emu->queue->due : -1;
+        pthread_mutex_unlock(&emu->lock);
+        return due;
+    }
+    pthread_mutex_lock(&emul.lock);
+    for (emu = emul.devices; emu; emu = emu->next) {
+        pthread_mutex_lock(&emu->lock);
+        if (emu->queue && (due < 0 || emu->queue->due < due)) {
+            due = emu->queue->due;
+        }
+        pthread_mutex_unlock(&emu->lock);
+    }
+    pthread_mutex_unlock(&emul.lock);
+    return due;
+}
+
+/* Move all due transfers from emu to the end of the done list */
+static emulated_transfer_t** take_due(emulated_t* emu, int64_t now,
+                                      emulated_transfer_t** last) BS_NONULL;
+
+emulated_transfer_t** take_due(emulated_t* emu, int64_t now,
+                               emulated_transfer_t** last) {
+    pthread_mutex_lock(&emu->lock);
+    while (emu->queue && emu->queue->due <= now) {
+        emulated_transfer_t* et = emu->queue;
+        emu->queue = et->next;
+        if (et->cancelled) {
+            et->error = BS_ERROR_CANCELLED;
+        } else if (et->timed_out) {
+            et->error = BS_ERROR_TIMEOUT;
+        } else {
+            et->error = emulated_process(emu, et->transfer);
+        }
+        et->next = NULL;
+        *last = et;
+        last = &et->next;
+    }
+    pthread_mutex_unlock(&emu->lock);
+    return last;
+}
+
+void emulated_dispatch(bs_device_t* device) {
+    emulated_transfer_t* done = NULL;
+    const int64_t now = bs_now_us();
+    if (device) {
+        if (device->transport != &emulated_transport) return;
+        take_due(device->priv, now, &done);
+    } else {
+        emulated_transfer_t** last = &done;
+        emulated_t* emu;
+        pthread_mutex_lock(&emul.lock);
+        for (emu = emul.devices; emu; emu = emu->next) {
+            last = take_due(emu, now, last);
+        }
+        pthread_mutex_unlock(&emul.lock);
+    }
+    /* Without any locks held as callbacks might close devices */
+    while (done) {
+        emulated_transfer_t* et = done;
+        done = et->next;
+        transfer_done(et->transfer, et->error);
+    }
+}
+
+static const bs_transport_t emulated_transport = {
+    emulated_alloc,
+    emulated_free,
+    emulated_submit,
+    emulated_cancel,
+    emulated_reconnect,
+    emulated_close,
+};
@@ -0,0 +1,193 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+
+#include "libbs_private.h"
+
+typedef struct member_t {
+    bs_device_t* device;
+    segments_t segments;
+    power_range_t ranges[3];
+    size_t range_count;
+    bool started;
+    bs_error_t error;
+} member_t;
+
+struct bs_group_t {
+    member_t* member;
+    size_t size, alloc;
+    bs_group_frame_t* frames;  /* Used by bs_group_set_all(), alloc long */
+    bs_power_pool_t* power;  /* Shared by all members, NULL if no budget */
+};
+
+bs_group_t* bs_group_new(bs_error_t* error) {
+    bs_group_t* group = calloc(1, sizeof(bs_group_t));
+    if (error) *error = group ? BS_NO_ERROR : BS_ERROR_NO_MEM;
+    return group;
+}
+
+void bs_group_free(bs_group_t* group) {
+    if (!group) return;
+    bs_group_set_power_budget(group, NULL);
+    free(group->member);
+    free(group->frames);
+    free(group);
+}
+
+bool bs_group_add(bs_group_t* group, bs_device_t* device) {
+    if (group->size == group->alloc) {
+        size_t na = group->alloc ? group->alloc * 2 : 8;
+        bs_group_frame_t* frames;
+        member_t* tmp;
+        /* A larger frames is harmless if member can not grow */
+        frames = realloc(group->frames, na * sizeof(bs_group_frame_t));
+        if (!frames) return false;
+        group->frames = frames;
+        tmp = realloc(group->member, na * sizeof(member_t));
+        if (!tmp) return false;
+        group->member = tmp;
+        group->alloc = na;
+    }
+    group->member[group->size++].device = device;
+    if (group->power) {
+        power_switch(device, device->own_power, group->power);
+    }
+    return true;
+}
+
+bool bs_group_set_power_budget(bs_group_t* group, const bs_power_t* power) {
+    bs_power_pool_t* pool = group->power;
+    size_t i;
+    if (power) {
+        if (pool) {
+            power_pool_configure(pool, power);
+            return true;
+        }
+        pool = power_pool_new(power);
+        if (!pool) return false;
+        group->power = pool;
+        for (i = 0; i < group->size; i++) {
+            bs_device_t* device = group->member[i].device;
+            power_switch(device, device->own_power, pool);
+        }
+        return true;
+    }
+    if (!pool) return true;
+    for (i = 0; i < group->size; i++) {
+        bs_device_t* device = group->member[i].device;
+        /* Device might have been added twice */
+        if (device->group_power == pool) {
+            power_switch(device, device->own_power, NULL);
+        }
+    }
+    group->power = NULL;
+    power_pool_free(pool);
+    return true;
+}
+
+uint32_t bs_group_power_estimate(const bs_group_t* group) {
+    return group->power ? power_estimate(group->power) : 0;
+}
+
+size_t bs_group_size(const bs_group_t* group) {
+    return group->size;
+}
+
+bs_device_t* bs_group_device(const bs_group_t* group, size_t index) {
+    return index < group->size ? group->member[index].device : NULL;
+}
+
+/* Scale the frames of all started members to fit the group budget
+ * together, the same scale is used for all so the frame keeps its look */
+static void group_limit(bs_group_t* group) BS_NONULL;
+
+void group_limit(bs_group_t* group) {
+    bs_power_pool_t* pool = group->power;
+    uint32_t old = 0, requested = 0, scale;
+    size_t i;
+    for (i = 0; i < group->size; i++) {
+        member_t* m = group->member + i;
+        m->range_count = m->started ?
+            power_ranges(&m->segments, m->ranges) : 0;
+    }
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < group->size; i++) {
+        member_t* m = group->member + i;
+        power_sums(m->device, m->ranges, m->range_count, &old, &requested);
+    }
+    scale = power_scale(pool, old, requested);
+    for (i = 0; i < group->size; i++) {
+        member_t* m = group->member + i;
+        pool->total += power_apply(m->device, m->ranges, m->range_count,
+                                   scale);
+    }
+    pool->total -= old;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* First error in segments, device->last_error if none */
+static bs_error_t member_error(member_t* member) BS_NONULL;
+
+bs_error_t member_error(member_t* member) {
+    size_t i;
+    for (i = 0; i < member->segments.count; i++) {
+        if (member->segments.error[i] != BS_NO_ERROR) {
+            return member->segments.error[i];
+        }
+    }
+    return member->device->last_error;
+}
+
+bool bs_group_set(bs_group_t* group, const bs_group_frame_t* frames,
+                  bs_error_t* results) {
+    bs_segment_t tmp[3];
+    size_t i;
+    bool ret = true;
+    /* Start all devices first, then wait for them */
+    for (i = 0; i < group->size; i++) {
+        member_t* m = group->member + i;
+        m->started = false;
+        m->error = BS_NO_ERROR;
+        if (frames[i].count == 0) continue;
+        if (!segments_frame(m->device, frames[i].count, frames[i].color,
+                            &m->segments, tmp)) {
+            m->error = m->device->last_error;
+            continue;
+        }
+        if (!group->power) {
+            segments_start(m->device, &m->segments);
+        } else {
+            segments_pack(m->device, &m->segments);
+        }
+        m->started = true;
+    }
+    if (group->power) {
+        group_limit(group);
+        for (i = 0; i < group->size; i++) {
+            member_t* m = group->member + i;
+            if (m->started) segments_send(m->device, &m->segments);
+        }
+    }
+    for (i = 0; i < group->size; i++) {
+        member_t* m = group->member + i;
+        if (m->started && !segments_finish(m->device, &m->segments)) {
+            m->error = member_error(m);
+        }
+        if (m->error != BS_NO_ERROR) ret = false;
+        if (results) results[i] = m->error;
+    }
+    return ret;
+}
+
+bool bs_group_set_all(bs_group_t* group, size_t count,
+                      const bs_color_t* color, bs_error_t* results) {
+    size_t i;
+    if (group->size == 0) return true;
+    for (i = 0; i < group->size; i++) {
+        group->frames[i].count = count;
+        group->frames[i].color = color;
+    }
+    return bs_group_set(group, group->frames, results);
+}
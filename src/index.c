@@ -0,0 +1,540 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <string.h>
+
+#include "extra_compiler_stuff.h"
+#include "libbs_private.h"
+
+typedef struct entry_t entry_t;
+
+struct entry_t {
+    entry_t* next;
+    uint8_t bus;
+    uint8_t address;
+    char serial[];
+};
+
+typedef struct event_t event_t;
+
+struct event_t {
+    event_t* next;
+    libusb_device* device;  /* Referenced, only for arrivals */
+    libusb_hotplug_event event;
+    uint8_t bus;
+    uint8_t address;
+    unsigned int tries;  /* Failed attempts to open an arrival */
+    int64_t due_us;  /* When to try again, if tries > 0 */
+};
+
+/* A device that can not be opened when it arrives, for example as udev has
+ * not set its permissions yet, is tried again after RETRY_MS and then with
+ * the delay doubled each time, at most RETRIES times */
+#define RETRY_MS 100
+#define RETRIES 8
+
+typedef struct subscriber_t subscriber_t;
+
+struct subscriber_t {
+    subscriber_t* next;
+    int id;
+    bs_hotplug_callback_t callback;
+    void* userdata;
+};
+
+static struct {
+    pthread_mutex_t control;  /* Held while starting or stopping */
+    pthread_mutex_t lock;  /* Protects everything but subscribers */
+    pthread_mutex_t notify;  /* Protects subscribers, held while notifying */
+    bool running;
+    bool stop;
+    pthread_t thread;
+    libusb_context* ctx;
+    libusb_hotplug_callback_handle hotplug;
+    entry_t** bucket;
+    size_t buckets;  /* Always a power of two */
+    size_t entries;
+    event_t* events;  /* Hotplug events not yet handled */
+    event_t** last_event;
+    event_t* retries;  /* Arrivals to try again, only used by handle_events */
+    subscriber_t* subscribers;
+    int next_id;
+} idx = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+          PTHREAD_MUTEX_INITIALIZER, false, false, 0, NULL, 0, NULL, 0, 0,
+          NULL, NULL, NULL, NULL, 1 };
+
+static size_t hash(const char* str) BS_NONULL;
+
+size_t hash(const char* str) {
+    /* FNV-1a */
+    size_t h = 2166136261u;
+    for (; *str; str++) {
+        h ^= (uint8_t)*str;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Return the position of the entry with serial, or where it should go */
+static entry_t** find_entry(const char* serial) BS_NONULL;
+
+entry_t** find_entry(const char* serial) {
+    entry_t** pos = idx.bucket + (hash(serial) & (idx.buckets - 1));
+    while (*pos && strcmp((*pos)->serial, serial) != 0) pos = &(*pos)->next;
+    return pos;
+}
+
+static void grow_buckets(void) {
+    const size_t nb = idx.buckets * 2;
+    entry_t** tmp = calloc(nb, sizeof(entry_t*));
+    size_t i;
+    if (!tmp) return;  /* Keep using the old, longer chains */
+    for (i = 0; i < idx.buckets; i++) {
+        while (idx.bucket[i]) {
+            entry_t* e = idx.bucket[i];
+            entry_t** pos = tmp + (hash(e->serial) & (nb - 1));
+            idx.bucket[i] = e->next;
+            e->next = *pos;
+            *pos = e;
+        }
+    }
+    free(idx.bucket);
+    idx.bucket = tmp;
+    idx.buckets = nb;
+}
+
+/* Add or update entry for serial, return false if out of memory */
+static bool add_entry(const char* serial, uint8_t bus, uint8_t address)
+    BS_NONULL;
+
+bool add_entry(const char* serial, uint8_t bus, uint8_t address) {
+    entry_t** pos;
+    entry_t* e;
+    size_t len;
+    pthread_mutex_lock(&idx.lock);
+    pos = find_entry(serial);
+    if (*pos) {
+        (*pos)->bus = bus;
+        (*pos)->address = address;
+        pthread_mutex_unlock(&idx.lock);
+        return true;
+    }
+    len = strlen(serial);
+    e = malloc(sizeof(entry_t) + len + 1);
+    if (!e) {
+        pthread_mutex_unlock(&idx.lock);
+        return false;
+    }
+    e->next = NULL;
+    e->bus = bus;
+    e->address = address;
+    memcpy(e->serial, serial, len + 1);
+    *pos = e;
+    if (++idx.entries > idx.buckets) grow_buckets();
+    pthread_mutex_unlock(&idx.lock);
+    return true;
+}
+
+/* Remove entry at bus and address, return it or NULL if not found */
+static entry_t* remove_entry(uint8_t bus, uint8_t address) {
+    size_t i;
+    pthread_mutex_lock(&idx.lock);
+    /* Removals are rare, not worth keeping a second table for */
+    for (i = 0; i < idx.buckets; i++) {
+        entry_t** pos;
+        for (pos = idx.bucket + i; *pos; pos = &(*pos)->next) {
+            if ((*pos)->bus == bus && (*pos)->address == address) {
+                entry_t* e = *pos;
+                *pos = e->next;
+                idx.entries--;
+                pthread_mutex_unlock(&idx.lock);
+                return e;
+            }
+        }
+    }
+    pthread_mutex_unlock(&idx.lock);
+    return NULL;
+}
+
+static void notify(const char* serial, bs_hotplug_event_t event) BS_NONULL;
+
+void notify(const char* serial, bs_hotplug_event_t event) {
+    subscriber_t* s;
+    pthread_mutex_lock(&idx.notify);
+    for (s = idx.subscribers; s; s = s->next) {
+        s->callback(serial, event, s->userdata);
+    }
+    pthread_mutex_unlock(&idx.notify);
+}
+
+static int LIBUSB_CALL hotplug_callback(libusb_context* ctx UNUSED,
+                                        libusb_device* device,
+                                        libusb_hotplug_event event,
+                                        void* userdata UNUSED) {
+    /* Can't do any requests from here so queue for the index thread */
+    event_t* ev = malloc(sizeof(event_t));
+    if (!ev) return 0;
+    ev->next = NULL;
+    ev->tries = 0;
+    ev->due_us = 0;
+    ev->event = event;
+    ev->bus = libusb_get_bus_number(device);
+    ev->address = libusb_get_device_address(device);
+    ev->device = event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ?
+        libusb_ref_device(device) : NULL;
+    pthread_mutex_lock(&idx.lock);
+    *idx.last_event = ev;
+    idx.last_event = &ev->next;
+    pthread_mutex_unlock(&idx.lock);
+    return 0;
+}
+
+/* Drop retries for the device at bus and address */
+static void drop_retries(uint8_t bus, uint8_t address) {
+    event_t** pos = &idx.retries;
+    while (*pos) {
+        event_t* ev = *pos;
+        if (ev->bus == bus && ev->address == address) {
+            *pos = ev->next;
+            libusb_unref_device(ev->device);
+            free(ev);
+        } else {
+            pos = &ev->next;
+        }
+    }
+}
+
+/* Handle ev, returns false if ev was kept to be tried again */
+static bool handle_event(event_t* ev) BS_NONULL;
+
+bool handle_event(event_t* ev) {
+    if (ev->device) {
+        char serial[256];
+        libusb_device_handle* handle;
+        bs_error_t error = BS_NO_ERROR;
+        handle = usb_open_serial(ev->device, serial, sizeof(serial), &error);
+        if (!handle) {
+            /* No error means it is not a BlinkStick */
+            if (error != BS_NO_ERROR && ev->tries < RETRIES) {
+                ev->due_us = bs_now_us() +
+                    (int64_t)(RETRY_MS << ev->tries) * 1000;
+                ev->tries++;
+                ev->next = idx.retries;
+                idx.retries = ev;
+                return false;
+            }
+            libusb_unref_device(ev->device);
+            return true;
+        }
+        libusb_unref_device(ev->device);
+        libusb_close(handle);
+        if (add_entry(serial, ev->bus, ev->address)) {
+            notify(serial, BS_HOTPLUG_ARRIVED);
+        }
+    } else {
+        entry_t* e;
+        drop_retries(ev->bus, ev->address);
+        e = remove_entry(ev->bus, ev->address);
+        if (!e) return true;
+        notify(e->serial, BS_HOTPLUG_LEFT);
+        free(e);
+    }
+    return true;
+}
+
+/* Queue the retries that are due as events again */
+static void queue_retries(void) {
+    const int64_t now = bs_now_us();
+    event_t** pos = &idx.retries;
+    while (*pos) {
+        event_t* ev = *pos;
+        if (ev->due_us <= now) {
+            *pos = ev->next;
+            ev->next = NULL;
+            pthread_mutex_lock(&idx.lock);
+            *idx.last_event = ev;
+            idx.last_event = &ev->next;
+            pthread_mutex_unlock(&idx.lock);
+        } else {
+            pos = &ev->next;
+        }
+    }
+}
+
+/* Handle all queued events, returns false if stop was requested */
+static bool handle_events(void) {
+    for (;;) {
+        event_t* ev;
+        pthread_mutex_lock(&idx.lock);
+        if (idx.stop) {
+            pthread_mutex_unlock(&idx.lock);
+            return false;
+        }
+        ev = idx.events;
+        if (ev) {
+            idx.events = ev->next;
+            if (!idx.events) idx.last_event = &idx.events;
+        }
+        pthread_mutex_unlock(&idx.lock);
+        if (!ev) return true;
+        if (handle_event(ev)) free(ev);
+    }
+}
+
+static void* index_thread(void* arg UNUSED) {
+    while (handle_events()) {
+        struct timeval tv;
+        queue_retries();
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        libusb_handle_events_timeout_completed(idx.ctx, &tv, NULL);
+    }
+    return NULL;
+}
+
+/* Free everything, the index thread must not be running */
+static void free_index(void) {
+    size_t i;
+    pthread_mutex_lock(&idx.lock);
+    while (idx.events) {
+        event_t* ev = idx.events;
+        idx.events = ev->next;
+        if (ev->device) libusb_unref_device(ev->device);
+        free(ev);
+    }
+    idx.last_event = &idx.events;
+    while (idx.retries) {
+        event_t* ev = idx.retries;
+        idx.retries = ev->next;
+        libusb_unref_device(ev->device);
+        free(ev);
+    }
+    for (i = 0; i < idx.buckets; i++) {
+        while (idx.bucket[i]) {
+            entry_t* e = idx.bucket[i];
+            idx.bucket[i] = e->next;
+            free(e);
+        }
+    }
+    free(idx.bucket);
+    idx.bucket = NULL;
+    idx.buckets = idx.entries = 0;
+    pthread_mutex_unlock(&idx.lock);
+    pthread_mutex_lock(&idx.notify);
+    while (idx.subscribers) {
+        subscriber_t* s = idx.subscribers;
+        idx.subscribers = s->next;
+        free(s);
+    }
+    pthread_mutex_unlock(&idx.notify);
+}
+
+static bool is_running(void) {
+    bool running;
+    pthread_mutex_lock(&idx.lock);
+    running = idx.running;
+    pthread_mutex_unlock(&idx.lock);
+    return running;
+}
+
+static bool index_start(bs_error_t* error);
+
+bool bs_index_start(bs_error_t* error) {
+    bool ret = true;
+    if (error) *error = BS_NO_ERROR;
+    pthread_mutex_lock(&idx.control);
+    if (!is_running()) ret = index_start(error);
+    pthread_mutex_unlock(&idx.control);
+    return ret;
+}
+
+/* Start the index, idx.control must be held */
+bool index_start(bs_error_t* error) {
+    entry_t** bucket;
+    int ret;
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        if (error) *error = BS_ERROR_NOT_SUPPORTED;
+        return false;
+    }
+    bucket = calloc(16, sizeof(entry_t*));
+    if (!bucket) {
+        if (error) *error = BS_ERROR_NO_MEM;
+        return false;
+    }
+    pthread_mutex_lock(&idx.lock);
+    idx.buckets = 16;
+    idx.bucket = bucket;
+    idx.events = NULL;
+    idx.last_event = &idx.events;
+    idx.stop = false;
+    pthread_mutex_unlock(&idx.lock);
+    /* Own context so hotplug handling never completes library transfers */
+    ret = libusb_init(&idx.ctx);
+    if (ret) {
+        if (error) *error = error_from_libusb(ret);
+        free_index();
+        return false;
+    }
+    /* Connected devices are queued as arrivals during the call */
+    ret = libusb_hotplug_register_callback(
+        idx.ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+        LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_ENUMERATE,
+        0x20a0, 0x41e5, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL,
+        &idx.hotplug);
+    if (ret) {
+        if (error) *error = error_from_libusb(ret);
+        libusb_exit(idx.ctx);
+        free_index();
+        return false;
+    }
+    handle_events();
+    if (pthread_create(&idx.thread, NULL, index_thread, NULL)) {
+        if (error) *error = BS_ERROR_NO_MEM;
+        libusb_hotplug_deregister_callback(idx.ctx, idx.hotplug);
+        libusb_exit(idx.ctx);
+        free_index();
+        return false;
+    }
+    pthread_mutex_lock(&idx.lock);
+    idx.running = true;
+    pthread_mutex_unlock(&idx.lock);
+    return true;
+}
+
+void bs_index_stop(void) {
+    pthread_mutex_lock(&idx.control);
+    pthread_mutex_lock(&idx.lock);
+    if (!idx.running) {
+        pthread_mutex_unlock(&idx.lock);
+        pthread_mutex_unlock(&idx.control);
+        return;
+    }
+    /* Lookups fall back to scanning from here on, so nothing but the index
+     * thread uses the table while it is torn down */
+    idx.running = false;
+    idx.stop = true;
+    pthread_mutex_unlock(&idx.lock);
+    libusb_hotplug_deregister_callback(idx.ctx, idx.hotplug);
+    pthread_join(idx.thread, NULL);
+    libusb_exit(idx.ctx);
+    idx.ctx = NULL;
+    free_index();
+    pthread_mutex_unlock(&idx.control);
+}
+
+bool index_lookup(const char* serial, bool* found, uint8_t* bus,
+                  uint8_t* address) {
+    entry_t* e = NULL;
+    pthread_mutex_lock(&idx.lock);
+    if (!idx.running) {
+        pthread_mutex_unlock(&idx.lock);
+        return false;
+    }
+    if (serial) {
+        e = *find_entry(serial);
+    } else {
+        size_t i;
+        for (i = 0; !e && i < idx.buckets; i++) e = idx.bucket[i];
+    }
+    *found = e != NULL;
+    if (e) {
+        *bus = e->bus;
+        *address = e->address;
+    }
+    pthread_mutex_unlock(&idx.lock);
+    return true;
+}
+
+bool index_serials(const char* prefix, char*** serials) {
+    const size_t len = prefix ? strlen(prefix) : 0;
+    size_t i, n = 0;
+    pthread_mutex_lock(&idx.lock);
+    if (!idx.running) {
+        pthread_mutex_unlock(&idx.lock);
+        return false;
+    }
+    *serials = malloc((idx.entries + 1) * sizeof(char*));
+    for (i = 0; *serials && i < idx.buckets; i++) {
+        entry_t* e;
+        for (e = idx.bucket[i]; e; e = e->next) {
+            if (len && strncmp(e->serial, prefix, len) != 0) continue;
+            (*serials)[n] = strdup(e->serial);
+            if ((*serials)[n]) n++;
+        }
+    }
+    if (*serials) (*serials)[n] = NULL;
+    pthread_mutex_unlock(&idx.lock);
+    return true;
+}
+
+bool bs_index_contains(const char* serial) {
+    bool found;
+    uint8_t bus, address;
+    return index_lookup(serial, &found, &bus, &address) && found;
+}
+
+int bs_hotplug_subscribe(bs_hotplug_callback_t callback, void* userdata,
+                         bool enumerate, bs_error_t* error) {
+    subscriber_t* s;
+    s = malloc(sizeof(subscriber_t));
+    if (!s) {
+        if (error) *error = BS_ERROR_NO_MEM;
+        return -1;
+    }
+    s->callback = callback;
+    s->userdata = userdata;
+    /* Hold notify so no events are missed or seen twice while enumerating,
+     * and so bs_index_stop() can not free the subscribers before s is
+     * added */
+    pthread_mutex_lock(&idx.notify);
+    if (!is_running()) {
+        pthread_mutex_unlock(&idx.notify);
+        free(s);
+        if (error) *error = BS_ERROR_INVALID_PARAM;
+        return -1;
+    }
+    if (enumerate) {
+        char** serials;
+        size_t i;
+        if (!index_serials(NULL, &serials)) {
+            /* Stopped since checked */
+            pthread_mutex_unlock(&idx.notify);
+            free(s);
+            if (error) *error = BS_ERROR_INVALID_PARAM;
+            return -1;
+        }
+        if (!serials) {
+            pthread_mutex_unlock(&idx.notify);
+            free(s);
+            if (error) *error = BS_ERROR_NO_MEM;
+            return -1;
+        }
+        /* Call without idx.lock so callback can use bs_index_contains() */
+        for (i = 0; serials[i]; i++) {
+            callback(serials[i], BS_HOTPLUG_ARRIVED, userdata);
+            free(serials[i]);
+        }
+        free(serials);
+    }
+    s->id = idx.next_id++;
+    s->next = idx.subscribers;
+    idx.subscribers = s;
+    pthread_mutex_unlock(&idx.notify);
+    if (error) *error = BS_NO_ERROR;
+    return s->id;
+}
+
+void bs_hotplug_unsubscribe(int id) {
+    subscriber_t** pos;
+    pthread_mutex_lock(&idx.notify);
+    for (pos = &idx.subscribers; *pos; pos = &(*pos)->next) {
+        if ((*pos)->id == id) {
+            subscriber_t* s = *pos;
+            *pos = s->next;
+            free(s);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&idx.notify);
+}
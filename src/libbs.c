@@ -4,24 +4,29 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
 #include <string.h>
+#include <time.h>
 
-#include "libbs.h"
+#include "extra_compiler_stuff.h"
+#include "libbs_private.h"
 
 #include <libusb.h>
 
-static bs_error_t error_from_libusb(ssize_t err);
-
 static struct {
+    pthread_mutex_t lock;  /* Protects all of glob */
     libusb_context* ctx;
     bool forced;
-    long devices;
-} glob;
+    long users;  /* Open devices, calls using ctx and bs_init() */
+} glob = { PTHREAD_MUTEX_INITIALIZER, NULL, false, 0 };
 
-static bool init_glob(bs_error_t* error) {
+/* Create the context if needed, glob.lock must be held */
+static bool init_ctx(bs_error_t* error) {
     if (glob.ctx == NULL) {
         int ret = libusb_init(&glob.ctx);
         if (ret != 0) {
+            glob.ctx = NULL;
             if (error) *error = error_from_libusb(ret);
             return false;
         }
@@ -30,41 +35,85 @@ static bool init_glob(bs_error_t* error) {
     return true;
 }
 
-static void deinit_glob(void) {
-    if (!glob.forced && glob.devices == 0 && glob.ctx) {
+/* Get a reference to the libusb context, creating it if needed.
+ * Release with unref_glob(), returns NULL in case of error */
+static libusb_context* ref_glob(bs_error_t* error) {
+    libusb_context* ctx = NULL;
+    pthread_mutex_lock(&glob.lock);
+    if (init_ctx(error)) {
+        glob.users++;
+        ctx = glob.ctx;
+    }
+    pthread_mutex_unlock(&glob.lock);
+    return ctx;
+}
+
+static void unref_glob(void) {
+    pthread_mutex_lock(&glob.lock);
+    assert(glob.users > 0);
+    if (--glob.users == 0) {
         libusb_exit(glob.ctx);
         glob.ctx = NULL;
     }
+    pthread_mutex_unlock(&glob.lock);
 }
 
-typedef enum {
-    BS_VERSION_UNKOWN = 0,
-    BS_VERSION_BASIC = 1,
-    BS_VERSION_PRO = 2,
-    BS_VERSION_STRIP_SQUARE = 3,
-} bs_version_t;
+struct bs_mailbox_t {
+    pthread_t thread;
+    pthread_cond_t cond;
+    bool running;
+    bool stop;
+    struct {
+        bool full;  /* A frame is waiting to be sent */
+        uint16_t value;
+        uint16_t length;
+        uint8_t data[2 + 64 * 3];
+    } slot[3];  /* One per channel */
+    bs_mailbox_stats_t stats;
+};
 
-struct bs_device_t {
-    libusb_device_handle* handle;
-    char* serial;
-    bs_error_t last_error;
-    int mode;  /* Cached mode, -1 if unknown */
-    bs_version_t version;
+struct bs_reconnect_t {
+    pthread_t thread;
+    pthread_cond_t cond;
+    bool running;  /* Device is being reconnected */
+    bool joinable;  /* Thread has been started and not yet joined */
+    bool stop;
 };
 
+typedef struct usb_device_t {
+    libusb_context* ctx;  /* Referenced as long as the device is open */
+    libusb_device_handle* handle;
+    /* Where the device was last seen */
+    uint8_t bus;
+    uint8_t address;
+    uint8_t ports[7];
+    int port_count;
+} usb_device_t;
+
+static const bs_transport_t usb_transport;
+
 bool bs_init(bs_error_t* error) {
+    bool ret = true;
     if (error) *error = BS_NO_ERROR;
-    if (glob.forced) return true;
-    if (!init_glob(error)) return false;
-    glob.forced = true;
-    return true;
+    pthread_mutex_lock(&glob.lock);
+    if (!glob.forced) {
+        ret = init_ctx(error);
+        if (ret) {
+            glob.users++;
+            glob.forced = true;
+        }
+    }
+    pthread_mutex_unlock(&glob.lock);
+    return ret;
 }
 
 void bs_shutdown(void) {
-    assert(glob.devices == 0);
+    pthread_mutex_lock(&glob.lock);
+    assert(glob.users == 1);
     assert(glob.forced);
     glob.forced = false;
-    deinit_glob();
+    pthread_mutex_unlock(&glob.lock);
+    unref_glob();
 }
 
 static bs_device_t* bs_open(libusb_device* device, const char* match_serial,
@@ -72,6 +121,10 @@ static bs_device_t* bs_open(libusb_device* device, const char* match_serial,
 
 static bs_version_t get_version(const char* serial) BS_NONULL;
 
+static void stop_mailbox(bs_device_t* device) BS_NONULL;
+static bs_error_t error_from_status(enum libusb_transfer_status status);
+static void stop_reconnect(bs_device_t* device) BS_NONULL;
+
 bs_version_t get_version(const char* serial) {
     char* end;
     unsigned long tmp;
@@ -92,12 +145,10 @@ bs_version_t get_version(const char* serial) {
     return BS_VERSION_UNKOWN;
 }
 
-bs_device_t* bs_open(libusb_device* device, const char* match_serial,
-                     bs_error_t* error) {
+libusb_device_handle* usb_open_serial(libusb_device* device, char* serial,
+                                      size_t size, bs_error_t* error) {
     libusb_device_handle* handle;
-    bs_device_t* dev;
     struct libusb_device_descriptor desc;
-    char tmp[256];
     int ret, len;
     ret = libusb_get_device_descriptor(device, &desc);
     if (ret) {
@@ -105,68 +156,183 @@ bs_device_t* bs_open(libusb_device* device, const char* match_serial,
         return NULL;
     }
     if (desc.idVendor != 0x20a0 || desc.idProduct != 0x41e5) return NULL;
-    do {
-        ret = libusb_open(device, &handle);
-    } while (ret == LIBUSB_ERROR_INTERRUPTED);
+    while ((ret = libusb_open(device, &handle)) == LIBUSB_ERROR_INTERRUPTED) {
+        stats_add(NULL, STATS_INTERRUPTED, 1);
+    }
     if (ret) {
         if (error) *error = error_from_libusb(ret);
         return NULL;
     }
-    do {
-        len = libusb_get_string_descriptor_ascii(
-                handle, desc.iSerialNumber, (uint8_t*)tmp, sizeof(tmp) - 1);
-    } while (len == LIBUSB_ERROR_INTERRUPTED);
+    while ((len = libusb_get_string_descriptor_ascii(
+                handle, desc.iSerialNumber, (uint8_t*)serial, size - 1)) ==
+           LIBUSB_ERROR_INTERRUPTED) {
+        stats_add(NULL, STATS_INTERRUPTED, 1);
+    }
     if (len <= 3) {
         if (len < 0 && error) *error = error_from_libusb(len);
         libusb_close(handle);
         return NULL;
     }
-    tmp[len] = '\0';
-    if (memcmp(tmp, "BS", 2) != 0 ||
-        (match_serial && strcmp(tmp, match_serial) != 0)) {
+    serial[len] = '\0';
+    if (memcmp(serial, "BS", 2) != 0) {
+        libusb_close(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+/* Create device for handle, closing handle in case of error */
+static bs_device_t* usb_device_new(libusb_device* device,
+                                   libusb_device_handle* handle,
+                                   const char* serial, bs_error_t* error)
+    BS_NONULL_ARGS(1, 2, 3) BS_MALLOC;
+
+bs_device_t* usb_device_new(libusb_device* device,
+                            libusb_device_handle* handle,
+                            const char* serial, bs_error_t* error) {
+    bs_device_t* dev;
+    usb_device_t* usb = malloc(sizeof(usb_device_t));
+    dev = usb ? device_new(&usb_transport, usb, serial, get_version(serial))
+        : NULL;
+    if (!dev) {
+        if (error) *error = BS_ERROR_NO_MEM;
+        free(usb);
         libusb_close(handle);
         return NULL;
     }
-    dev = malloc(sizeof(bs_device_t));
-    dev->handle = handle;
-    dev->serial = malloc(len + 1);
-    memcpy(dev->serial, tmp, len + 1);
-    dev->last_error = BS_NO_ERROR;
-    dev->version = get_version(dev->serial);
+    usb->handle = handle;
+    usb->bus = libusb_get_bus_number(device);
+    usb->address = libusb_get_device_address(device);
+    usb->port_count = libusb_get_port_numbers(device, usb->ports,
+                                              sizeof(usb->ports));
+    /* Caller has a reference so the context exists */
+    pthread_mutex_lock(&glob.lock);
+    glob.users++;
+    usb->ctx = glob.ctx;
+    pthread_mutex_unlock(&glob.lock);
+    return dev;
+}
+
+bs_device_t* bs_open(libusb_device* device, const char* match_serial,
+                     bs_error_t* error) {
+    libusb_device_handle* handle;
+    char tmp[256];
+    handle = usb_open_serial(device, tmp, sizeof(tmp), error);
+    if (!handle) return NULL;
+    if (match_serial && strcmp(tmp, match_serial) != 0) {
+        libusb_close(handle);
+        return NULL;
+    }
+    return usb_device_new(device, handle, tmp, error);
+}
+
+bs_device_t* device_new(const bs_transport_t* transport, void* priv,
+                        const char* serial, bs_version_t version) {
+    bs_device_t* dev = malloc(sizeof(bs_device_t));
+    if (!dev) return NULL;
+    dev->serial = strdup(serial);
+    if (!dev->serial) {
+        free(dev);
+        return NULL;
+    }
+    dev->transport = transport;
+    dev->priv = priv;
+    atomic_init(&dev->last_error, BS_NO_ERROR);
+    dev->version = version;
     dev->mode = dev->version == BS_VERSION_BASIC ? 0 : -1;
-    glob.devices++;
+    pthread_mutex_init(&dev->lock, NULL);
+    dev->mailbox = NULL;
+    dev->reconnect = NULL;
+    dev->background_reconnect = true;
+    dev->closing = false;
+    dev->cache = false;
+    memset(dev->shadow_valid, 0, sizeof(dev->shadow_valid));
+    dev->pending_head = NULL;
+    dev->pending = 0;
+    dev->max_pending = 4;
+    dev->timeout_ms = 0;
+    dev->timeouts = 0;
+    dev->last_success_us = 0;
+    dev->correct = false;
+    dev->own_power = NULL;
+    dev->group_power = NULL;
+    stats_init(&dev->stats);
+    dev->trace_session = 0;
+    dev->trace_id = 0;
     return dev;
 }
 
-bs_device_t* bs_open_first(bs_error_t* error) {
+void device_free(bs_device_t* device) {
+    bs_power_pool_t* own = device->own_power;
+    power_switch(device, NULL, NULL);
+    power_pool_free(own);
+    if (device->mailbox) {
+        pthread_cond_destroy(&device->mailbox->cond);
+        free(device->mailbox);
+    }
+    if (device->reconnect) {
+        pthread_cond_destroy(&device->reconnect->cond);
+        free(device->reconnect);
+    }
+    pthread_mutex_destroy(&device->lock);
+    free(device->serial);
+    free(device);
+}
+
+/* Open device at bus and address if it has serial, serial may be NULL */
+static bs_device_t* open_at(uint8_t bus, uint8_t address, const char* serial,
+                            bs_error_t* error) BS_MALLOC;
+
+bs_device_t* open_at(uint8_t bus, uint8_t address, const char* serial,
+                     bs_error_t* error) {
     size_t i;
     ssize_t count;
     libusb_device** devices;
     bs_device_t* dev = NULL;
-    if (!init_glob(error)) return NULL;
-    count = libusb_get_device_list(glob.ctx, &devices);
+    libusb_context* ctx = ref_glob(error);
+    if (!ctx) return NULL;
+    /* Getting the device list does not talk to any device */
+    count = libusb_get_device_list(ctx, &devices);
     if (count < 0) {
         if (error) *error = error_from_libusb(count);
+        unref_glob();
         return NULL;
     }
     if (error) *error = BS_NO_ERROR;
     for (i = 0; i < (size_t)count; i++) {
-        dev = bs_open(devices[i], NULL, error);
-        if (dev) break;
+        if (libusb_get_bus_number(devices[i]) == bus &&
+            libusb_get_device_address(devices[i]) == address) {
+            dev = bs_open(devices[i], serial, error);
+            break;
+        }
     }
     libusb_free_device_list(devices, 1);
+    unref_glob();
     return dev;
 }
 
-bs_device_t* bs_open_matching_serial(const char* serial, bs_error_t* error) {
+/* Open first device with serial, or any device if serial is NULL */
+static bs_device_t* open_matching(const char* serial, bs_error_t* error)
+    BS_MALLOC;
+
+bs_device_t* open_matching(const char* serial, bs_error_t* error) {
     size_t i;
     ssize_t count;
     libusb_device** devices;
     bs_device_t* dev = NULL;
-    if (!init_glob(error)) return NULL;
-    count = libusb_get_device_list(glob.ctx, &devices);
+    libusb_context* ctx;
+    uint8_t bus, address;
+    bool found;
+    if (index_lookup(serial, &found, &bus, &address)) {
+        if (error) *error = BS_NO_ERROR;
+        return found ? open_at(bus, address, serial, error) : NULL;
+    }
+    ctx = ref_glob(error);
+    if (!ctx) return NULL;
+    count = libusb_get_device_list(ctx, &devices);
     if (count < 0) {
         if (error) *error = error_from_libusb(count);
+        unref_glob();
         return NULL;
     }
     if (error) *error = BS_NO_ERROR;
@@ -175,108 +341,1340 @@ bs_device_t* bs_open_matching_serial(const char* serial, bs_error_t* error) {
         if (dev) break;
     }
     libusb_free_device_list(devices, 1);
+    unref_glob();
     return dev;
 }
 
-bs_device_t** bs_open_all(size_t max, bs_error_t* error) {
-    size_t i, open = 0, alloc;
+bs_device_t* bs_open_first(bs_error_t* error) {
+    return open_matching(NULL, error);
+}
+
+bs_device_t* bs_open_matching_serial(const char* serial, bs_error_t* error) {
+    return open_matching(serial, error);
+}
+
+/* Reading serials of this many devices at the same time */
+#define PROBE_WINDOW 32
+/* Give up on a device not answering within this many ms */
+#define PROBE_TIMEOUT 1000
+
+typedef struct probe_t {
+    libusb_device* device;
+    libusb_device_handle* handle;
+    struct libusb_transfer* transfer;
+    int* pending;  /* Decreased when probe is done */
+    bool busy;  /* transfer is submitted */
+    uint8_t string;  /* Index of serial string descriptor */
+    bool langid;  /* Waiting for list of languages, not the serial */
+    bool ok;  /* serial is valid */
+    bs_error_t error;  /* Why serial is not valid, if known */
+    char serial[128];
+    uint8_t buffer[LIBUSB_CONTROL_SETUP_SIZE + 255];
+} probe_t;
+
+static bool probe_submit(probe_t* probe, uint16_t langid) BS_NONULL;
+static void LIBUSB_CALL probe_cb(struct libusb_transfer* transfer);
+
+static void probe_done(probe_t* probe) {
+    probe->busy = false;
+    (*probe->pending)--;
+}
+
+bool probe_submit(probe_t* probe, uint16_t langid) {
+    libusb_fill_control_setup(probe->buffer, LIBUSB_ENDPOINT_IN,
+                              LIBUSB_REQUEST_GET_DESCRIPTOR,
+                              (LIBUSB_DT_STRING << 8) |
+                              (probe->langid ? 0 : probe->string),
+                              langid, 255);
+    libusb_fill_control_transfer(probe->transfer, probe->handle,
+                                 probe->buffer, probe_cb, probe,
+                                 PROBE_TIMEOUT);
+    return libusb_submit_transfer(probe->transfer) == 0;
+}
+
+static void LIBUSB_CALL probe_cb(struct libusb_transfer* transfer) {
+    probe_t* probe = transfer->user_data;
+    const uint8_t* data = libusb_control_transfer_get_data(transfer);
+    int len, i;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        probe->error = error_from_status(transfer->status);
+        probe_done(probe);
+        return;
+    }
+    if (transfer->actual_length < 4 || data[1] != LIBUSB_DT_STRING) {
+        probe->error = BS_ERROR_COMM;
+        probe_done(probe);
+        return;
+    }
+    len = transfer->actual_length < data[0] ? transfer->actual_length
+        : data[0];
+    if (probe->langid) {
+        /* Ask for the serial in the first language, as libusb does */
+        probe->langid = false;
+        if (!probe_submit(probe, data[2] | (data[3] << 8))) {
+            probe->error = BS_ERROR_IO;
+            probe_done(probe);
+        }
+        return;
+    }
+    /* UTF-16LE to ASCII */
+    for (i = 2; i + 1 < len && (size_t)(i / 2) < sizeof(probe->serial);
+         i += 2) {
+        probe->serial[i / 2 - 1] = data[i + 1] || data[i] & 0x80 ? '?'
+            : (char)data[i];
+    }
+    probe->serial[i / 2 - 1] = '\0';
+    probe->ok = true;
+    probe_done(probe);
+}
+
+static bool match_filter(const bs_filter_t* filter, const char* serial)
+    BS_NONULL_ARGS(2);
+
+bool match_filter(const bs_filter_t* filter, const char* serial) {
+    if (strlen(serial) <= 3 || memcmp(serial, "BS", 2) != 0) return false;
+    return !filter || !filter->serial_prefix ||
+        strncmp(serial, filter->serial_prefix,
+                strlen(filter->serial_prefix)) == 0;
+}
+
+/* Open and read the serial of count devices concurrently, then call
+ * callback for each match. more is set to false if callback asked to stop.
+ * If open_error is non-null and not yet set, it is set to the first error
+ * opening a device or reading its serial, such devices are skipped.
+ * Returns false and sets error if events could not be handled, callback is
+ * then not called */
+static bool probe_devices(libusb_device** devices, size_t count,
+                          const bs_filter_t* filter,
+                          bs_enumerate_callback_t callback, void* userdata,
+                          bool* more, bs_error_t* open_error,
+                          bs_error_t* error)
+    BS_NONULL_ARGS(1, 4, 6);
+
+bool probe_devices(libusb_device** devices, size_t count,
+                   const bs_filter_t* filter,
+                   bs_enumerate_callback_t callback, void* userdata,
+                   bool* more, bs_error_t* open_error, bs_error_t* error) {
+    probe_t probe[PROBE_WINDOW];
+    struct libusb_device_descriptor desc;
+    bs_error_t ret = BS_NO_ERROR;
+    size_t i;
+    int pending = 0, err;
+    for (i = 0; i < count; i++) {
+        probe_t* p = probe + i;
+        p->device = devices[i];
+        p->handle = NULL;
+        p->transfer = NULL;
+        p->pending = &pending;
+        p->busy = false;
+        p->langid = true;
+        p->ok = false;
+        p->error = BS_NO_ERROR;
+        err = libusb_get_device_descriptor(p->device, &desc);
+        if (err == 0) err = libusb_open(p->device, &p->handle);
+        if (err != 0) {
+            p->handle = NULL;
+            p->error = error_from_libusb(err);
+            continue;
+        }
+        p->string = desc.iSerialNumber;
+        p->transfer = libusb_alloc_transfer(0);
+        if (!p->transfer) {
+            p->error = BS_ERROR_NO_MEM;
+        } else if (probe_submit(p, 0)) {
+            p->busy = true;
+            pending++;
+        } else {
+            p->error = BS_ERROR_IO;
+        }
+    }
+    while (pending > 0) {
+        ret = device_events(NULL, -1, NULL);
+        if (ret != BS_NO_ERROR) {
+            for (i = 0; i < count; i++) {
+                if (probe[i].busy) libusb_cancel_transfer(probe[i].transfer);
+            }
+            while (pending > 0 &&
+                   device_events(NULL, -1, NULL) == BS_NO_ERROR) {
+            }
+            break;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        probe_t* p = probe + i;
+        /* Leak rather than free what a transfer still uses */
+        if (p->busy) continue;
+        libusb_free_transfer(p->transfer);
+        if (p->handle && ret == BS_NO_ERROR && *more && p->ok &&
+            match_filter(filter, p->serial)) {
+            bs_device_t* dev = usb_device_new(p->device, p->handle,
+                                              p->serial, &p->error);
+            if (dev && !callback(dev, userdata)) *more = false;
+        } else if (p->handle) {
+            libusb_close(p->handle);
+        }
+        if (open_error && *open_error == BS_NO_ERROR) {
+            *open_error = p->error;
+        }
+    }
+    if (ret != BS_NO_ERROR) {
+        if (error) *error = ret;
+        return false;
+    }
+    return true;
+}
+
+/* Find the device at bus and address in the count devices, NULL if gone */
+static libusb_device* find_device(libusb_device** devices, ssize_t count,
+                                  uint8_t bus, uint8_t address) BS_NONULL;
+
+libusb_device* find_device(libusb_device** devices, ssize_t count,
+                           uint8_t bus, uint8_t address) {
+    ssize_t i;
+    for (i = 0; i < count; i++) {
+        if (libusb_get_bus_number(devices[i]) == bus &&
+            libusb_get_device_address(devices[i]) == address) {
+            return devices[i];
+        }
+    }
+    return NULL;
+}
+
+/* Enumerate the devices in the index, only the devices matching the filter
+ * are opened, concurrently as by enumerate_usb(). used is set to false if
+ * the index is not running, nothing else is done then.
+ * Returns false and sets error on errors, including the first device in the
+ * index that could not be opened */
+static bool enumerate_index(libusb_context* ctx, const bs_filter_t* filter,
+                            bs_enumerate_callback_t callback, void* userdata,
+                            bool* used, bs_error_t* error)
+    BS_NONULL_ARGS(1, 3, 5);
+
+bool enumerate_index(libusb_context* ctx, const bs_filter_t* filter,
+                     bs_enumerate_callback_t callback, void* userdata,
+                     bool* used, bs_error_t* error) {
+    char** serials;
+    libusb_device** devices;
+    libusb_device* window[PROBE_WINDOW];
+    bs_error_t open_error = BS_NO_ERROR;
     ssize_t count;
+    size_t i, n = 0;
+    bool more = true, ret = true;
+    *used = index_serials(filter ? filter->serial_prefix : NULL, &serials);
+    if (!*used) return true;
+    if (!serials) {
+        if (error) *error = BS_ERROR_NO_MEM;
+        return false;
+    }
+    count = libusb_get_device_list(ctx, &devices);
+    if (count < 0) {
+        if (error) *error = error_from_libusb(count);
+        ret = false;
+    }
+    for (i = 0; serials[i]; i++) {
+        uint8_t bus, address;
+        bool found;
+        libusb_device* device;
+        if (ret && more &&
+            index_lookup(serials[i], &found, &bus, &address) && found &&
+            (device = find_device(devices, count, bus, address))) {
+            window[n++] = device;
+            if (n == PROBE_WINDOW) {
+                ret = probe_devices(window, n, filter, callback, userdata,
+                                    &more, &open_error, error);
+                n = 0;
+            }
+        }
+        free(serials[i]);
+    }
+    free(serials);
+    if (ret && more && n > 0) {
+        ret = probe_devices(window, n, filter, callback, userdata, &more,
+                            &open_error, error);
+    }
+    if (count >= 0) libusb_free_device_list(devices, 1);
+    if (ret && open_error != BS_NO_ERROR) {
+        if (error) *error = open_error;
+        ret = false;
+    }
+    return ret;
+}
+
+/* Enumerate all USB devices with vendor and product */
+static bool enumerate_usb(libusb_context* ctx, uint16_t vendor,
+                          uint16_t product, const bs_filter_t* filter,
+                          bs_enumerate_callback_t callback, void* userdata,
+                          bs_error_t* error) BS_NONULL_ARGS(1, 5);
+
+bool enumerate_usb(libusb_context* ctx, uint16_t vendor, uint16_t product,
+                   const bs_filter_t* filter,
+                   bs_enumerate_callback_t callback, void* userdata,
+                   bs_error_t* error) {
     libusb_device** devices;
-    bs_device_t** dev = NULL;
-    if (!init_glob(error)) return NULL;
-    if (max == 0) max = 12;
-    count = libusb_get_device_list(glob.ctx, &devices);
+    libusb_device* window[PROBE_WINDOW];
+    struct libusb_device_descriptor desc;
+    ssize_t count, i;
+    size_t n = 0;
+    bool more = true, ret = true;
+    count = libusb_get_device_list(ctx, &devices);
     if (count < 0) {
         if (error) *error = error_from_libusb(count);
-        return NULL;
+        return false;
     }
-    if (error) *error = BS_NO_ERROR;
-    alloc = (size_t)count;
-    if (alloc > max) alloc = max;
-    dev = calloc(sizeof(bs_device_t*), alloc + 1);
-    for (i = 0; i < (size_t)count; i++) {
-        bs_device_t* d = bs_open(devices[i], NULL, NULL);
-        if (d) {
-            assert(open < alloc);
-            dev[open++] = d;
+    for (i = 0; i < count; i++) {
+        /* The device descriptor is cached, the device is not opened */
+        if (libusb_get_device_descriptor(devices[i], &desc) != 0 ||
+            desc.idVendor != vendor || desc.idProduct != product) {
+            continue;
+        }
+        window[n++] = devices[i];
+        if (n == PROBE_WINDOW) {
+            ret = probe_devices(window, n, filter, callback, userdata, &more,
+                                NULL, error);
+            if (!ret || !more) break;
+            n = 0;
         }
     }
+    if (i == count && n > 0) {
+        ret = probe_devices(window, n, filter, callback, userdata, &more,
+                            NULL, error);
+    }
     libusb_free_device_list(devices, 1);
-    dev[open] = NULL;
-    return dev;
+    return ret;
+}
+
+bool bs_enumerate(const bs_filter_t* filter, bs_enumerate_callback_t callback,
+                  void* userdata, bs_error_t* error) {
+    const uint16_t vendor = filter && filter->vendor ? filter->vendor : 0x20a0;
+    const uint16_t product = filter && filter->product ? filter->product
+        : 0x41e5;
+    libusb_context* ctx;
+    bool ret = true, used = false;
+    if (error) *error = BS_NO_ERROR;
+    /* Keep the context even if callback closes the last device */
+    ctx = ref_glob(error);
+    if (!ctx) return false;
+    if (vendor == 0x20a0 && product == 0x41e5) {
+        ret = enumerate_index(ctx, filter, callback, userdata, &used, error);
+    }
+    if (!used) {
+        ret = enumerate_usb(ctx, vendor, product, filter, callback, userdata,
+                            error);
+    }
+    unref_glob();
+    return ret;
+}
+
+typedef struct open_all_t {
+    bs_device_t** dev;
+    size_t count, alloc, max;
+    bool failed;
+} open_all_t;
+
+static bool open_all_cb(bs_device_t* device, void* userdata) BS_NONULL;
+
+bool open_all_cb(bs_device_t* device, void* userdata) {
+    open_all_t* all = userdata;
+    if (all->count + 1 >= all->alloc) {
+        size_t na = all->alloc * 2;
+        bs_device_t** tmp = realloc(all->dev, na * sizeof(bs_device_t*));
+        if (!tmp) {
+            all->failed = true;
+            bs_close(device);
+            return false;
+        }
+        all->dev = tmp;
+        all->alloc = na;
+    }
+    all->dev[all->count++] = device;
+    return all->max == 0 || all->count < all->max;
+}
+
+bs_device_t** bs_open_all(size_t max, bs_error_t* error) {
+    open_all_t all;
+    all.max = max;
+    all.count = 0;
+    all.alloc = 16;
+    all.failed = false;
+    all.dev = malloc(all.alloc * sizeof(bs_device_t*));
+    if (!all.dev) {
+        if (error) *error = BS_ERROR_NO_MEM;
+        return NULL;
+    }
+    if (!bs_enumerate(NULL, open_all_cb, &all, error) || all.failed) {
+        while (all.count > 0) bs_close(all.dev[--all.count]);
+        free(all.dev);
+        if (error && all.failed) *error = BS_ERROR_NO_MEM;
+        return NULL;
+    }
+    all.dev[all.count] = NULL;
+    return all.dev;
 }
 
 void bs_close(bs_device_t* device) {
     if (device == NULL) return;
-    libusb_close(device->handle);
-    free(device->serial);
-    free(device);
-    assert(glob.devices > 0);
-    glob.devices--;
-    deinit_glob();
+    /* Requests completed with a disconnect from here on, in cancel_pending()
+     * or by another thread handling events, must not start a reconnect
+     * thread that would outlive the device */
+    pthread_mutex_lock(&device->lock);
+    device->closing = true;
+    pthread_mutex_unlock(&device->lock);
+    stop_mailbox(device);
+    stop_reconnect(device);
+    cancel_pending(device);
+    device->transport->close(device);
+    device_free(device);
 }
 
 char* bs_serial(bs_device_t* device) {
     return strdup(device->serial);
 }
 
-bool bs_good(bs_device_t* device) {
-    bs_color_t clr;
-    /* TODO: Make a more effective version? */
-    return bs_get(device, &clr);
-}
-
 bs_error_t bs_error(bs_device_t* device) {
     return device->last_error;
 }
 
+static uint64_t shadow_mask(uint8_t index, uint8_t count) {
+    if (count >= 64) return ~UINT64_C(0);
+    return ((UINT64_C(1) << count) - 1) << index;
+}
+
+/* Return true if the shadow cache has all colors in the range, and if so
+ * copy them to color */
+static bool cache_get(bs_device_t* device, uint8_t channel, uint8_t index,
+                      uint8_t count, bs_color_t* color) BS_NONULL;
+
+bool cache_get(bs_device_t* device, uint8_t channel, uint8_t index,
+               uint8_t count, bs_color_t* color) {
+    uint64_t mask;
+    bool ret;
+    if (!device->cache || channel > 2 || index + count > 64) return false;
+    mask = shadow_mask(index, count);
+    pthread_mutex_lock(&device->lock);
+    /* The cache has colors as set, reads return them corrected or limited */
+    ret = !device->correct && !device->own_power && !device->group_power &&
+        (device->shadow_valid[channel] & mask) == mask;
+    if (ret) {
+        memcpy(color, device->shadow[channel] + index,
+               count * sizeof(bs_color_t));
+    }
+    pthread_mutex_unlock(&device->lock);
+    return ret;
+}
+
+/* Return true if the shadow cache says the device already shows the colors
+ * in the range, followed by black up to padded */
+static bool cache_same(bs_device_t* device, uint8_t channel, uint8_t index,
+                       uint8_t count, const bs_color_t* color,
+                       uint8_t padded) BS_NONULL;
+
+bool cache_same(bs_device_t* device, uint8_t channel, uint8_t index,
+                uint8_t count, const bs_color_t* color, uint8_t padded) {
+    static const bs_color_t black = { 0, 0, 0 };
+    const bs_color_t* shadow;
+    uint64_t mask;
+    bool ret;
+    uint8_t i;
+    if (!device->cache || channel > 2 || index + padded > 64) return false;
+    /* Colors limited before might fit in the budget now */
+    if (device->own_power || device->group_power) return false;
+    mask = shadow_mask(index, padded);
+    shadow = device->shadow[channel] + index;
+    pthread_mutex_lock(&device->lock);
+    ret = (device->shadow_valid[channel] & mask) == mask &&
+        memcmp(shadow, color, count * sizeof(bs_color_t)) == 0;
+    for (i = count; ret && i < padded; i++) {
+        ret = memcmp(shadow + i, &black, sizeof(bs_color_t)) == 0;
+    }
+    pthread_mutex_unlock(&device->lock);
+    return ret;
+}
+
+/* Store the colors in the range, followed by black up to padded */
+static void cache_put(bs_device_t* device, uint8_t channel, uint8_t index,
+                      uint8_t count, const bs_color_t* color, uint8_t padded)
+    BS_NONULL;
+
+void cache_put(bs_device_t* device, uint8_t channel, uint8_t index,
+               uint8_t count, const bs_color_t* color, uint8_t padded) {
+    bs_color_t* shadow;
+    if (!device->cache || channel > 2 || index + padded > 64) return;
+    shadow = device->shadow[channel] + index;
+    pthread_mutex_lock(&device->lock);
+    memcpy(shadow, color, count * sizeof(bs_color_t));
+    memset(shadow + count, 0, (padded - count) * sizeof(bs_color_t));
+    device->shadow_valid[channel] |= shadow_mask(index, padded);
+    pthread_mutex_unlock(&device->lock);
+}
+
+bool bs_set_correction(bs_device_t* device,
+                       const bs_correction_t* correction) {
+    uint8_t lut[3][256];
+    if (correction) {
+        const uint8_t balance[3] = {
+            correction->red, correction->green, correction->blue
+        };
+        unsigned int c, v;
+        if (!(correction->gamma > 0.0)) {
+            device->last_error = BS_ERROR_INVALID_PARAM;
+            return false;
+        }
+        /* All the floating point math is done here, once */
+        for (v = 0; v < 256; v++) {
+            const double level = pow(v / 255.0, correction->gamma) *
+                correction->brightness;
+            for (c = 0; c < 3; c++) {
+                lut[c][v] = (uint8_t)round(level * balance[c] / 255.0);
+            }
+        }
+    }
+    pthread_mutex_lock(&device->lock);
+    device->correct = correction != NULL;
+    if (correction) {
+        device->correction = *correction;
+        memcpy(device->lut, lut, sizeof(lut));
+    }
+    /* What the device shows no longer matches the colors in the cache */
+    memset(device->shadow_valid, 0, sizeof(device->shadow_valid));
+    pthread_mutex_unlock(&device->lock);
+    return true;
+}
+
+bool bs_get_correction(bs_device_t* device, bs_correction_t* correction) {
+    bool ret;
+    pthread_mutex_lock(&device->lock);
+    ret = device->correct;
+    if (ret) *correction = device->correction;
+    pthread_mutex_unlock(&device->lock);
+    return ret;
+}
+
+/* Apply color correction, if enabled, to count leds in a report. The
+ * single led reports are in RGB order, the others in GRB */
+static void correct(bs_device_t* device, uint8_t* data, size_t count,
+                    bool grb) BS_NONULL;
+
+void correct(bs_device_t* device, uint8_t* data, size_t count, bool grb) {
+    size_t i;
+    pthread_mutex_lock(&device->lock);
+    if (device->correct) {
+        const uint8_t* first = device->lut[grb ? 1 : 0];
+        const uint8_t* second = device->lut[grb ? 0 : 1];
+        const uint8_t* third = device->lut[2];
+        for (i = 0; i < count; i++, data += 3) {
+            data[0] = first[data[0]];
+            data[1] = second[data[1]];
+            data[2] = third[data[2]];
+        }
+    }
+    pthread_mutex_unlock(&device->lock);
+}
+
+/* Colors read back from a corrected or power limited device are not what
+ * was set, so they can not go in the cache */
+static bool adjusting(bs_device_t* device) BS_NONULL;
+
+bool adjusting(bs_device_t* device) {
+    bool ret;
+    pthread_mutex_lock(&device->lock);
+    ret = device->correct || device->own_power || device->group_power;
+    pthread_mutex_unlock(&device->lock);
+    return ret;
+}
+
+/* Store colors from a report, in wire (GRB) order */
+static void cache_put_report(bs_device_t* device, uint8_t channel,
+                             const uint8_t* data, uint8_t count) BS_NONULL;
+
+void cache_put_report(bs_device_t* device, uint8_t channel,
+                      const uint8_t* data, uint8_t count) {
+    bs_color_t color[64];
+    if (!device->cache || adjusting(device)) return;
+    bs_unpack_grb(color, data, count);
+    cache_put(device, channel, 0, count, color, count);
+}
+
+/* Scale count leds of a report about to be sent to fit the power budget */
+static void limit(bs_device_t* device, uint8_t channel, uint8_t index,
+                  uint8_t count, uint8_t* data) BS_NONULL;
+
+void limit(bs_device_t* device, uint8_t channel, uint8_t index,
+           uint8_t count, uint8_t* data) {
+    power_range_t range;
+    range.channel = channel;
+    range.index = index;
+    range.count = count;
+    range.data = data;
+    power_limit(device, &range, 1);
+}
+
+void bs_set_cache(bs_device_t* device, bool enable) {
+    pthread_mutex_lock(&device->lock);
+    device->cache = enable;
+    memset(device->shadow_valid, 0, sizeof(device->shadow_valid));
+    pthread_mutex_unlock(&device->lock);
+}
+
+void bs_invalidate_cache(bs_device_t* device) {
+    pthread_mutex_lock(&device->lock);
+    memset(device->shadow_valid, 0, sizeof(device->shadow_valid));
+    pthread_mutex_unlock(&device->lock);
+}
+
+static bool mailbox_post(bs_device_t* device, uint8_t channel,
+                         uint16_t value, const uint8_t* data,
+                         uint16_t length) BS_NONULL;
+
+static bool set_pro_channel(bs_device_t* device, uint8_t channel,
+                            uint8_t index, bs_color_t color, int64_t deadline)
+    BS_NONULL;
+static bool get_pro_channel(bs_device_t* device, uint8_t channel,
+                            uint8_t index, bs_color_t* color,
+                            int64_t deadline) BS_NONULL;
+static bool set_many_channel(bs_device_t* device, uint8_t channel,
+                             uint8_t count, const bs_color_t* color,
+                             int64_t deadline) BS_NONULL;
+static bool get_many_channel(bs_device_t* device, uint8_t channel,
+                             uint8_t count, bs_color_t* color,
+                             int64_t deadline) BS_NONULL;
+static bool set_color(bs_device_t* device, bs_color_t color,
+                      int64_t deadline) BS_NONULL;
+
+/* Deadline for a call that should complete within timeout_ms */
+static int64_t call_deadline(unsigned int timeout_ms) {
+    return timeout_ms ? bs_now_us() + (int64_t)timeout_ms * 1000 :
+        DEADLINE_NONE;
+}
+
 bool bs_set(bs_device_t* device, bs_color_t color) {
-    return bs_set_pro(device, 0, color);
+    return set_color(device, color, DEADLINE_DEFAULT);
+}
+
+bool bs_set_timed(bs_device_t* device, bs_color_t color,
+                  unsigned int timeout_ms) {
+    return set_color(device, color, call_deadline(timeout_ms));
+}
+
+bool set_color(bs_device_t* device, bs_color_t color, int64_t deadline) {
+    if (device->mailbox && device->mailbox->running) {
+        uint8_t data[4];
+        if (cache_same(device, 0, 0, 1, &color, 1)) return true;
+        data[0] = 0;
+        data[1] = color.red;
+        data[2] = color.green;
+        data[3] = color.blue;
+        correct(device, data + 1, 1, false);
+        limit(device, 0, 0, 1, data + 1);
+        mailbox_post(device, 0, 1, data, 4);
+        cache_put(device, 0, 0, 1, &color, 1);
+        return true;
+    }
+    return set_pro_channel(device, 0, 0, color, deadline);
 }
 
 bool bs_get(bs_device_t* device, bs_color_t* color) {
-    return bs_get_pro(device, 0, color);
+    return get_pro_channel(device, 0, 0, color, DEADLINE_DEFAULT);
+}
+
+bool bs_get_timed(bs_device_t* device, bs_color_t* color,
+                  unsigned int timeout_ms) {
+    return get_pro_channel(device, 0, 0, color, call_deadline(timeout_ms));
+}
+
+/* Count a request that timed out */
+static void count_timeout(bs_device_t* device) BS_NONULL;
+
+static void unlink_transfer(bs_transfer_t* t) {
+    bs_device_t* device = t->device;
+    if (t->prev) {
+        t->prev->next = t->next;
+    } else {
+        device->pending_head = t->next;
+    }
+    if (t->next) t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+    assert(device->pending > 0);
+    device->pending--;
 }
 
-static unsigned int TIMEOUT = 0;
+static void free_transfer(bs_transfer_t* t) {
+    t->device->transport->free(t);
+    free(t);
+}
 
+/* Link and submit an allocated transfer, returns false and sets
+ * device->last_error if it could not be submitted */
+static bool start_transfer(bs_device_t* device, bs_transfer_t* t) BS_NONULL;
+
+bs_transfer_t* submit_transfer(bs_device_t* device,
+                               uint8_t request_type, uint8_t request,
+                               uint16_t value, uint16_t index,
+                               const uint8_t* data, uint16_t length,
+                               bool async, bs_callback_t callback,
+                               void* userdata, int64_t deadline) {
+    bs_transfer_t* t;
+    unsigned int timeout_ms = 0;
+    bool reconnecting;
+    pthread_mutex_lock(&device->lock);
+    reconnecting = device->reconnect && device->reconnect->running;
+    if (deadline == DEADLINE_DEFAULT) timeout_ms = device->timeout_ms;
+    pthread_mutex_unlock(&device->lock);
+    if (reconnecting) {
+        /* Fail fast while the device is reconnected in the background */
+        device->last_error = BS_ERROR_DISCONNECTED;
+        return NULL;
+    }
+    if (deadline != DEADLINE_DEFAULT && deadline != DEADLINE_NONE) {
+        const int64_t left = deadline - bs_now_us();
+        if (left <= 0) {
+            count_timeout(device);
+            device->last_error = BS_ERROR_TIMEOUT;
+            return NULL;
+        }
+        /* Round up, libusb takes 0 as no timeout */
+        timeout_ms = (left + 999) / 1000;
+    }
+    t = calloc(1, sizeof(bs_transfer_t));
+    if (!t) {
+        device->last_error = BS_ERROR_NO_MEM;
+        return NULL;
+    }
+    t->timeout_ms = timeout_ms;
+    t->device = device;
+    t->request_type = request_type;
+    t->request = request;
+    t->value = value;
+    t->index = index;
+    t->length = length;
+    t->async = async;
+    t->callback = callback;
+    t->userdata = userdata;
+    if (!device->transport->alloc(device, t)) {
+        free(t);
+        device->last_error = BS_ERROR_NO_MEM;
+        return NULL;
+    }
+    if ((request_type & LIBUSB_ENDPOINT_IN) == 0 && length > 0) {
+        memcpy(t->data, data, length);
+    }
+    if (!start_transfer(device, t)) {
+        free_transfer(t);
+        return NULL;
+    }
+    return t;
+}
+
+bool start_transfer(bs_device_t* device, bs_transfer_t* t) {
+    bs_error_t error;
+    /* Link before submit as the transfer might complete in another thread
+     * before submit returns */
+    pthread_mutex_lock(&device->lock);
+    t->completed = 0;
+    t->next = device->pending_head;
+    if (t->next) t->next->prev = t;
+    device->pending_head = t;
+    device->pending++;
+    pthread_mutex_unlock(&device->lock);
+    t->start_us = bs_now_us();
+    error = device->transport->submit(device, t);
+    if (error != BS_NO_ERROR) {
+        pthread_mutex_lock(&device->lock);
+        unlink_transfer(t);
+        t->completed = 1;
+        pthread_mutex_unlock(&device->lock);
+        device->last_error = error;
+        return false;
+    }
+    return true;
+}
+
+/* Start reconnecting device in the background if enabled and not already
+ * running, device->lock must be held */
+static void start_reconnect(bs_device_t* device) BS_NONULL;
+
+void transfer_done(bs_transfer_t* t, bs_error_t error) {
+    bs_device_t* device = t->device;
+    /* A sync transfer might be freed by its owner as soon as it is marked
+     * completed, which can be in another thread */
+    const bool async = t->async;
+    const bool owned = t->owned;
+    stats_request(device, t, error);
+    trace_request(device, t, error);
+    pthread_mutex_lock(&device->lock);
+    t->error = error;
+    unlink_transfer(t);
+    if (error != BS_NO_ERROR && (t->request_type & LIBUSB_ENDPOINT_IN) == 0) {
+        /* Unknown what the device is showing after a failed set */
+        memset(device->shadow_valid, 0, sizeof(device->shadow_valid));
+    }
+    if (error == BS_ERROR_DISCONNECTED) start_reconnect(device);
+    if (error == BS_ERROR_TIMEOUT) device->timeouts++;
+    if (error == BS_NO_ERROR) {
+        device->last_success_us = bs_now_us();
+    } else if (error != BS_ERROR_CANCELLED) {
+        /* Only trust a success if nothing has failed since */
+        device->last_success_us = 0;
+    }
+    if (error != BS_NO_ERROR) device->last_error = error;
+    t->completed = 1;
+    pthread_mutex_unlock(&device->lock);
+    if (async) {
+        if (t->callback) t->callback(device, error, t->userdata);
+        /* An owned transfer might already be reused by the callback */
+        if (!owned) free_transfer(t);
+    }
+}
+
+void count_timeout(bs_device_t* device) {
+    /* Never sent, so not counted by transfer_done() */
+    stats_add(device, STATS_ERRORS, 1);
+    stats_add(device, STATS_TIMEOUTS, 1);
+    pthread_mutex_lock(&device->lock);
+    device->timeouts++;
+    pthread_mutex_unlock(&device->lock);
+}
+
+int64_t bs_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+bs_error_t device_events(bs_device_t* device, int64_t timeout_us,
+                         int* completed) {
+    int64_t wait = timeout_us, due = emulated_next_due(device);
+    libusb_context* ctx = NULL;
+    int ret = 0;
+    if (!device) {
+        pthread_mutex_lock(&glob.lock);
+        if (glob.ctx) {
+            ctx = glob.ctx;
+            glob.users++;
+        }
+        pthread_mutex_unlock(&glob.lock);
+    } else if (device->transport == &usb_transport) {
+        ctx = ((usb_device_t*)device->priv)->ctx;
+    }
+    if (due >= 0) {
+        int64_t now = bs_now_us();
+        due = due > now ? due - now : 0;
+        if (wait < 0 || due < wait) wait = due;
+    }
+    if (ctx) {
+        if (wait < 0) {
+            ret = libusb_handle_events_completed(ctx, completed);
+        } else {
+            struct timeval tv;
+            tv.tv_sec = wait / 1000000;
+            tv.tv_usec = wait % 1000000;
+            ret = libusb_handle_events_timeout_completed(ctx, &tv, completed);
+        }
+        if (!device) unref_glob();
+    } else if (wait > 0) {
+        struct timespec ts;
+        ts.tv_sec = wait / 1000000;
+        ts.tv_nsec = (wait % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+    }
+    emulated_dispatch(device);
+    if (ret == LIBUSB_ERROR_INTERRUPTED) {
+        stats_add(device, STATS_INTERRUPTED, 1);
+    } else if (ret < 0) {
+        return error_from_libusb(ret);
+    }
+    return BS_NO_ERROR;
+}
+
+/* Check if transfer is completed, it might be completed by another thread */
+static bool is_completed(bs_transfer_t* t) {
+    bool ret;
+    pthread_mutex_lock(&t->device->lock);
+    ret = t->completed;
+    pthread_mutex_unlock(&t->device->lock);
+    return ret;
+}
+
+/* Run the event loop until transfer is completed, canceling it if
+ * event handling fails */
+static void wait_transfer(bs_transfer_t* t) {
+    while (!is_completed(t)) {
+        if (device_events(t->device, -1, &t->completed) != BS_NO_ERROR) {
+            t->device->transport->cancel(t->device, t);
+            while (!is_completed(t)) {
+                if (device_events(t->device, -1, &t->completed) !=
+                    BS_NO_ERROR) {
+                    break;
+                }
+            }
+            break;
+        }
+    }
+}
+
+static bs_error_t sync_transfer(bs_device_t* device, uint8_t request_type,
+                                uint8_t request, uint16_t value,
+                                uint16_t index, uint8_t* data,
+                                uint16_t length, int64_t deadline) BS_NONULL;
+
+bs_error_t sync_transfer(bs_device_t* device, uint8_t request_type,
+                         uint8_t request, uint16_t value, uint16_t index,
+                         uint8_t* data, uint16_t length, int64_t deadline) {
+    bs_error_t error;
+    bs_transfer_t* t = submit_transfer(device, request_type, request, value,
+                                       index, data, length, false, NULL,
+                                       NULL, deadline);
+    if (!t) return device->last_error;
+    wait_transfer(t);
+    if (!is_completed(t)) {
+        /* Unable to get rid of the transfer, leak it rather than
+         * risk the transport writing to freed memory */
+        device->last_error = BS_ERROR_IO;
+        return BS_ERROR_IO;
+    }
+    error = t->error;
+    if (error == BS_NO_ERROR && (request_type & LIBUSB_ENDPOINT_IN)) {
+        memcpy(data, t->data, length);
+    }
+    free_transfer(t);
+    return error;
+}
+
+void cancel_pending(bs_device_t* device) {
+    bs_transfer_t* t;
+    pthread_mutex_lock(&device->lock);
+    for (t = device->pending_head; t; t = t->next) {
+        device->transport->cancel(device, t);
+    }
+    pthread_mutex_unlock(&device->lock);
+    while (bs_pending(device) > 0) {
+        if (device_events(device, -1, NULL) != BS_NO_ERROR) break;
+    }
+}
+
+/* Reconnect a disconnected device in the calling thread, returns false if
+ * it could not be reconnected */
+static bool reconnect_now(bs_device_t* device) BS_NONULL;
+
+bool reconnect_now(bs_device_t* device) {
+    /* Requests on the old connection must be done first. They fail on their
+     * own as the device is gone, so wait for them instead of canceling
+     * requests the caller did not make */
+    while (bs_pending(device) > 0) {
+        if (device_events(device, -1, NULL) != BS_NO_ERROR) {
+            cancel_pending(device);
+            if (bs_pending(device) > 0) return false;
+            break;
+        }
+    }
+    if (!device->transport->reconnect(device)) return false;
+    stats_add(device, STATS_RECONNECTS, 1);
+    bs_invalidate_cache(device);
+    return true;
+}
+
+/* Send a request and wait for it to complete, deadline is an absolute
+ * bs_now_us() time or DEADLINE_DEFAULT / DEADLINE_NONE */
 static bool bs_ctrl_transfer(bs_device_t* device, uint8_t request_type,
                              uint8_t request, uint16_t value, uint16_t index,
-                             uint8_t* data, uint16_t length) BS_NONULL;
+                             uint8_t* data, uint16_t length, int64_t deadline)
+    BS_NONULL;
 
 bool bs_ctrl_transfer(bs_device_t* device, uint8_t request_type,
                       uint8_t request, uint16_t value, uint16_t index,
-                      uint8_t* data, uint16_t length) {
-    int ret;
-    do {
-        ret = libusb_control_transfer(device->handle, request_type, request,
-                                      value, index, data, length, TIMEOUT);
-    } while (ret == LIBUSB_ERROR_INTERRUPTED);
-    if (ret == LIBUSB_ERROR_NO_DEVICE) {
-        bs_device_t* dev = bs_open_matching_serial(device->serial, NULL);
-        if (dev != NULL) {
-            libusb_close(device->handle);
-            device->handle = dev->handle;
-            free(dev->serial);
-            free(dev);
-            do {
-                ret = libusb_control_transfer(device->handle, request_type,
-                                              request, value, index, data,
-                                              length, TIMEOUT);
-            } while (ret == LIBUSB_ERROR_INTERRUPTED);
-        }
-    }
-    if (ret < 0) {
-        device->last_error = error_from_libusb(ret);
-        return false;
+                      uint8_t* data, uint16_t length, int64_t deadline) {
+    bs_error_t error = sync_transfer(device, request_type, request, value,
+                                     index, data, length, deadline);
+    if (error == BS_ERROR_DISCONNECTED) {
+        if (device->background_reconnect) {
+            /* Not started by transfer_done() if submit failed */
+            pthread_mutex_lock(&device->lock);
+            start_reconnect(device);
+            pthread_mutex_unlock(&device->lock);
+            device->last_error = BS_ERROR_DISCONNECTED;
+            return false;
+        }
+        if (reconnect_now(device)) {
+            stats_add(device, STATS_RETRIES, 1);
+            error = sync_transfer(device, request_type, request, value,
+                                  index, data, length, deadline);
+        }
+    }
+    return error == BS_NO_ERROR;
+}
+
+size_t bs_pending(bs_device_t* device) {
+    size_t pending;
+    pthread_mutex_lock(&device->lock);
+    pending = device->pending;
+    pthread_mutex_unlock(&device->lock);
+    return pending;
+}
+
+void bs_set_max_pending(bs_device_t* device, size_t max) {
+    pthread_mutex_lock(&device->lock);
+    device->max_pending = max > 0 ? max : 1;
+    pthread_mutex_unlock(&device->lock);
+}
+
+void bs_set_timeout(bs_device_t* device, unsigned int timeout_ms) {
+    pthread_mutex_lock(&device->lock);
+    device->timeout_ms = timeout_ms;
+    pthread_mutex_unlock(&device->lock);
+}
+
+unsigned int bs_get_timeout(bs_device_t* device) {
+    unsigned int timeout_ms;
+    pthread_mutex_lock(&device->lock);
+    timeout_ms = device->timeout_ms;
+    pthread_mutex_unlock(&device->lock);
+    return timeout_ms;
+}
+
+unsigned long bs_timeouts(bs_device_t* device) {
+    unsigned long timeouts;
+    pthread_mutex_lock(&device->lock);
+    timeouts = device->timeouts;
+    pthread_mutex_unlock(&device->lock);
+    return timeouts;
+}
+
+/* Number of probes bs_probe_many() has in flight at the same time */
+#define HEALTH_WINDOW 32
+/* How old a successful request bs_good() accepts */
+#define GOOD_MAX_AGE_MS 1000
+
+/* Check device without talking to it if possible, otherwise start a probe
+ * request and set t. Returns the health if known without a request. */
+static bs_health_t probe_start(bs_device_t* device, unsigned int max_age_ms,
+                               bs_transfer_t** t) BS_NONULL;
+
+/* Wait for a probe request started by probe_start() */
+static bs_health_t probe_finish(bs_device_t* device, bs_transfer_t* t)
+    BS_NONULL;
+
+bs_health_t probe_start(bs_device_t* device, unsigned int max_age_ms,
+                        bs_transfer_t** t) {
+    bool reconnecting, found;
+    int64_t last;
+    uint8_t bus, address;
+    *t = NULL;
+    pthread_mutex_lock(&device->lock);
+    reconnecting = device->reconnect && device->reconnect->running;
+    last = device->last_success_us;
+    pthread_mutex_unlock(&device->lock);
+    if (reconnecting) return BS_HEALTH_RECONNECTING;
+    if (last > 0 && bs_now_us() - last <= (int64_t)max_age_ms * 1000) {
+        return BS_HEALTH_OK;
+    }
+    if (device->transport == &usb_transport &&
+        index_lookup(device->serial, &found, &bus, &address) && !found) {
+        /* The index knows about all plugged in sticks */
+        device->last_error = BS_ERROR_DISCONNECTED;
+        return BS_HEALTH_GONE;
+    }
+    /* Read the mode, smaller than any color report. Basic sticks only
+     * have the color report */
+    *t = submit_transfer(device,
+                         LIBUSB_ENDPOINT_IN |
+                         LIBUSB_REQUEST_TYPE_CLASS |
+                         LIBUSB_RECIPIENT_DEVICE,
+                         LIBUSB_REQUEST_CLEAR_FEATURE,
+                         device->version == BS_VERSION_BASIC ? 1 : 4, 0,
+                         NULL, device->version == BS_VERSION_BASIC ? 4 : 2,
+                         false, NULL, NULL, DEADLINE_DEFAULT);
+    if (!*t) {
+        return device->last_error == BS_ERROR_DISCONNECTED ?
+            BS_HEALTH_RECONNECTING : BS_HEALTH_FAILED;
     }
-    if ((uint16_t)ret != length) {
-        device->last_error = BS_ERROR_COMM;
+    return BS_HEALTH_OK;
+}
+
+bs_health_t probe_finish(bs_device_t* device, bs_transfer_t* t) {
+    bs_error_t error;
+    wait_transfer(t);
+    if (!is_completed(t)) {
+        /* Leak, see sync_transfer */
+        device->last_error = BS_ERROR_IO;
+        return BS_HEALTH_FAILED;
+    }
+    error = t->error;
+    free_transfer(t);
+    if (error == BS_NO_ERROR) return BS_HEALTH_OK;
+    if (error == BS_ERROR_DISCONNECTED &&
+        bs_connection(device) == BS_RECONNECTING) {
+        return BS_HEALTH_RECONNECTING;
+    }
+    return BS_HEALTH_FAILED;
+}
+
+bs_health_t bs_probe(bs_device_t* device, unsigned int max_age_ms) {
+    bs_transfer_t* t;
+    bs_health_t health = probe_start(device, max_age_ms, &t);
+    return t ? probe_finish(device, t) : health;
+}
+
+bool bs_probe_many(bs_device_t** devices, size_t count,
+                   unsigned int max_age_ms, bs_health_t* health) {
+    bs_transfer_t* t[HEALTH_WINDOW];
+    size_t i, j, n;
+    bool ret = true;
+    for (i = 0; i < count; i += n) {
+        n = count - i < HEALTH_WINDOW ? count - i : HEALTH_WINDOW;
+        /* Start all probes before waiting for any */
+        for (j = 0; j < n; j++) {
+            health[i + j] = probe_start(devices[i + j], max_age_ms, &t[j]);
+        }
+        for (j = 0; j < n; j++) {
+            if (t[j]) health[i + j] = probe_finish(devices[i + j], t[j]);
+            if (health[i + j] != BS_HEALTH_OK) ret = false;
+        }
+    }
+    return ret;
+}
+
+bool bs_good(bs_device_t* device) {
+    return bs_probe(device, GOOD_MAX_AGE_MS) == BS_HEALTH_OK;
+}
+
+bool bs_flush(bs_device_t* device) {
+    while (bs_pending(device) > 0) {
+        bs_error_t error = device_events(device, -1, NULL);
+        if (error != BS_NO_ERROR) {
+            device->last_error = error;
+            return false;
+        }
+    }
+    return true;
+}
+
+bs_pollfd_t* bs_get_pollfds(size_t* count, bs_error_t* error) {
+    const struct libusb_pollfd** fds;
+    bs_pollfd_t* ret;
+    size_t i, n = 0;
+    pthread_mutex_lock(&glob.lock);
+    if (!glob.forced) {
+        /* Context and its file descriptors might come and go otherwise */
+        pthread_mutex_unlock(&glob.lock);
+        if (error) *error = BS_ERROR_INVALID_PARAM;
+        return NULL;
+    }
+    fds = libusb_get_pollfds(glob.ctx);
+    pthread_mutex_unlock(&glob.lock);
+    if (!fds) {
+        if (error) *error = BS_ERROR_NO_MEM;
+        return NULL;
+    }
+    while (fds[n]) n++;
+    ret = malloc((n ? n : 1) * sizeof(bs_pollfd_t));
+    if (!ret) {
+        libusb_free_pollfds(fds);
+        if (error) *error = BS_ERROR_NO_MEM;
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        ret[i].fd = fds[i]->fd;
+        ret[i].events = fds[i]->events;
+    }
+    libusb_free_pollfds(fds);
+    *count = n;
+    if (error) *error = BS_NO_ERROR;
+    return ret;
+}
+
+void bs_set_pollfd_notifiers(bs_pollfd_added_t added,
+                             bs_pollfd_removed_t removed, void* userdata) {
+    pthread_mutex_lock(&glob.lock);
+    if (glob.forced) {
+        libusb_set_pollfd_notifiers(glob.ctx, added, removed, userdata);
+    }
+    pthread_mutex_unlock(&glob.lock);
+}
+
+int bs_get_next_timeout(void) {
+    int64_t wait = -1, due = emulated_next_due(NULL);
+    struct timeval tv;
+    if (due >= 0) {
+        int64_t now = bs_now_us();
+        wait = due > now ? due - now : 0;
+    }
+    pthread_mutex_lock(&glob.lock);
+    if (glob.ctx && libusb_get_next_timeout(glob.ctx, &tv) == 1) {
+        int64_t usb = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+        if (wait < 0 || usb < wait) wait = usb;
+    }
+    pthread_mutex_unlock(&glob.lock);
+    /* Round up so the timeout has passed when the caller wakes up */
+    return wait < 0 ? -1 : (int)((wait + 999) / 1000);
+}
+
+bool bs_handle_events(int timeout_ms, bs_error_t* error) {
+    bs_error_t err = device_events(NULL, timeout_ms < 0 ? -1 :
+                                   (int64_t)timeout_ms * 1000, NULL);
+    if (error) *error = err;
+    return err == BS_NO_ERROR;
+}
+
+/* USB transport, using libusb asynchronous transfers */
+
+static void LIBUSB_CALL usb_transfer_cb(struct libusb_transfer* transfer) {
+    bs_transfer_t* t = transfer->user_data;
+    bs_error_t error;
+    switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        if (transfer->actual_length != t->length) {
+            error = BS_ERROR_COMM;
+        } else {
+            error = BS_NO_ERROR;
+        }
+        break;
+    default:
+        error = error_from_status(transfer->status);
+        break;
+    }
+    transfer_done(t, error);
+}
+
+static bool usb_alloc(bs_device_t* device, bs_transfer_t* t) {
+    usb_device_t* usb = device->priv;
+    struct libusb_transfer* transfer = libusb_alloc_transfer(0);
+    uint8_t* buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + t->length);
+    if (!transfer || !buffer) {
+        libusb_free_transfer(transfer);
+        free(buffer);
         return false;
     }
+    libusb_fill_control_setup(buffer, t->request_type, t->request, t->value,
+                              t->index, t->length);
+    libusb_fill_control_transfer(transfer, usb->handle, buffer,
+                                 usb_transfer_cb, t, t->timeout_ms);
+    transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    t->priv = transfer;
+    t->data = libusb_control_transfer_get_data(transfer);
+    return true;
+}
+
+static void usb_free(bs_transfer_t* t) {
+    libusb_free_transfer(t->priv);
+}
+
+static bs_error_t usb_submit(bs_device_t* device, bs_transfer_t* t) {
+    usb_device_t* usb = device->priv;
+    struct libusb_transfer* transfer = t->priv;
+    /* Handle might have changed since alloc if device was reconnected, and
+     * owned transfers are sent many times */
+    transfer->dev_handle = usb->handle;
+    transfer->timeout = t->timeout_ms;
+    return error_from_libusb(libusb_submit_transfer(transfer));
+}
+
+static void usb_cancel(bs_device_t* device UNUSED, bs_transfer_t* t) {
+    libusb_cancel_transfer(t->priv);
+}
+
+/* Open device if it is the BlinkStick with serial */
+static libusb_device_handle* usb_open_matching(libusb_device* device,
+                                               const char* serial) BS_NONULL;
+
+libusb_device_handle* usb_open_matching(libusb_device* device,
+                                        const char* serial) {
+    char tmp[256];
+    libusb_device_handle* handle = usb_open_serial(device, tmp, sizeof(tmp),
+                                                   NULL);
+    if (handle && strcmp(tmp, serial) != 0) {
+        libusb_close(handle);
+        handle = NULL;
+    }
+    return handle;
+}
+
+static bool usb_reconnect(bs_device_t* device) {
+    usb_device_t* usb = device->priv;
+    libusb_device_handle* handle = NULL;
+    libusb_device** devices;
+    libusb_device* found = NULL;
+    ssize_t count, i;
+    uint8_t ports[7], bus, address;
+    bool indexed;
+    count = libusb_get_device_list(usb->ctx, &devices);
+    if (count < 0) return false;
+    /* Most likely plugged back into the same port */
+    for (i = 0; !handle && i < count; i++) {
+        if (libusb_get_bus_number(devices[i]) == usb->bus &&
+            libusb_get_port_numbers(devices[i], ports, sizeof(ports)) ==
+            usb->port_count && usb->port_count > 0 &&
+            memcmp(ports, usb->ports, usb->port_count) == 0) {
+            handle = usb_open_matching(devices[i], device->serial);
+            if (handle) found = devices[i];
+        }
+    }
+    if (!handle && index_lookup(device->serial, &indexed, &bus, &address)) {
+        for (i = 0; indexed && !handle && i < count; i++) {
+            if (libusb_get_bus_number(devices[i]) == bus &&
+                libusb_get_device_address(devices[i]) == address) {
+                handle = usb_open_matching(devices[i], device->serial);
+                if (handle) found = devices[i];
+            }
+        }
+    } else {
+        for (i = 0; !handle && i < count; i++) {
+            handle = usb_open_matching(devices[i], device->serial);
+            if (handle) found = devices[i];
+        }
+    }
+    if (handle) {
+        usb->bus = libusb_get_bus_number(found);
+        usb->address = libusb_get_device_address(found);
+        usb->port_count = libusb_get_port_numbers(found, usb->ports,
+                                                  sizeof(usb->ports));
+    }
+    libusb_free_device_list(devices, 1);
+    if (!handle) return false;
+    libusb_close(usb->handle);
+    usb->handle = handle;
     return true;
 }
 
+static void usb_close(bs_device_t* device) {
+    usb_device_t* usb = device->priv;
+    libusb_close(usb->handle);
+    free(usb);
+    unref_glob();
+}
+
+static const bs_transport_t usb_transport = {
+    usb_alloc,
+    usb_free,
+    usb_submit,
+    usb_cancel,
+    usb_reconnect,
+    usb_close,
+};
+
+static bool async_transfer(bs_device_t* device, uint16_t value,
+                           const uint8_t* data, uint16_t length,
+                           bs_callback_t callback, void* userdata)
+    BS_NONULL_ARGS(1, 3);
+
+bool async_transfer(bs_device_t* device, uint16_t value,
+                    const uint8_t* data, uint16_t length,
+                    bs_callback_t callback, void* userdata) {
+    bool busy;
+    pthread_mutex_lock(&device->lock);
+    busy = device->pending >= device->max_pending;
+    pthread_mutex_unlock(&device->lock);
+    if (busy) {
+        device->last_error = BS_ERROR_BUSY;
+        return false;
+    }
+    return submit_transfer(device,
+                           LIBUSB_ENDPOINT_OUT |
+                           LIBUSB_REQUEST_TYPE_CLASS |
+                           LIBUSB_RECIPIENT_DEVICE,
+                           LIBUSB_REQUEST_SET_CONFIGURATION,
+                           value, 0, data, length, true, callback,
+                           userdata, DEADLINE_DEFAULT) != NULL;
+}
+
 static size_t max_count(bs_device_t* device) BS_NONULL;
 size_t max_count(bs_device_t* device) {
     switch (device->version) {
@@ -292,37 +1690,87 @@ size_t max_count(bs_device_t* device) {
     return 0;
 }
 
+uint8_t bs_get_channels(bs_device_t* device) {
+    switch (device->version) {
+    case BS_VERSION_BASIC:
+    case BS_VERSION_STRIP_SQUARE:
+        return 1;
+    case BS_VERSION_PRO:
+        switch (bs_get_mode(device)) {
+        case BS_MODE_MULTI:
+            return 3;
+        case -1:
+            return 0;
+        }
+        return 1;
+    case BS_VERSION_UNKOWN:
+        return 3;
+    }
+    return 0;
+}
+
+/* Check that channel and count (or index + 1) is valid for device */
+static bool valid_leds(bs_device_t* device, uint8_t channel, size_t count)
+    BS_NONULL;
+
+bool valid_leds(bs_device_t* device, uint8_t channel, size_t count) {
+    if (count > max_count(device) ||
+        (channel > 0 && channel >= bs_get_channels(device))) {
+        device->last_error = BS_ERROR_INVALID_PARAM;
+        return false;
+    }
+    return true;
+}
+
 bool bs_set_pro(bs_device_t* device, uint8_t index, bs_color_t color) {
+    return bs_set_pro_channel(device, 0, index, color);
+}
+
+bool bs_set_pro_channel(bs_device_t* device, uint8_t channel, uint8_t index,
+                        bs_color_t color) {
+    return set_pro_channel(device, channel, index, color, DEADLINE_DEFAULT);
+}
+
+bool set_pro_channel(bs_device_t* device, uint8_t channel, uint8_t index,
+                     bs_color_t color, int64_t deadline) {
     uint8_t data[6];
-    if (index == 0) {
+    if (cache_same(device, channel, index, 1, &color, 1)) return true;
+    if (index == 0 && channel == 0) {
         data[0] = 0;
         data[1] = color.red;
         data[2] = color.green;
         data[3] = color.blue;
-        return bs_ctrl_transfer(device,
-                                LIBUSB_ENDPOINT_OUT |
-                                LIBUSB_REQUEST_TYPE_CLASS |
-                                LIBUSB_RECIPIENT_DEVICE,
-                                LIBUSB_REQUEST_SET_CONFIGURATION,
-                                1, 0, data, 4);
-    } else {
-        if (index >= max_count(device)) {
-            device->last_error = BS_ERROR_INVALID_PARAM;
+        correct(device, data + 1, 1, false);
+        limit(device, 0, 0, 1, data + 1);
+        if (!bs_ctrl_transfer(device,
+                              LIBUSB_ENDPOINT_OUT |
+                              LIBUSB_REQUEST_TYPE_CLASS |
+                              LIBUSB_RECIPIENT_DEVICE,
+                              LIBUSB_REQUEST_SET_CONFIGURATION,
+                              1, 0, data, 4, deadline)) {
             return false;
         }
+    } else {
+        if (!valid_leds(device, channel, index + 1)) return false;
         data[0] = 5;
-        data[1] = 0;  /* Channel */
+        data[1] = channel;
         data[2] = index;
         data[3] = color.red;
         data[4] = color.green;
         data[5] = color.blue;
-        return bs_ctrl_transfer(device,
-                                LIBUSB_ENDPOINT_OUT |
-                                LIBUSB_REQUEST_TYPE_CLASS |
-                                LIBUSB_RECIPIENT_DEVICE,
-                                LIBUSB_REQUEST_SET_CONFIGURATION,
-                                5, 0, data, 6);
+        correct(device, data + 3, 1, false);
+        limit(device, channel, index, 1, data + 3);
+        if (!bs_ctrl_transfer(device,
+                              LIBUSB_ENDPOINT_OUT |
+                              LIBUSB_REQUEST_TYPE_CLASS |
+                              LIBUSB_RECIPIENT_DEVICE,
+                              LIBUSB_REQUEST_SET_CONFIGURATION,
+                              5, 0, data, 6, deadline)) {
+            return false;
+        }
     }
+    cache_put(device, channel, index, 1, &color, 1);
+    return true;
 }
 
 static uint8_t report_id(uint8_t count) {
@@ -350,6 +1798,22 @@ static size_t min_size(uint8_t count) {
 }
 
 bool bs_get_pro(bs_device_t* device, uint8_t index, bs_color_t* color) {
+    return bs_get_pro_channel(device, 0, index, color);
+}
+
+bool bs_get_pro_channel(bs_device_t* device, uint8_t channel, uint8_t index,
+                        bs_color_t* color) {
+    return get_pro_channel(device, channel, index, color, DEADLINE_DEFAULT);
+}
+
+bool get_pro_channel(bs_device_t* device, uint8_t channel, uint8_t index,
+                     bs_color_t* color, int64_t deadline) {
+    if (cache_get(device, channel, index, 1, color)) return true;
+    if (channel > 0) {
+        /* Reports can only be read for the first channel */
+        device->last_error = BS_ERROR_NOT_SUPPORTED;
+        return false;
+    }
     if (index == 0) {
         uint8_t data[4];
         if (!bs_ctrl_transfer(device,
@@ -357,71 +1821,951 @@ bool bs_get_pro(bs_device_t* device, uint8_t index, bs_color_t* color) {
                               LIBUSB_REQUEST_TYPE_CLASS |
                               LIBUSB_RECIPIENT_DEVICE,
                               LIBUSB_REQUEST_CLEAR_FEATURE,
-                              1, 0, data, sizeof(data))) {
+                              1, 0, data, sizeof(data), deadline)) {
             return false;
         }
         color->red = data[1];
         color->green = data[2];
         color->blue = data[3];
+        if (!adjusting(device)) cache_put(device, 0, 0, 1, color, 1);
         return true;
     } else {
         uint8_t data[2 + 64 * 3];
-        if (index >= max_count(device)) {
-            device->last_error = BS_ERROR_INVALID_PARAM;
-            return false;
-        }
+        if (!valid_leds(device, 0, index + 1)) return false;
         if (!bs_ctrl_transfer(device,
                               LIBUSB_ENDPOINT_IN |
                               LIBUSB_REQUEST_TYPE_CLASS |
                               LIBUSB_RECIPIENT_DEVICE,
                               LIBUSB_REQUEST_CLEAR_FEATURE,
                               report_id(index + 1), 0,
-                              data, min_size(index + 1))) {
+                              data, min_size(index + 1), deadline)) {
             return false;
         }
         color->red = data[2 + index * 3 + 1];
         color->green = data[2 + index * 3 + 0];
         color->blue = data[2 + index * 3 + 2];
+        cache_put_report(device, 0, data + 2,
+                         (min_size(index + 1) - 2) / 3);
         return true;
     }
 }
 
+/* Fill data with the report for setting count leds on channel,
+ * return size of report or zero if count is invalid for device */
+static size_t pack_many(bs_device_t* device, uint8_t channel, uint8_t count,
+                        const bs_color_t* color, uint8_t* data) BS_NONULL;
+
+size_t pack_many(bs_device_t* device, uint8_t channel, uint8_t count,
+                 const bs_color_t* color, uint8_t* data) {
+    size_t o, size;
+    if (!valid_leds(device, channel, count)) return 0;
+    data[0] = 0;
+    data[1] = channel;
+    bs_pack_grb(data + 2, color, count);
+    correct(device, data + 2, count, true);
+    o = 2 + count * 3;
+    size = min_size(count);
+    memset(data + o, 0, size - o);
+    return size;
+}
+
 bool bs_set_many(bs_device_t* device, uint8_t count, const bs_color_t* color) {
+    return bs_set_many_channel(device, 0, count, color);
+}
+
+bool bs_set_many_timed(bs_device_t* device, uint8_t count,
+                       const bs_color_t* color, unsigned int timeout_ms) {
+    return set_many_channel(device, 0, count, color,
+                            call_deadline(timeout_ms));
+}
+
+bool bs_set_many_channel(bs_device_t* device, uint8_t channel, uint8_t count,
+                         const bs_color_t* color) {
+    return set_many_channel(device, channel, count, color, DEADLINE_DEFAULT);
+}
+
+bool set_many_channel(bs_device_t* device, uint8_t channel, uint8_t count,
+                      const bs_color_t* color, int64_t deadline) {
     uint8_t data[2 + 64 * 3];
+    uint8_t padded;
+    size_t size;
+    if (count == 0) return true;
+    if (count == 1 && channel == 0) {
+        return set_color(device, color[0], deadline);
+    }
+    padded = (min_size(count) - 2) / 3;
+    if (cache_same(device, channel, 0, count, color, padded)) return true;
+    size = pack_many(device, channel, count, color, data);
+    if (size == 0) return false;
+    limit(device, channel, 0, padded, data + 2);
+    if (device->mailbox && device->mailbox->running) {
+        mailbox_post(device, channel, report_id(count), data, size);
+    } else if (!bs_ctrl_transfer(device,
+                                 LIBUSB_ENDPOINT_OUT |
+                                 LIBUSB_REQUEST_TYPE_CLASS |
+                                 LIBUSB_RECIPIENT_DEVICE,
+                                 LIBUSB_REQUEST_SET_CONFIGURATION,
+                                 report_id(count), 0, data, size,
+                                 deadline)) {
+        return false;
+    }
+    cache_put(device, channel, 0, count, color, padded);
+    return true;
+}
+
+/* Fill in report for segment i, return false if segment is invalid */
+static bool pack_segment(bs_device_t* device, segments_t* segments, size_t i)
+    BS_NONULL;
+
+bool pack_segment(bs_device_t* device, segments_t* segments, size_t i) {
+    const uint8_t channel = segments->channel[i];
+    const uint8_t count = segments->leds[i];
+    const bs_color_t* color = segments->color[i];
+    size_t size;
+    if (count == 1 && channel == 0) {
+        /* Same report as bs_set(), works on all devices */
+        segments->value[i] = 1;
+        segments->length[i] = 4;
+        segments->padded[i] = 1;
+        segments->data[i][0] = 0;
+        segments->data[i][1] = color->red;
+        segments->data[i][2] = color->green;
+        segments->data[i][3] = color->blue;
+        correct(device, segments->data[i] + 1, 1, false);
+        return true;
+    }
+    size = pack_many(device, channel, count, color, segments->data[i]);
+    if (size == 0) return false;
+    segments->value[i] = report_id(count);
+    segments->length[i] = size;
+    segments->padded[i] = (size - 2) / 3;
+    return true;
+}
+
+bool segments_start(bs_device_t* device, segments_t* segments) {
+    power_range_t ranges[3];
+    bool ret = segments_pack(device, segments);
+    power_limit(device, ranges, power_ranges(segments, ranges));
+    return segments_send(device, segments) && ret;
+}
+
+bool segments_pack(bs_device_t* device, segments_t* segments) {
+    size_t i;
+    bool ret = true;
+    for (i = 0; i < segments->count; i++) {
+        const uint8_t count = segments->leds[i];
+        segments->error[i] = BS_NO_ERROR;
+        segments->transfer[i] = NULL;
+        segments->send[i] = false;
+        if (count == 0) continue;
+        if (!pack_segment(device, segments, i)) {
+            segments->error[i] = device->last_error;
+            ret = false;
+            continue;
+        }
+        segments->send[i] = !cache_same(device, segments->channel[i], 0,
+                                        count, segments->color[i],
+                                        segments->padded[i]);
+    }
+    return ret;
+}
+
+bool segments_send(bs_device_t* device, segments_t* segments) {
+    const bool mailbox = device->mailbox && device->mailbox->running;
+    size_t i;
+    bool ret = true;
+    for (i = 0; i < segments->count; i++) {
+        const uint8_t channel = segments->channel[i];
+        const uint8_t count = segments->leds[i];
+        if (!segments->send[i]) continue;
+        if (mailbox) {
+            mailbox_post(device, channel, segments->value[i],
+                         segments->data[i], segments->length[i]);
+            cache_put(device, channel, 0, count, segments->color[i],
+                      segments->padded[i]);
+            continue;
+        }
+        segments->transfer[i] = submit_transfer(device,
+                                                LIBUSB_ENDPOINT_OUT |
+                                                LIBUSB_REQUEST_TYPE_CLASS |
+                                                LIBUSB_RECIPIENT_DEVICE,
+                                                LIBUSB_REQUEST_SET_CONFIGURATION,
+                                                segments->value[i], 0,
+                                                segments->data[i],
+                                                segments->length[i],
+                                                false, NULL, NULL,
+                                                segments->deadline);
+        if (!segments->transfer[i]) {
+            segments->error[i] = device->last_error;
+            ret = false;
+        }
+    }
+    return ret;
+}
+
+/* Wait for a report started with submit_transfer(), if the device was
+ * disconnected it is reconnected and the report sent again, unless it is
+ * reconnected in the background. Returns result */
+static bs_error_t finish_report(bs_device_t* device, bs_transfer_t* t,
+                                uint16_t value, uint8_t* data,
+                                uint16_t length, int64_t deadline) BS_NONULL;
+
+bs_error_t finish_report(bs_device_t* device, bs_transfer_t* t,
+                         uint16_t value, uint8_t* data, uint16_t length,
+                         int64_t deadline) {
+    bs_error_t error;
+    wait_transfer(t);
+    if (!is_completed(t)) {
+        /* Leak, see sync_transfer */
+        return BS_ERROR_IO;
+    }
+    error = t->error;
+    free_transfer(t);
+    if (error == BS_ERROR_DISCONNECTED) {
+        if (device->background_reconnect) {
+            /* Already started by transfer_done(), a retry would fail fast
+             * until it is done */
+            return error;
+        }
+        if (reconnect_now(device)) {
+            stats_add(device, STATS_RETRIES, 1);
+            error = sync_transfer(device,
+                                  LIBUSB_ENDPOINT_OUT |
+                                  LIBUSB_REQUEST_TYPE_CLASS |
+                                  LIBUSB_RECIPIENT_DEVICE,
+                                  LIBUSB_REQUEST_SET_CONFIGURATION,
+                                  value, 0, data, length, deadline);
+        }
+    }
+    return error;
+}
+
+bool segments_finish(bs_device_t* device, segments_t* segments) {
+    size_t i;
+    bool ret = true;
+    for (i = 0; i < segments->count; i++) {
+        bs_transfer_t* t = segments->transfer[i];
+        const uint8_t count = segments->leds[i];
+        if (t) {
+            segments->error[i] = finish_report(device, t, segments->value[i],
+                                               segments->data[i],
+                                               segments->length[i],
+                                               segments->deadline);
+            segments->transfer[i] = NULL;
+            if (segments->error[i] == BS_NO_ERROR) {
+                cache_put(device, segments->channel[i], 0, count,
+                          segments->color[i], segments->padded[i]);
+            }
+        }
+        if (segments->error[i] != BS_NO_ERROR) ret = false;
+    }
+    return ret;
+}
+
+bool bs_set_all_channels(bs_device_t* device, uint8_t count,
+                         const bs_color_t* color) {
+    segments_t segments;
+    uint8_t channels, i;
+    bool ret;
+    if (count == 0) return true;
+    channels = bs_get_channels(device);
+    if (channels == 0) return false;
+    segments.count = channels;
+    segments.deadline = DEADLINE_DEFAULT;
+    for (i = 0; i < channels; i++) {
+        segments.channel[i] = i;
+        segments.leds[i] = count;
+        segments.color[i] = color + i * count;
+    }
+    ret = segments_start(device, &segments);
+    return segments_finish(device, &segments) && ret;
+}
+
+/* Packets in a control transfer of length bytes to a low speed device,
+ * data is sent eight bytes at a time between the setup and status stages */
+static unsigned int transfer_packets(size_t length) {
+    return 2 + (length + 7) / 8;
+}
+
+static unsigned int count_bits(uint64_t bits) {
+    unsigned int count = 0;
+    for (; bits; bits &= bits - 1) count++;
+    return count;
+}
+
+/* Bit set for each of count leds on channel where color differs from
+ * previous, or from the shadow cache if previous is NULL */
+static uint64_t changed_leds(bs_device_t* device, uint8_t channel,
+                             uint8_t count, const bs_color_t* previous,
+                             const bs_color_t* color) BS_NONULL_ARGS(1, 5);
+
+uint64_t changed_leds(bs_device_t* device, uint8_t channel, uint8_t count,
+                      const bs_color_t* previous, const bs_color_t* color) {
+    const bs_color_t* shadow = device->shadow[channel];
+    uint64_t changed = 0, valid = 0;
     uint8_t i;
-    size_t o, size;
+    if (previous) {
+        for (i = 0; i < count; i++) {
+            if (memcmp(previous + i, color + i, sizeof(bs_color_t)) != 0) {
+                changed |= UINT64_C(1) << i;
+            }
+        }
+        return changed;
+    }
+    pthread_mutex_lock(&device->lock);
+    /* Same as cache_same(), with a budget everything is sent */
+    if (device->cache && !device->own_power && !device->group_power) {
+        valid = device->shadow_valid[channel];
+    }
+    for (i = 0; i < count; i++) {
+        if (!(valid & (UINT64_C(1) << i)) ||
+            memcmp(shadow + i, color + i, sizeof(bs_color_t)) != 0) {
+            changed |= UINT64_C(1) << i;
+        }
+    }
+    pthread_mutex_unlock(&device->lock);
+    return changed;
+}
+
+/* Number of leds, from index 0, to send in one report when updating the
+ * changed leds among count, the other changed leds are sent with a report
+ * each. Picks the plan with the fewest packets */
+static uint8_t plan_update(uint8_t count, uint64_t changed) {
+    static const uint8_t sizes[] = { 8, 16, 32, 64 };
+    const unsigned int single = transfer_packets(6);
+    unsigned int best_cost = count_bits(changed) * single;
+    uint8_t best = 0;
+    size_t i;
+    for (i = 0; i < sizeof(sizes); i++) {
+        /* Reports from 0 up to count, the last one is padded with black
+         * just as bs_set_many_channel() would */
+        const uint8_t n = sizes[i] < count ? sizes[i] : count;
+        const uint64_t rest = n < 64 ? changed >> n : 0;
+        const unsigned int cost = transfer_packets(min_size(n)) +
+            count_bits(rest) * single;
+        if (cost < best_cost) {
+            best = n;
+            best_cost = cost;
+        }
+        if (n == count) break;
+    }
+    return best;
+}
+
+/* A report sent by bs_update() */
+typedef struct update_report_t {
+    bs_transfer_t* transfer;
+    uint16_t value;
+    uint16_t length;
+    uint8_t index;  /* First led in report */
+    uint8_t count;  /* Leds in report */
+    uint8_t padded;  /* Leds set by report, black after count */
+    uint8_t* data;
+} update_report_t;
+
+bool bs_update(bs_device_t* device, uint8_t channel, uint8_t count,
+               const bs_color_t* previous, const bs_color_t* color) {
+    update_report_t report[65];
+    uint8_t bulk[2 + 64 * 3];
+    uint8_t single[64][6];
+    uint64_t changed;
+    size_t n = 0, i;
+    uint8_t size;
+    bool ret = true;
     if (count == 0) return true;
-    if (count == 1) return bs_set_pro(device, 0, color[0]);
-    if (count > max_count(device)) {
+    if (!valid_leds(device, channel, count)) return false;
+    changed = changed_leds(device, channel, count, previous, color);
+    if (changed == 0) return true;
+    if (device->version == BS_VERSION_BASIC || count == 1 ||
+        (device->mailbox && device->mailbox->running)) {
+        /* Nothing to pick from, or only one report per channel can wait in
+         * the mailbox */
+        return set_many_channel(device, channel, count, color,
+                                DEADLINE_DEFAULT);
+    }
+    size = plan_update(count, changed);
+    if (size > 0) {
+        report[n].value = report_id(size);
+        report[n].length = pack_many(device, channel, size, color, bulk);
+        report[n].index = 0;
+        report[n].count = size;
+        report[n].padded = (report[n].length - 2) / 3;
+        report[n].data = bulk;
+        limit(device, channel, 0, report[n].padded, bulk + 2);
+        n++;
+    }
+    for (i = size; i < count; i++) {
+        uint8_t* data = single[i];
+        if (!(changed & (UINT64_C(1) << i))) continue;
+        if (channel == 0 && i == 0) {
+            /* Same as set_pro_channel() */
+            data[0] = 0;
+            data[1] = color[i].red;
+            data[2] = color[i].green;
+            data[3] = color[i].blue;
+            correct(device, data + 1, 1, false);
+            limit(device, 0, 0, 1, data + 1);
+            report[n].value = 1;
+            report[n].length = 4;
+        } else {
+            data[0] = 5;
+            data[1] = channel;
+            data[2] = i;
+            data[3] = color[i].red;
+            data[4] = color[i].green;
+            data[5] = color[i].blue;
+            correct(device, data + 3, 1, false);
+            limit(device, channel, i, 1, data + 3);
+            report[n].value = 5;
+            report[n].length = 6;
+        }
+        report[n].index = i;
+        report[n].count = 1;
+        report[n].padded = 1;
+        report[n].data = data;
+        n++;
+    }
+    /* Start all reports first, then wait for them */
+    for (i = 0; i < n; i++) {
+        report[i].transfer = submit_transfer(device,
+                                             LIBUSB_ENDPOINT_OUT |
+                                             LIBUSB_REQUEST_TYPE_CLASS |
+                                             LIBUSB_RECIPIENT_DEVICE,
+                                             LIBUSB_REQUEST_SET_CONFIGURATION,
+                                             report[i].value, 0,
+                                             report[i].data,
+                                             report[i].length,
+                                             false, NULL, NULL,
+                                             DEADLINE_DEFAULT);
+        if (!report[i].transfer) ret = false;
+    }
+    for (i = 0; i < n; i++) {
+        bs_error_t error;
+        if (!report[i].transfer) continue;
+        error = finish_report(device, report[i].transfer, report[i].value,
+                              report[i].data, report[i].length,
+                              DEADLINE_DEFAULT);
+        if (error != BS_NO_ERROR) {
+            if (ret) device->last_error = error;
+            ret = false;
+            continue;
+        }
+        cache_put(device, channel, report[i].index, report[i].count,
+                  color + report[i].index, report[i].padded);
+    }
+    return ret;
+}
+
+size_t bs_get_segments(bs_device_t* device, size_t count) {
+    const size_t leds = max_count(device);
+    const uint8_t channels = bs_get_channels(device);
+    if (leds == 0 || channels == 0 || count > leds * channels) {
         device->last_error = BS_ERROR_INVALID_PARAM;
+        return 0;
+    }
+    return (count + leds - 1) / leds;
+}
+
+/* Fill in segments for a frame of count leds, return number of segments or
+ * zero in case of error */
+static size_t split_frame(bs_device_t* device, size_t count,
+                          bs_segment_t* segments) BS_NONULL;
+
+size_t split_frame(bs_device_t* device, size_t count,
+                   bs_segment_t* segments) {
+    const size_t n = bs_get_segments(device, count);
+    const size_t leds = max_count(device);
+    size_t i;
+    for (i = 0; i < n; i++) {
+        segments[i].channel = i;
+        segments[i].offset = i * leds;
+        segments[i].count = count - segments[i].offset > leds ?
+            leds : count - segments[i].offset;
+        segments[i].error = BS_NO_ERROR;
+    }
+    return n;
+}
+
+bool segments_frame(bs_device_t* device, size_t count,
+                    const bs_color_t* color, segments_t* segments,
+                    bs_segment_t* result) {
+    size_t i;
+    segments->count = split_frame(device, count, result);
+    if (segments->count == 0) return false;
+    segments->deadline = DEADLINE_DEFAULT;
+    for (i = 0; i < segments->count; i++) {
+        segments->channel[i] = result[i].channel;
+        segments->leds[i] = result[i].count;
+        segments->color[i] = color + result[i].offset;
+    }
+    return true;
+}
+
+static bool set_leds(bs_device_t* device, size_t count,
+                     const bs_color_t* color, bs_segment_t* result,
+                     int64_t deadline) BS_NONULL_ARGS(1, 3);
+
+bool bs_set_leds(bs_device_t* device, size_t count, const bs_color_t* color,
+                 bs_segment_t* result) {
+    return set_leds(device, count, color, result, DEADLINE_DEFAULT);
+}
+
+bool bs_set_leds_timed(bs_device_t* device, size_t count,
+                       const bs_color_t* color, bs_segment_t* result,
+                       unsigned int timeout_ms) {
+    return set_leds(device, count, color, result, call_deadline(timeout_ms));
+}
+
+bool set_leds(bs_device_t* device, size_t count, const bs_color_t* color,
+              bs_segment_t* result, int64_t deadline) {
+    bs_segment_t tmp[3];
+    segments_t segments;
+    size_t i;
+    bool ret;
+    if (count == 0) return true;
+    if (!result) result = tmp;
+    if (!segments_frame(device, count, color, &segments, result)) {
         return false;
     }
+    segments.deadline = deadline;
+    ret = segments_start(device, &segments);
+    ret = segments_finish(device, &segments) && ret;
+    for (i = 0; i < segments.count; i++) result[i].error = segments.error[i];
+    return ret;
+}
+
+bool bs_get_leds(bs_device_t* device, size_t count, bs_color_t* color,
+                 bs_segment_t* segments) {
+    bs_segment_t tmp[3];
+    size_t n, i;
+    bool ret = true;
+    if (count == 0) return true;
+    if (!segments) segments = tmp;
+    n = split_frame(device, count, segments);
+    if (n == 0) return false;
+    for (i = 0; i < n; i++) {
+        if (!bs_get_many_channel(device, segments[i].channel,
+                                 segments[i].count,
+                                 color + segments[i].offset)) {
+            segments[i].error = device->last_error;
+            ret = false;
+        }
+    }
+    return ret;
+}
+
+bool bs_set_async(bs_device_t* device, bs_color_t color,
+                  bs_callback_t callback, void* userdata) {
+    uint8_t data[4];
     data[0] = 0;
-    data[1] = 0;  /* Channel */
-    o = 2;
-    for (i = 0; i < count; i++) {
-        data[o++] = color[i].green;
-        data[o++] = color[i].red;
-        data[o++] = color[i].blue;
+    data[1] = color.red;
+    data[2] = color.green;
+    data[3] = color.blue;
+    correct(device, data + 1, 1, false);
+    limit(device, 0, 0, 1, data + 1);
+    if (!async_transfer(device, 1, data, 4, callback, userdata)) return false;
+    cache_put(device, 0, 0, 1, &color, 1);
+    return true;
+}
+
+bool bs_set_many_async(bs_device_t* device, uint8_t count,
+                       const bs_color_t* color, bs_callback_t callback,
+                       void* userdata) {
+    uint8_t data[2 + 64 * 3];
+    size_t size;
+    if (count == 0) {
+        /* Same as bs_set_many(), there is nothing to wait for */
+        if (callback) callback(device, BS_NO_ERROR, userdata);
+        return true;
     }
-    size = min_size(count);
-    memset(data + o, 0, size - o);
-    return bs_ctrl_transfer(device,
-                            LIBUSB_ENDPOINT_OUT |
-                            LIBUSB_REQUEST_TYPE_CLASS |
-                            LIBUSB_RECIPIENT_DEVICE,
-                            LIBUSB_REQUEST_SET_CONFIGURATION,
-                            report_id(count), 0, data, size);
+    if (count == 1) return bs_set_async(device, color[0], callback, userdata);
+    size = pack_many(device, 0, count, color, data);
+    if (size == 0) return false;
+    limit(device, 0, 0, (size - 2) / 3, data + 2);
+    if (!async_transfer(device, report_id(count), data, size, callback,
+                        userdata)) {
+        return false;
+    }
+    cache_put(device, 0, 0, count, color, (size - 2) / 3);
+    return true;
+}
+
+struct bs_frame_t {
+    bs_transfer_t transfer;  /* Sent every time, data is the frame */
+    uint8_t channel;
+    uint8_t count;
+};
+
+bs_frame_t* bs_frame_new(bs_device_t* device, uint8_t channel, uint8_t count,
+                         bs_error_t* error) {
+    bs_frame_t* frame;
+    bs_transfer_t* t;
+    if (device->version == BS_VERSION_BASIC) {
+        /* Only has the single color report */
+        if (error) *error = BS_ERROR_NOT_SUPPORTED;
+        return NULL;
+    }
+    if (count == 0 || !valid_leds(device, channel, count)) {
+        if (error) *error = BS_ERROR_INVALID_PARAM;
+        return NULL;
+    }
+    frame = calloc(1, sizeof(bs_frame_t));
+    if (!frame) {
+        if (error) *error = BS_ERROR_NO_MEM;
+        return NULL;
+    }
+    t = &frame->transfer;
+    t->device = device;
+    t->request_type = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS |
+        LIBUSB_RECIPIENT_DEVICE;
+    t->request = LIBUSB_REQUEST_SET_CONFIGURATION;
+    t->value = report_id(count);
+    t->length = min_size(count);
+    t->owned = true;
+    t->completed = 1;
+    if (!device->transport->alloc(device, t)) {
+        free(frame);
+        if (error) *error = BS_ERROR_NO_MEM;
+        return NULL;
+    }
+    /* Same layout as pack_many(), padding stays black */
+    memset(t->data, 0, t->length);
+    t->data[1] = channel;
+    frame->channel = channel;
+    frame->count = count;
+    if (error) *error = BS_NO_ERROR;
+    return frame;
+}
+
+void bs_frame_free(bs_frame_t* frame) {
+    bs_transfer_t* t;
+    if (!frame) return;
+    t = &frame->transfer;
+    if (!is_completed(t)) {
+        t->device->transport->cancel(t->device, t);
+        wait_transfer(t);
+        /* Leak, see sync_transfer */
+        if (!is_completed(t)) return;
+    }
+    t->device->transport->free(t);
+    free(frame);
+}
+
+uint8_t* bs_frame_pixels(bs_frame_t* frame) {
+    return frame->transfer.data + 2;
+}
+
+uint8_t bs_frame_count(bs_frame_t* frame) {
+    return frame->count;
+}
+
+void bs_frame_set(bs_frame_t* frame, uint8_t index, bs_color_t color) {
+    uint8_t* pixel = bs_frame_pixels(frame) + index * BS_FRAME_STRIDE;
+    assert(index < frame->count);
+    pixel[BS_FRAME_RED] = color.red;
+    pixel[BS_FRAME_GREEN] = color.green;
+    pixel[BS_FRAME_BLUE] = color.blue;
+}
+
+bs_color_t bs_frame_get(bs_frame_t* frame, uint8_t index) {
+    const uint8_t* pixel = bs_frame_pixels(frame) + index * BS_FRAME_STRIDE;
+    bs_color_t color;
+    assert(index < frame->count);
+    color.red = pixel[BS_FRAME_RED];
+    color.green = pixel[BS_FRAME_GREEN];
+    color.blue = pixel[BS_FRAME_BLUE];
+    return color;
+}
+
+/* Start sending frame, fails with BS_ERROR_BUSY if it is already being
+ * sent */
+static bool frame_start(bs_frame_t* frame, bool async, bs_callback_t callback,
+                        void* userdata) BS_NONULL_ARGS(1);
+
+bool frame_start(bs_frame_t* frame, bool async, bs_callback_t callback,
+                 void* userdata) {
+    bs_transfer_t* t = &frame->transfer;
+    bs_device_t* device = t->device;
+    bool busy;
+    pthread_mutex_lock(&device->lock);
+    if (device->reconnect && device->reconnect->running) {
+        pthread_mutex_unlock(&device->lock);
+        /* Fail fast, see submit_transfer */
+        device->last_error = BS_ERROR_DISCONNECTED;
+        return false;
+    }
+    busy = !t->completed || (async && device->pending >= device->max_pending);
+    t->timeout_ms = device->timeout_ms;
+    /* Colors are written in place, the cache can not know what is sent */
+    device->shadow_valid[frame->channel] = 0;
+    pthread_mutex_unlock(&device->lock);
+    if (busy) {
+        device->last_error = BS_ERROR_BUSY;
+        return false;
+    }
+    t->async = async;
+    t->callback = callback;
+    t->userdata = userdata;
+    t->error = BS_NO_ERROR;
+    return start_transfer(device, t);
+}
+
+bool bs_frame_send(bs_frame_t* frame) {
+    bs_transfer_t* t = &frame->transfer;
+    bs_device_t* device = t->device;
+    if (!frame_start(frame, false, NULL, NULL)) return false;
+    wait_transfer(t);
+    if (!is_completed(t)) {
+        /* Leaked, see sync_transfer, the frame stays busy */
+        device->last_error = BS_ERROR_IO;
+        return false;
+    }
+    if (t->error == BS_ERROR_DISCONNECTED) {
+        /* Retry with reconnect, see segments_finish() */
+        return bs_ctrl_transfer(device, t->request_type, t->request, t->value,
+                                t->index, t->data, t->length,
+                                DEADLINE_DEFAULT);
+    }
+    return t->error == BS_NO_ERROR;
+}
+
+bool bs_frame_send_async(bs_frame_t* frame, bs_callback_t callback,
+                         void* userdata) {
+    return frame_start(frame, true, callback, userdata);
+}
+
+bool mailbox_post(bs_device_t* device, uint8_t channel, uint16_t value,
+                  const uint8_t* data, uint16_t length) {
+    bs_mailbox_t* mailbox = device->mailbox;
+    pthread_mutex_lock(&device->lock);
+    if (mailbox->slot[channel].full) mailbox->stats.dropped++;
+    mailbox->stats.submitted++;
+    mailbox->slot[channel].value = value;
+    mailbox->slot[channel].length = length;
+    memcpy(mailbox->slot[channel].data, data, length);
+    mailbox->slot[channel].full = true;
+    pthread_cond_signal(&mailbox->cond);
+    pthread_mutex_unlock(&device->lock);
+    return true;
+}
+
+/* Return first channel with a full slot or -1 if all are empty */
+static int mailbox_next(bs_mailbox_t* mailbox) {
+    int channel;
+    for (channel = 0; channel < 3; channel++) {
+        if (mailbox->slot[channel].full) return channel;
+    }
+    return -1;
+}
+
+static void* mailbox_writer(void* arg) {
+    bs_device_t* device = arg;
+    bs_mailbox_t* mailbox = device->mailbox;
+    uint8_t data[2 + 64 * 3];
+    uint16_t value, length;
+    int channel;
+    bool ret;
+    pthread_mutex_lock(&device->lock);
+    while (true) {
+        while ((channel = mailbox_next(mailbox)) < 0 && !mailbox->stop) {
+            pthread_cond_wait(&mailbox->cond, &device->lock);
+        }
+        if (channel < 0) break;
+        value = mailbox->slot[channel].value;
+        length = mailbox->slot[channel].length;
+        memcpy(data, mailbox->slot[channel].data, length);
+        mailbox->slot[channel].full = false;
+        pthread_mutex_unlock(&device->lock);
+        ret = bs_ctrl_transfer(device,
+                               LIBUSB_ENDPOINT_OUT |
+                               LIBUSB_REQUEST_TYPE_CLASS |
+                               LIBUSB_RECIPIENT_DEVICE,
+                               LIBUSB_REQUEST_SET_CONFIGURATION,
+                               value, 0, data, length, DEADLINE_DEFAULT);
+        pthread_mutex_lock(&device->lock);
+        if (ret) {
+            mailbox->stats.sent++;
+        } else {
+            mailbox->stats.failed++;
+        }
+    }
+    pthread_mutex_unlock(&device->lock);
+    return NULL;
+}
+
+bool bs_set_mailbox(bs_device_t* device, bool enable) {
+    int channel;
+    if (!enable) {
+        stop_mailbox(device);
+        return true;
+    }
+    if (device->mailbox) {
+        if (device->mailbox->running) return true;
+    } else {
+        device->mailbox = calloc(1, sizeof(bs_mailbox_t));
+        if (!device->mailbox) {
+            device->last_error = BS_ERROR_NO_MEM;
+            return false;
+        }
+        pthread_cond_init(&device->mailbox->cond, NULL);
+    }
+    device->mailbox->stop = false;
+    for (channel = 0; channel < 3; channel++) {
+        device->mailbox->slot[channel].full = false;
+    }
+    if (pthread_create(&device->mailbox->thread, NULL, mailbox_writer,
+                       device)) {
+        device->last_error = BS_ERROR_NO_MEM;
+        return false;
+    }
+    device->mailbox->running = true;
+    return true;
+}
+
+void stop_mailbox(bs_device_t* device) {
+    bs_mailbox_t* mailbox = device->mailbox;
+    if (!mailbox || !mailbox->running) return;
+    pthread_mutex_lock(&device->lock);
+    mailbox->stop = true;
+    pthread_cond_signal(&mailbox->cond);
+    pthread_mutex_unlock(&device->lock);
+    pthread_join(mailbox->thread, NULL);
+    mailbox->running = false;
+}
+
+static void* reconnect_thread(void* arg) {
+    bs_device_t* device = arg;
+    bs_reconnect_t* reconnect = device->reconnect;
+    int64_t delay = 10000;
+    bool ret;
+    pthread_mutex_lock(&device->lock);
+    while (true) {
+        struct timespec ts;
+        int64_t until;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        until = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 + delay;
+        ts.tv_sec = until / 1000000;
+        ts.tv_nsec = (until % 1000000) * 1000;
+        while (!reconnect->stop &&
+               pthread_cond_timedwait(&reconnect->cond, &device->lock,
+                                      &ts) == 0) {
+        }
+        if (reconnect->stop) break;
+        /* Requests on the old connection must be done first, they are
+         * completed by whoever is handling events */
+        if (device->pending > 0) continue;
+        pthread_mutex_unlock(&device->lock);
+        ret = device->transport->reconnect(device);
+        pthread_mutex_lock(&device->lock);
+        if (ret) {
+            stats_add(device, STATS_RECONNECTS, 1);
+            memset(device->shadow_valid, 0, sizeof(device->shadow_valid));
+            break;
+        }
+        if (delay < 2000000) delay *= 2;
+    }
+    reconnect->running = false;
+    pthread_mutex_unlock(&device->lock);
+    return NULL;
+}
+
+void start_reconnect(bs_device_t* device) {
+    bs_reconnect_t* reconnect = device->reconnect;
+    if (!device->background_reconnect || device->closing) return;
+    if (!reconnect) {
+        reconnect = calloc(1, sizeof(bs_reconnect_t));
+        if (!reconnect) return;
+        pthread_cond_init(&reconnect->cond, NULL);
+        device->reconnect = reconnect;
+    }
+    if (reconnect->running) return;
+    if (reconnect->joinable) {
+        /* Done as running is false */
+        pthread_join(reconnect->thread, NULL);
+        reconnect->joinable = false;
+    }
+    reconnect->stop = false;
+    reconnect->running = true;
+    if (pthread_create(&reconnect->thread, NULL, reconnect_thread, device)) {
+        reconnect->running = false;
+        return;
+    }
+    reconnect->joinable = true;
+}
+
+void stop_reconnect(bs_device_t* device) {
+    bs_reconnect_t* reconnect;
+    pthread_t thread;
+    bool join;
+    pthread_mutex_lock(&device->lock);
+    reconnect = device->reconnect;
+    join = reconnect && reconnect->joinable;
+    if (join) {
+        /* Joined here, so start_reconnect() in another thread does not */
+        thread = reconnect->thread;
+        reconnect->joinable = false;
+        reconnect->stop = true;
+        pthread_cond_signal(&reconnect->cond);
+    }
+    pthread_mutex_unlock(&device->lock);
+    /* The thread clears running before it returns */
+    if (join) pthread_join(thread, NULL);
+}
+
+void bs_set_background_reconnect(bs_device_t* device, bool enable) {
+    /* Read by start_reconnect() when requests complete in other threads */
+    pthread_mutex_lock(&device->lock);
+    device->background_reconnect = enable;
+    pthread_mutex_unlock(&device->lock);
+    if (!enable) stop_reconnect(device);
+}
+
+bs_connection_t bs_connection(bs_device_t* device) {
+    bs_connection_t ret;
+    pthread_mutex_lock(&device->lock);
+    ret = device->reconnect && device->reconnect->running ?
+        BS_RECONNECTING : BS_CONNECTED;
+    pthread_mutex_unlock(&device->lock);
+    return ret;
+}
+
+void bs_mailbox_stats(bs_device_t* device, bs_mailbox_stats_t* stats) {
+    if (!device->mailbox) {
+        memset(stats, 0, sizeof(bs_mailbox_stats_t));
+        return;
+    }
+    pthread_mutex_lock(&device->lock);
+    *stats = device->mailbox->stats;
+    pthread_mutex_unlock(&device->lock);
 }
 
 bool bs_get_many(bs_device_t* device, uint8_t count, bs_color_t* color) {
+    return bs_get_many_channel(device, 0, count, color);
+}
+
+bool bs_get_many_timed(bs_device_t* device, uint8_t count, bs_color_t* color,
+                       unsigned int timeout_ms) {
+    return get_many_channel(device, 0, count, color,
+                            call_deadline(timeout_ms));
+}
+
+bool bs_get_many_channel(bs_device_t* device, uint8_t channel, uint8_t count,
+                         bs_color_t* color) {
+    return get_many_channel(device, channel, count, color, DEADLINE_DEFAULT);
+}
+
+bool get_many_channel(bs_device_t* device, uint8_t channel, uint8_t count,
+                      bs_color_t* color, int64_t deadline) {
     uint8_t data[2 + 64 * 3];
-    uint8_t i;
-    size_t o;
     if (count == 0) return true;
-    if (count == 1) return bs_get_pro(device, 0, color);
-    if (count > max_count(device)) {
-        device->last_error = BS_ERROR_INVALID_PARAM;
+    if (count == 1) {
+        return get_pro_channel(device, channel, 0, color, deadline);
+    }
+    if (cache_get(device, channel, 0, count, color)) return true;
+    if (!valid_leds(device, channel, count)) return false;
+    if (channel > 0) {
+        /* Reports can only be read for the first channel */
+        device->last_error = BS_ERROR_NOT_SUPPORTED;
         return false;
     }
     if (!bs_ctrl_transfer(device,
@@ -429,21 +2773,60 @@ bool bs_get_many(bs_device_t* device, uint8_t count, bs_color_t* color) {
                           LIBUSB_REQUEST_TYPE_CLASS |
                           LIBUSB_RECIPIENT_DEVICE,
                           LIBUSB_REQUEST_SET_CONFIGURATION,
-                          report_id(count), 0, data, min_size(count))) {
+                          report_id(count), 0, data, min_size(count),
+                          deadline)) {
         return false;
     }
-    i = count;
-    o = 2 + count * 3;
-    while (i > 0) {
-        i--;
-        color[i].blue = data[--o];
-        color[i].red = data[--o];
-        color[i].green = data[--o];
+    bs_unpack_grb(color, data + 2, count);
+    cache_put_report(device, 0, data + 2, (min_size(count) - 2) / 3);
+    return true;
+}
+
+/* Get the mode of a USB device from the capability cache, return false if
+ * not found */
+static bool load_caps(bs_device_t* device) BS_NONULL;
+
+bool load_caps(bs_device_t* device) {
+    usb_device_t* usb = device->priv;
+    bs_caps_t entry;
+    if (device->transport != &usb_transport ||
+        !caps_load(device->serial, usb->bus, usb->address, &entry) ||
+        entry.version != device->version) {
+        return false;
+    }
+    device->mode = entry.mode;
+    if (bs_get_max_leds(device) != entry.leds) {
+        /* Written by some other version of the library */
+        device->mode = -1;
+        return false;
     }
-    assert(o == 2);
     return true;
 }
 
+/* Update the capability cache entry of a USB device after a mode change,
+ * removing it if the mode is unknown */
+static void save_caps(bs_device_t* device) BS_NONULL;
+
+void save_caps(bs_device_t* device) {
+    usb_device_t* usb = device->priv;
+    bs_caps_t entry;
+    if (device->transport != &usb_transport) return;
+    if (device->mode < 0) {
+        caps_store(device->serial, usb->bus, usb->address, NULL);
+        return;
+    }
+    entry.version = device->version;
+    entry.mode = device->mode;
+    entry.leds = bs_get_max_leds(device);
+    caps_store(device->serial, usb->bus, usb->address, &entry);
+}
+
+void forget_mode(bs_device_t* device) {
+    if (device->version == BS_VERSION_BASIC) return;
+    device->mode = -1;
+    save_caps(device);
+}
+
 bool bs_set_mode(bs_device_t* device, uint8_t mode) {
     uint8_t data[2];
     switch (device->version) {
@@ -478,24 +2861,32 @@ bool bs_set_mode(bs_device_t* device, uint8_t mode) {
                           LIBUSB_ENDPOINT_OUT |
                           LIBUSB_REQUEST_TYPE_CLASS |
                           LIBUSB_RECIPIENT_DEVICE,
-                          LIBUSB_REQUEST_SET_CONFIGURATION, 4, 0, data, 2)) {
+                          LIBUSB_REQUEST_SET_CONFIGURATION, 4, 0, data, 2,
+                          DEADLINE_DEFAULT)) {
+        /* Might or might not have changed */
+        device->mode = -1;
+        save_caps(device);
         return false;
     }
     device->mode = mode;
+    save_caps(device);
+    bs_invalidate_cache(device);
     return true;
 }
 
 int bs_get_mode(bs_device_t* device) {
     uint8_t data[2];
-    if (device->mode < 0) {
+    if (device->mode < 0 && !load_caps(device)) {
         if (!bs_ctrl_transfer(device,
                               LIBUSB_ENDPOINT_IN |
                               LIBUSB_REQUEST_TYPE_CLASS |
                               LIBUSB_RECIPIENT_DEVICE,
-                              LIBUSB_REQUEST_CLEAR_FEATURE, 4, 0, data, 2)) {
+                              LIBUSB_REQUEST_CLEAR_FEATURE, 4, 0, data, 2,
+                              DEADLINE_DEFAULT)) {
             return -1;
         }
         device->mode = data[1];
+        save_caps(device);
     }
     return device->mode;
 }
@@ -554,6 +2945,26 @@ bs_error_t error_from_libusb(ssize_t err) {
     }
 }
 
+bs_error_t error_from_status(enum libusb_transfer_status status) {
+    switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        return BS_NO_ERROR;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return BS_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_CANCELLED:
+        return BS_ERROR_CANCELLED;
+    case LIBUSB_TRANSFER_STALL:
+        return BS_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return BS_ERROR_DISCONNECTED;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        return BS_ERROR_OVERFLOW;
+    case LIBUSB_TRANSFER_ERROR:
+    default:
+        return BS_ERROR_IO;
+    }
+}
+
 const char* bs_error_str(bs_error_t error) {
     switch (error) {
     case BS_NO_ERROR:
@@ -580,6 +2991,8 @@ const char* bs_error_str(bs_error_t error) {
         return "Insufficient memory";
     case BS_ERROR_NOT_SUPPORTED:
         return "Operation not supported";
+    case BS_ERROR_CANCELLED:
+        return "Operation cancelled";
     case BS_ERROR_UNKNOWN:
         break;
     }
@@ -30,8 +30,211 @@ typedef enum bs_error_t {
     BS_ERROR_NO_MEM, /* Insufficient memory */
     BS_ERROR_NOT_SUPPORTED, /* Operation not supported */
     BS_ERROR_UNKNOWN, /* Unknown error */
+    BS_ERROR_CANCELLED, /* Operation cancelled */
 } bs_error_t;
 
+/**
+ * Called when an asynchronous request has completed.
+ * Called from inside bs_handle_events(), bs_flush() or any of the blocking
+ * methods, blocking methods may not be called from the callback.
+ * For a USB device that may be a blocking call on any other USB device, in
+ * whatever thread is making it, see Thread safety below.
+ * A request with nothing to send completes before the call that started it
+ * returns.
+ * @param device device the request was made on
+ * @param error BS_NO_ERROR if the request was successful, BS_ERROR_CANCELLED
+ *              if the device was closed before the request completed
+ * @param userdata userdata given with the request
+ */
+typedef void (*bs_callback_t)(bs_device_t* device, bs_error_t error,
+                              void* userdata);
+
+/**
+ * File descriptor to poll for libbs events, see bs_get_pollfds()
+ */
+typedef struct bs_pollfd_t {
+    int fd;
+    short events; /* Events to poll for, POLLIN and/or POLLOUT */
+} bs_pollfd_t;
+
+/**
+ * Called when libbs starts using a new file descriptor.
+ * @param fd file descriptor to add
+ * @param events events to poll for, POLLIN and/or POLLOUT
+ * @param userdata userdata given to bs_set_pollfd_notifiers()
+ */
+typedef void (*bs_pollfd_added_t)(int fd, short events, void* userdata);
+
+/**
+ * Called when libbs stops using a file descriptor.
+ * @param fd file descriptor to remove
+ * @param userdata userdata given to bs_set_pollfd_notifiers()
+ */
+typedef void (*bs_pollfd_removed_t)(int fd, void* userdata);
+
+/**
+ * Kind of device index event, see bs_hotplug_subscribe()
+ */
+typedef enum bs_hotplug_event_t {
+    BS_HOTPLUG_ARRIVED = 1, /* Device was plugged in */
+    BS_HOTPLUG_LEFT = 2, /* Device was unplugged */
+} bs_hotplug_event_t;
+
+/**
+ * Called when a device is added to or removed from the device index.
+ * Called from the index thread, may not call bs_hotplug_subscribe(),
+ * bs_hotplug_unsubscribe() or bs_index_stop().
+ * @param serial serial of device
+ * @param event what happened to device
+ * @param userdata userdata given to bs_hotplug_subscribe()
+ */
+typedef void (*bs_hotplug_callback_t)(const char* serial,
+                                      bs_hotplug_event_t event,
+                                      void* userdata);
+
+/**
+ * Connection state of a device, see bs_connection()
+ */
+typedef enum bs_connection_t {
+    BS_CONNECTED = 0, /* Device is connected, or not yet known to be lost */
+    BS_RECONNECTING = 1, /* Device was lost and is being reconnected */
+} bs_connection_t;
+
+/**
+ * Color correction applied to all colors sent to a device, see
+ * bs_set_correction()
+ */
+typedef struct bs_correction_t {
+    double gamma; /* Output is input raised to gamma, 1.0 for linear */
+    uint8_t red; /* White balance, output for full red, 255 for unchanged */
+    uint8_t green; /* Same for green */
+    uint8_t blue; /* Same for blue */
+    uint8_t brightness; /* Scales all output, 255 for full brightness */
+} bs_correction_t;
+
+/** Number of buckets in bs_stats_t latency histogram */
+#define BS_STATS_BUCKETS (24)
+
+/**
+ * Request counters of a device, or all devices, see bs_stats().
+ */
+typedef struct bs_stats_t {
+    uint64_t requests; /* Requests sent and completed, failed or not */
+    uint64_t errors; /* Requests that failed, cancelled ones not included */
+    uint64_t timeouts; /* Requests that timed out, also counted in errors */
+    uint64_t bytes_out; /* Bytes sent by successful requests */
+    uint64_t bytes_in; /* Bytes received by successful requests */
+    uint64_t retries; /* Requests sent again after a disconnect */
+    uint64_t reconnects; /* Successful reconnects */
+    uint64_t interrupted; /* USB calls interrupted by a signal and restarted */
+    uint64_t latency_us; /* Total time of all requests, from submit */
+    /* Requests by time taken. latency[0] is requests done in less than 1 us,
+     * latency[i] those that took at least 2^(i-1) us but less than 2^i us,
+     * the last bucket also has all slower requests */
+    uint64_t latency[BS_STATS_BUCKETS];
+} bs_stats_t;
+
+/**
+ * A request from a trace file, see bs_replay().
+ */
+typedef struct bs_replay_t {
+    uint64_t start_us; /* When it was sent, from the start of the trace */
+    uint32_t recorded_us; /* Time it took to complete when recorded */
+    bs_error_t recorded_error; /* Result when recorded */
+    uint32_t latency_us; /* Time it took to complete when replayed */
+    bs_error_t error; /* Result when replayed */
+    uint8_t request_type; /* USB control request */
+    uint8_t request;
+    uint16_t value;
+    uint16_t index;
+    uint16_t length;
+} bs_replay_t;
+
+/**
+ * Called by bs_replay() when a replayed request has completed.
+ * @param request the request and its results
+ * @param userdata userdata argument given to bs_replay()
+ */
+typedef void (*bs_replay_callback_t)(const bs_replay_t* request,
+                                     void* userdata);
+
+/**
+ * Power budget for the leds of a device or group, see bs_set_power_budget().
+ * A WS2812 draws about 20 mA per color at full brightness and about 1 mA
+ * when black.
+ */
+typedef struct bs_power_t {
+    uint32_t budget_ma; /* Maximum current for all the leds */
+    uint16_t led_ma; /* Current of one color at 255, 0 for no limit */
+    uint16_t idle_ma; /* Current of a black led */
+    uint16_t leds; /* Number of leds, for the idle current */
+} bs_power_t;
+
+/**
+ * Result of a health check, see bs_probe()
+ */
+typedef enum bs_health_t {
+    BS_HEALTH_OK = 0, /* Device answered recently or to the probe */
+    BS_HEALTH_RECONNECTING = 1, /* Device was lost and is being reconnected */
+    BS_HEALTH_GONE = 2, /* Device is not plugged in according to the index */
+    BS_HEALTH_FAILED = 3, /* Probe failed, see bs_error() */
+} bs_health_t;
+
+/**
+ * Devices to enumerate, see bs_enumerate()
+ */
+typedef struct bs_filter_t {
+    uint16_t vendor; /* USB vendor id, 0 for BlinkStick */
+    uint16_t product; /* USB product id, 0 for BlinkStick */
+    const char* serial_prefix; /* Only devices with serial starting with
+                                * this, NULL for any */
+} bs_filter_t;
+
+/**
+ * Called for each device found by bs_enumerate().
+ * @param device opened device, owned by the callback which must close it
+ * @param userdata userdata given to bs_enumerate()
+ * @return false to stop enumerating
+ */
+typedef bool (*bs_enumerate_callback_t)(bs_device_t* device, void* userdata);
+
+typedef struct bs_mailbox_stats_t {
+    uint64_t submitted; /* Frames given to bs_set() or bs_set_many() */
+    uint64_t sent; /* Frames successfully sent to the device */
+    uint64_t failed; /* Frames that failed to be sent */
+    uint64_t dropped; /* Frames replaced by a newer frame before sent */
+} bs_mailbox_stats_t;
+
+/**
+ * Kind of BlinkStick to emulate, see bs_open_emulated()
+ */
+typedef enum bs_emulated_type_t {
+    BS_EMULATED_BASIC = 1, /* BlinkStick, one led */
+    BS_EMULATED_PRO = 2, /* BlinkStick Pro, three channels of 64 leds */
+    BS_EMULATED_STRIP = 3, /* BlinkStick Strip/Square, eight leds */
+} bs_emulated_type_t;
+
+typedef struct bs_emulated_config_t {
+    bs_emulated_type_t type;
+    const char* serial; /* Serial of device, NULL to generate one */
+    unsigned int latency_us; /* Time each request takes to complete */
+    unsigned int fail_every; /* Fail every Nth request, 0 to never fail */
+    unsigned int fail_permille; /* Chance of a request failing, in 1/1000 */
+    bs_error_t fail_error; /* Error reported by failing requests,
+                            * BS_NO_ERROR means BS_ERROR_IO */
+    unsigned int seed; /* Seed for fail_permille */
+} bs_emulated_config_t;
+
+/**
+ * Part of a frame sent as one report, see bs_set_leds()
+ */
+typedef struct bs_segment_t {
+    size_t offset; /* Index in frame of first led in segment */
+    uint8_t channel; /* Channel the segment is shown on */
+    uint8_t count; /* Number of leds in segment */
+    bs_error_t error; /* Result of sending (or reading) segment */
+} bs_segment_t;
+
 /** Normal one led, (Pro and basic BlinkStick) */
 #define BS_MODE_NORMAL (0)
 /** Inverse one led (Pro) */
@@ -41,6 +244,35 @@ typedef enum bs_error_t {
 /** Multi-led repeat (color #0 is used for all) (BlinkStick Strip/Square) */
 #define BS_MODE_REPEAT (3)
 
+/** First output on BlinkStick Pro (R) */
+#define BS_CHANNEL_R (0)
+/** Second output on BlinkStick Pro (G) */
+#define BS_CHANNEL_G (1)
+/** Third output on BlinkStick Pro (B) */
+#define BS_CHANNEL_B (2)
+
+/*
+ * Thread safety:
+ * All functions may be called from any thread. Different devices may be
+ * used from different threads at the same time; the only state they share
+ * is the USB context, which is reference counted under a lock taken when
+ * opening and closing devices, and libusb's own event handling.
+ * All USB devices share one libusb context, and a blocking call on a USB
+ * device handles events for the whole context. It may therefore complete
+ * requests, and call their callbacks, for any USB device, in the thread
+ * making the call. libusb lets only one thread handle events at a time, so
+ * threads waiting on USB devices are serialized while they wait, even on
+ * different devices. Blocking calls on an emulated device only handle
+ * events for that device, so threads driving emulated devices never wait
+ * for each other.
+ * A single device must only be used by one thread at a time, with the
+ * exception of bs_error(), bs_pending(), bs_connection() and
+ * bs_mailbox_stats(), and of mailbox mode which is made for handing frames
+ * to a writer thread. bs_handle_events() handles events for all devices and
+ * may complete requests, and call their callbacks, for devices used by
+ * other threads.
+ */
+
 /**
  * Init libbs.
  * You don't have to call this method, but if you do you must call bs_shutdown()
@@ -62,6 +294,71 @@ BS_API bool bs_init(bs_error_t* error);
  */
 BS_API void bs_shutdown(void);
 
+/**
+ * Enable or disable the capability cache, disabled by default.
+ * When enabled, the mode of a USB device is kept in a file per device under
+ * $XDG_RUNTIME_DIR/libbs/ so that a new process can open a device and call
+ * bs_get_mode(), bs_get_max_leds() and so on without asking the device.
+ * Entries are only used for the same connection they were written for, a
+ * device that is unplugged and plugged in again is asked. Mode changes made
+ * with bs_set_mode() update the entry. Mode changes made without libbs are
+ * not noticed until the device is reconnected. Mode changes made with
+ * bs_set_mode() while the cache is disabled remove the entry so other
+ * processes do not use one that is wrong.
+ * Nothing is cached if XDG_RUNTIME_DIR is not set.
+ * @param enable true to use the cache
+ */
+BS_API void bs_set_caps_cache(bool enable);
+
+/**
+ * Start keeping an index of all connected BlinkSticks by serial.
+ * The index is kept up to date by a background thread using USB hotplug
+ * events. While running, bs_open_first() and bs_open_matching_serial() look
+ * the device up in the index instead of reading the serial of every device.
+ * All devices connected at the time of the call are in the index when it
+ * returns, except those that could not be opened yet, for example as their
+ * permissions are not set yet, which are tried again for a while.
+ * no-op if already running.
+ * @param error if non-null, set to error if there was one,
+ *              BS_ERROR_NOT_SUPPORTED if the platform lacks hotplug support
+ * @return false if the index could not be started
+ */
+BS_API bool bs_index_start(bs_error_t* error);
+
+/**
+ * Stop keeping the device index. Subscriptions are removed.
+ * no-op if the index is not running.
+ */
+BS_API void bs_index_stop(void);
+
+/**
+ * Check if a BlinkStick with serial is connected, without any USB requests.
+ * @param serial serial to look for, may not be NULL
+ * @return true if device is in the index, always false if the index is not
+ *         running
+ */
+BS_API bool bs_index_contains(const char* serial) BS_NONULL;
+
+/**
+ * Subscribe to devices arriving and leaving the index.
+ * @param callback called for each event, may not be NULL
+ * @param userdata given to callback
+ * @param enumerate if true, callback is called with BS_HOTPLUG_ARRIVED for
+ *                  each device already in the index before returning
+ * @param error if non-null, set to error if there was one
+ * @return subscription id for bs_hotplug_unsubscribe() or -1 in case of
+ *         error, the index must be running
+ */
+BS_API int bs_hotplug_subscribe(bs_hotplug_callback_t callback,
+                                void* userdata, bool enumerate,
+                                bs_error_t* error) BS_NONULL_ARGS(1);
+
+/**
+ * Remove subscription, the callback will not be called after this returns.
+ * @param id id returned by bs_hotplug_subscribe()
+ */
+BS_API void bs_hotplug_unsubscribe(int id);
+
 /**
  * Open first BlinkStick found.
  * Remember to close returned device.
@@ -72,6 +369,8 @@ BS_API bs_device_t* bs_open_first(bs_error_t* error) BS_MALLOC;
 
 /**
  * Open BlinkStick with matching serial if found.
+ * If the device index is running, see bs_index_start(), only the matching
+ * device is opened.
  * Remember to close returned device.
  * @param serial serial to search for, may not be NULL
  * @param error if non-null, set to error if there was one
@@ -82,16 +381,62 @@ BS_API bs_device_t* bs_open_matching_serial(const char* serial,
     BS_NONULL_ARGS(1) BS_MALLOC;
 
 /**
- * Open all BlinkStick devices found.
+ * Open all BlinkStick devices found, see bs_enumerate().
  * Remember to close each individual device when done and then free the array
  * itself.
- * @param max maximum number of devices to return, if 0 is given a default is
- *            used (currently 12)
+ * @param max maximum number of devices to return, 0 for no limit
  * @param error if non-null, set to error if there was one
  * @return NULL-terminated array of open devices or NULL in case of error
  */
 BS_API bs_device_t** bs_open_all(size_t max, bs_error_t* error) BS_MALLOC;
 
+/**
+ * Open each BlinkStick matching filter and hand it to callback as it is found.
+ * Only devices with matching vendor and product ids are opened. The serials
+ * of up to 32 devices are read at the same time. If the device index is
+ * running, see bs_index_start(), and filter is for BlinkSticks, the serial
+ * prefix is matched against the index and only matching devices are opened.
+ * @param filter devices to look for, NULL for all BlinkSticks
+ * @param callback called with each device, may not be NULL
+ * @param userdata given to callback
+ * @param error if non-null, set to error if there was one
+ * @return false if there was an error listing devices or waiting for their
+ *         serials, devices already handed to callback stay open. Devices
+ *         that fail to open are skipped, but when the index is used the
+ *         first such error is set in error and false is returned after the
+ *         other devices have been handed to callback
+ */
+BS_API bool bs_enumerate(const bs_filter_t* filter,
+                         bs_enumerate_callback_t callback, void* userdata,
+                         bs_error_t* error) BS_NONULL_ARGS(2);
+
+/**
+ * Open an emulated BlinkStick.
+ * The emulated device lives in the library and needs no hardware, it answers
+ * the same requests as a real device of the given type would. Requests take
+ * latency_us each to complete and are handled one at a time, in order, just
+ * as on a real device.
+ * Remember to close returned device.
+ * @param config configuration of device, may not be NULL
+ * @param error if non-null, set to error if there was one
+ * @return device or NULL in case of error
+ */
+BS_API bs_device_t* bs_open_emulated(const bs_emulated_config_t* config,
+                                     bs_error_t* error)
+    BS_NONULL_ARGS(1) BS_MALLOC;
+
+/**
+ * Change latency and failure injection of an emulated BlinkStick.
+ * Type and serial in config are ignored. Requests already pending are not
+ * affected.
+ * @param device device opened with bs_open_emulated(), may not be NULL
+ * @param config new configuration, may not be NULL
+ * @return false if device is not emulated
+ */
+BS_API bool bs_emulated_configure(bs_device_t* device,
+                                  const bs_emulated_config_t* config)
+    BS_NONULL;
+
 /**
  * Close open device, calling twice on the same device is undefined.
  * Calling with NULL as argument is a no-op.
@@ -107,10 +452,40 @@ BS_API char* bs_serial(bs_device_t* device) BS_NONULL BS_MALLOC;
 
 /**
  * @param device to check, may not be NULL
- * @return true if device seems to be working
+ * @return true if device seems to be working, same as bs_probe() with a
+ *         max_age_ms of one second returning BS_HEALTH_OK
  */
 BS_API bool bs_good(bs_device_t* device) BS_NONULL;
 
+/**
+ * Check if device is working, talking to it only when needed.
+ * A device whose last request succeeded within max_age_ms, or that is being
+ * reconnected in the background, is not touched. If the device index is
+ * running and does not know about the device it is not touched either.
+ * Otherwise the mode is read, which is cheaper than reading colors, using
+ * the default timeout, see bs_set_timeout(). The probe does not reconnect.
+ * @param device device to check, may not be NULL
+ * @param max_age_ms how old a successful request may be to count,
+ *                   0 to always probe unless known to be gone
+ * @return health of device
+ */
+BS_API bs_health_t bs_probe(bs_device_t* device, unsigned int max_age_ms)
+    BS_NONULL;
+
+/**
+ * Check count devices as bs_probe() does, with the probes of all devices
+ * sent at the same time rather than one after the other.
+ * @param devices devices to check, may not be NULL
+ * @param count number of devices
+ * @param max_age_ms see bs_probe()
+ * @param health array of count to receive the health of each device,
+ *               may not be NULL
+ * @return true if all devices are BS_HEALTH_OK
+ */
+BS_API bool bs_probe_many(bs_device_t** devices, size_t count,
+                          unsigned int max_age_ms, bs_health_t* health)
+    BS_NONULL;
+
 /**
  * Return last error, not reset to BS_NO_ERROR when a method succeeds after
  * an earlier failure.
@@ -183,6 +558,644 @@ BS_API bool bs_set_many(bs_device_t* device, uint8_t count,
 BS_API bool bs_get_many(bs_device_t* device, uint8_t count,
                         bs_color_t* color) BS_NONULL;
 
+/**
+ * Number of channels (outputs) on device.
+ * BlinkStick Pro has three channels in multi-led mode, other devices and
+ * modes only have one. bs_set_pro(), bs_set_many() and friends all work on
+ * the first channel (BS_CHANNEL_R).
+ * @param device device to get channels on, may not be NULL
+ * @return 0 if there was an error
+ */
+BS_API uint8_t bs_get_channels(bs_device_t* device) BS_NONULL;
+
+/**
+ * Set color of indexed led on a channel of a pro stick
+ * @param device device to change color on, may not be NULL
+ * @param channel channel of led, see BS_CHANNEL_*
+ * @param index index to set
+ * @param color color to set
+ * @return false if there was an error
+ */
+BS_API bool bs_set_pro_channel(bs_device_t* device, uint8_t channel,
+                               uint8_t index, bs_color_t color) BS_NONULL;
+
+/**
+ * Get color of indexed led on a channel of a pro stick
+ * Only the first channel can be read from the device, other channels can
+ * only be read from the shadow cache, see bs_set_cache().
+ * @param device device to read color from, may not be NULL
+ * @param channel channel of led, see BS_CHANNEL_*
+ * @param index index to get
+ * @param color pointer to receive current color, may not be NULL
+ * @return false if there was an error
+ */
+BS_API bool bs_get_pro_channel(bs_device_t* device, uint8_t channel,
+                               uint8_t index, bs_color_t* color) BS_NONULL;
+
+/**
+ * Set color of many indexed led on a channel at the same time
+ * @param device device to change colors on, may not be NULL
+ * @param channel channel of leds, see BS_CHANNEL_*
+ * @param count number of leds to change, always 0-count
+ *        see bs_set_many() about the number of leds actually set
+ * @param color color of each led, may not be NULL
+ * @return false if there was an error
+ */
+BS_API bool bs_set_many_channel(bs_device_t* device, uint8_t channel,
+                                uint8_t count, const bs_color_t* color)
+    BS_NONULL;
+
+/**
+ * Change the colors of many indexed led on a channel, sending only what
+ * changed. Depending on which leds changed, this sends one report per
+ * changed led, one report covering leds 0 up to the last changed led, or
+ * one report covering some of the leds plus one report per changed led
+ * after them. It picks whatever needs the fewest USB packets, so a few
+ * changed leds on a long strip cost a fraction of a full report. All
+ * reports are sent back to back without waiting for each to complete.
+ * Leds with the same color in previous and color are not sent unless they
+ * happen to be covered by a report. If all leds changed, this is the same
+ * as bs_set_many_channel().
+ * @param device device to change colors on, may not be NULL
+ * @param channel channel of leds, see BS_CHANNEL_*
+ * @param count number of leds in previous and color, always 0-count
+ * @param previous colors the leds have now, or NULL to compare with the
+ *                 shadow cache, see bs_set_cache(). Leds not in the cache
+ *                 are treated as changed
+ * @param color new color of each led, may not be NULL
+ * @return false if there was an error
+ */
+BS_API bool bs_update(bs_device_t* device, uint8_t channel, uint8_t count,
+                      const bs_color_t* previous, const bs_color_t* color)
+    BS_NONULL_ARGS(1, 5);
+
+/**
+ * Get color of many indexed led on a channel at the same time
+ * Only the first channel can be read from the device, other channels can
+ * only be read from the shadow cache, see bs_set_cache().
+ * @param device device to read colors from, may not be NULL
+ * @param channel channel of leds, see BS_CHANNEL_*
+ * @param count number of leds to query, always 0-count
+ * @param color receive color of each led, may not be NULL
+ * @return false if there was an error
+ */
+BS_API bool bs_get_many_channel(bs_device_t* device, uint8_t channel,
+                                uint8_t count, bs_color_t* color) BS_NONULL;
+
+/**
+ * Set color of many indexed led on all channels at the same time.
+ * The reports for all channels are sent back to back without waiting for
+ * each to complete.
+ * @param device device to change colors on, may not be NULL
+ * @param count number of leds to change on each channel, always 0-count
+ *        see bs_set_many() about the number of leds actually set
+ * @param color count colors for each channel as returned by
+ *              bs_get_channels(), first all colors for the first channel and
+ *              so on, may not be NULL
+ * @return false if there was an error on any of the channels
+ */
+BS_API bool bs_set_all_channels(bs_device_t* device, uint8_t count,
+                                const bs_color_t* color) BS_NONULL;
+
+/**
+ * Number of segments bs_set_leds() splits a frame of count leds into.
+ * Each segment is one report, leds are put on each channel in turn, filling
+ * up one channel before moving to the next.
+ * @param device device to check, may not be NULL
+ * @param count number of leds in frame
+ * @return number of segments, or 0 if there was an error or the device does
+ *         not have count leds
+ */
+BS_API size_t bs_get_segments(bs_device_t* device, size_t count) BS_NONULL;
+
+/**
+ * Set color of count leds, as many as the device has on all channels.
+ * The frame is split into the fewest number of reports needed, see
+ * bs_get_segments(), which are sent back to back.
+ * @param device device to change colors on, may not be NULL
+ * @param count number of leds to change, always 0-count
+ * @param color color of each led, may not be NULL
+ * @param segments if non-null, array of at least bs_get_segments() segments
+ *                 to receive the result of each segment
+ * @return false if there was an error in any of the segments
+ */
+BS_API bool bs_set_leds(bs_device_t* device, size_t count,
+                        const bs_color_t* color, bs_segment_t* segments)
+    BS_NONULL_ARGS(1, 3);
+
+/**
+ * Get color of count leds, as many as the device has on all channels.
+ * See bs_get_many_channel() about limitations reading channels.
+ * @param device device to read colors from, may not be NULL
+ * @param count number of leds to query, always 0-count
+ * @param color receive color of each led, may not be NULL
+ * @param segments if non-null, array of at least bs_get_segments() segments
+ *                 to receive the result of each segment
+ * @return false if there was an error in any of the segments
+ */
+BS_API bool bs_get_leds(bs_device_t* device, size_t count, bs_color_t* color,
+                        bs_segment_t* segments) BS_NONULL_ARGS(1, 3);
+
+/**
+ * Same as bs_set() but fail with BS_ERROR_TIMEOUT unless done within
+ * timeout_ms, instead of using the default timeout, see bs_set_timeout().
+ * @param device device to change color on, may not be NULL
+ * @param color color to set
+ * @param timeout_ms time the whole call may take, 0 for no timeout
+ * @return false if there was an error
+ */
+BS_API bool bs_set_timed(bs_device_t* device, bs_color_t color,
+                         unsigned int timeout_ms) BS_NONULL;
+
+/**
+ * Same as bs_get() but with a timeout, see bs_set_timed().
+ * @param device device to read color from, may not be NULL
+ * @param color pointer to receive current color, may not be NULL
+ * @param timeout_ms time the whole call may take, 0 for no timeout
+ * @return false if there was an error
+ */
+BS_API bool bs_get_timed(bs_device_t* device, bs_color_t* color,
+                         unsigned int timeout_ms) BS_NONULL;
+
+/**
+ * Same as bs_set_many() but with a timeout, see bs_set_timed().
+ * @param device device to change colors on, may not be NULL
+ * @param count number of leds to change, always 0-count
+ * @param color color of each led, may not be NULL
+ * @param timeout_ms time the whole call may take, 0 for no timeout
+ * @return false if there was an error
+ */
+BS_API bool bs_set_many_timed(bs_device_t* device, uint8_t count,
+                              const bs_color_t* color,
+                              unsigned int timeout_ms) BS_NONULL;
+
+/**
+ * Same as bs_get_many() but with a timeout, see bs_set_timed().
+ * @param device device to read colors from, may not be NULL
+ * @param count number of leds to query, always 0-count
+ * @param color receive color of each led, may not be NULL
+ * @param timeout_ms time the whole call may take, 0 for no timeout
+ * @return false if there was an error
+ */
+BS_API bool bs_get_many_timed(bs_device_t* device, uint8_t count,
+                              bs_color_t* color, unsigned int timeout_ms)
+    BS_NONULL;
+
+/**
+ * Same as bs_set_leds() but with a timeout, see bs_set_timed().
+ * The timeout is for all segments together, segments not sent in time fail
+ * with BS_ERROR_TIMEOUT.
+ * @param device device to change colors on, may not be NULL
+ * @param count number of leds to change, always 0-count
+ * @param color color of each led, may not be NULL
+ * @param segments if non-null, array of at least bs_get_segments() segments
+ *                 to receive the result of each segment
+ * @param timeout_ms time the whole call may take, 0 for no timeout
+ * @return false if there was an error in any of the segments
+ */
+BS_API bool bs_set_leds_timed(bs_device_t* device, size_t count,
+                              const bs_color_t* color,
+                              bs_segment_t* segments, unsigned int timeout_ms)
+    BS_NONULL_ARGS(1, 3);
+
+/**
+ * Start setting current color without waiting for the device.
+ * The request is queued behind any other requests pending on the device.
+ * @param device device to change color on, may not be NULL
+ * @param color color to set
+ * @param callback called when the request has completed, may be NULL
+ * @param userdata given to callback
+ * @return false if the request could not be started, callback is not called
+ */
+BS_API bool bs_set_async(bs_device_t* device, bs_color_t color,
+                         bs_callback_t callback, void* userdata)
+    BS_NONULL_ARGS(1);
+
+/**
+ * Start setting color of many indexed led without waiting for the device.
+ * Works as bs_set_many() but returns as soon as the request is sent.
+ * Color is copied so it can be reused as soon as the method returns.
+ * On a USB device callback may be called by a blocking call on another USB
+ * device, in another thread, see bs_callback_t.
+ * @param device device to change colors on, may not be NULL
+ * @param count number of leds to change, always 0-count, if 0 nothing is
+ *              sent and callback is called with BS_NO_ERROR at once
+ * @param color color of each led, may not be NULL
+ * @param callback called when the request has completed, may be NULL
+ * @param userdata given to callback
+ * @return false if the request could not be started, callback is not called
+ */
+BS_API bool bs_set_many_async(bs_device_t* device, uint8_t count,
+                              const bs_color_t* color,
+                              bs_callback_t callback, void* userdata)
+    BS_NONULL_ARGS(1, 3);
+
+/**
+ * Convert colors to the GRB byte order used on the wire, as in the buffer
+ * of bs_frame_pixels(). Uses the fastest SIMD instructions the CPU has.
+ * @param dst buffer of count * 3 bytes, may be src but not otherwise
+ *            overlap it
+ * @param src colors to convert
+ * @param count number of colors
+ */
+BS_API void bs_pack_grb(uint8_t* dst, const bs_color_t* src, size_t count)
+    BS_NONULL;
+
+/**
+ * Convert colors from the GRB byte order used on the wire.
+ * @param dst count colors, may be src but not otherwise overlap it
+ * @param src buffer of count * 3 bytes
+ * @param count number of colors
+ */
+BS_API void bs_unpack_grb(bs_color_t* dst, const uint8_t* src, size_t count)
+    BS_NONULL;
+
+/**
+ * Name of the implementation used by bs_pack_grb() and bs_unpack_grb(),
+ * "avx2", "ssse3", "neon" or "scalar".
+ */
+BS_API const char* bs_pixel_kernel(void);
+
+/**
+ * Frame buffer in the format sent to the device, see bs_frame_new()
+ */
+typedef struct bs_frame_t bs_frame_t;
+
+/* Layout of the leds returned by bs_frame_pixels() */
+#define BS_FRAME_STRIDE 3  /* Bytes per led */
+#define BS_FRAME_GREEN 0  /* Offset of each color in a led */
+#define BS_FRAME_RED 1
+#define BS_FRAME_BLUE 2
+
+/**
+ * Create a frame for setting count leds on channel, with a buffer already
+ * laid out as the report sent to the device. Write colors directly into
+ * the buffer, see bs_frame_pixels(), and send it as many times as needed
+ * with bs_frame_send(). Sending does not copy, pack or allocate anything.
+ * Basic sticks are not supported.
+ * A frame must be freed before its device is closed, and may only be used
+ * by one thread at a time.
+ * @param device device the frame is sent to, may not be NULL
+ * @param channel channel to set, see bs_set_many_channel()
+ * @param count number of leds, 1-64, see bs_set_many() about padding
+ * @param error if not NULL, set to the error if any
+ * @return frame, all black, or NULL in case of error
+ */
+BS_API bs_frame_t* bs_frame_new(bs_device_t* device, uint8_t channel,
+                                uint8_t count, bs_error_t* error)
+    BS_NONULL_ARGS(1) BS_MALLOC;
+
+/**
+ * Free frame, waiting for it to be sent if it is being sent.
+ * @param frame frame to free, may be NULL
+ */
+BS_API void bs_frame_free(bs_frame_t* frame);
+
+/**
+ * Buffer of the first led in frame. Leds follow each other
+ * BS_FRAME_STRIDE bytes apart and each color is a byte at BS_FRAME_RED,
+ * BS_FRAME_GREEN and BS_FRAME_BLUE. Do not change while the frame is being
+ * sent asynchronously.
+ * @param frame frame to get buffer for, may not be NULL
+ * @return bs_frame_count() * BS_FRAME_STRIDE bytes
+ */
+BS_API uint8_t* bs_frame_pixels(bs_frame_t* frame) BS_NONULL;
+
+/**
+ * @param frame frame to check, may not be NULL
+ * @return number of leds in frame
+ */
+BS_API uint8_t bs_frame_count(bs_frame_t* frame) BS_NONULL;
+
+/**
+ * Set color of a led in frame.
+ * @param frame frame to change, may not be NULL
+ * @param index led to change, less than bs_frame_count()
+ * @param color color to set
+ */
+BS_API void bs_frame_set(bs_frame_t* frame, uint8_t index, bs_color_t color)
+    BS_NONULL;
+
+/**
+ * Get color of a led in frame.
+ * @param frame frame to read, may not be NULL
+ * @param index led to read, less than bs_frame_count()
+ * @return color of led
+ */
+BS_API bs_color_t bs_frame_get(bs_frame_t* frame, uint8_t index) BS_NONULL;
+
+/**
+ * Send frame to its device and wait for it to complete.
+ * Unlike bs_set_many() the frame is always sent, even in mailbox mode or
+ * if the shadow cache has the same colors.
+ * @param frame frame to send, may not be NULL
+ * @return false if there was an error, see bs_error(), BS_ERROR_BUSY if
+ *         the frame is already being sent
+ */
+BS_API bool bs_frame_send(bs_frame_t* frame) BS_NONULL;
+
+/**
+ * Start sending frame without waiting for the device, see bs_frame_send()
+ * and bs_set_many_async(). The frame may be sent again from callback.
+ * @param frame frame to send, may not be NULL
+ * @param callback called when the frame has been sent, may be NULL
+ * @param userdata given to callback
+ * @return false if the request could not be started, callback is not called
+ */
+BS_API bool bs_frame_send_async(bs_frame_t* frame, bs_callback_t callback,
+                                void* userdata) BS_NONULL_ARGS(1);
+
+/**
+ * Number of asynchronous requests that have been started but not yet
+ * completed on device.
+ * @param device device to check, may not be NULL
+ * @return number of pending requests
+ */
+BS_API size_t bs_pending(bs_device_t* device) BS_NONULL;
+
+/**
+ * Set the maximum number of requests that may be pending on device at the
+ * same time. Starting an asynchronous request when the maximum is reached
+ * fails with BS_ERROR_BUSY. Default is 4.
+ * @param device device to change, may not be NULL
+ * @param max maximum number of pending requests, 0 is treated as 1
+ */
+BS_API void bs_set_max_pending(bs_device_t* device, size_t max) BS_NONULL;
+
+/**
+ * Enable or disable color correction on device. When enabled all colors
+ * are corrected on the way to the device using lookup tables computed by
+ * this call, which costs a table lookup per color byte when sending.
+ * Colors read from the device are what was sent, after correction, so
+ * reads do not use the shadow cache while correction is enabled.
+ * Frames, see bs_frame_new(), are sent as they are.
+ * @param device device to change, may not be NULL
+ * @param correction correction to apply, copied, or NULL to disable
+ * @return false if correction is invalid
+ */
+BS_API bool bs_set_correction(bs_device_t* device,
+                              const bs_correction_t* correction)
+    BS_NONULL_ARGS(1);
+
+/**
+ * Get the color correction of device, see bs_set_correction().
+ * @param device device to check, may not be NULL
+ * @param correction receives the correction if enabled, may not be NULL
+ * @return true if correction is enabled
+ */
+BS_API bool bs_get_correction(bs_device_t* device,
+                              bs_correction_t* correction) BS_NONULL;
+
+/**
+ * Set a power budget for device. Every frame sent is scaled down, all
+ * leds by the same factor, if the estimated current of the leds with the
+ * new colors would go over the budget. The estimate is made from the bytes
+ * sent, after color correction, and only includes colors sent after the
+ * budget was set, leds not set since count as black. Reads do not use the
+ * shadow cache while there is a budget. Frames, see bs_frame_new(), are
+ * sent as they are and not counted.
+ * If device is in a group with a budget, see bs_group_set_power_budget(),
+ * that budget is used instead.
+ * @param device device to change, may not be NULL
+ * @param power budget, copied, or NULL to remove
+ * @return false in case of error
+ */
+BS_API bool bs_set_power_budget(bs_device_t* device, const bs_power_t* power)
+    BS_NONULL_ARGS(1);
+
+/**
+ * Estimated current of the leds of device according to its power budget,
+ * see bs_set_power_budget(). For a device in a group with a budget the
+ * estimate is for the whole group.
+ * @param device device to check, may not be NULL
+ * @return current in mA, 0 if device has no budget
+ */
+BS_API uint32_t bs_power_estimate(bs_device_t* device) BS_NONULL;
+
+/**
+ * Set the default timeout for each request sent to device, used by all
+ * functions without their own timeout. Requests that time out fail with
+ * BS_ERROR_TIMEOUT. Default is 0, wait forever.
+ * @param device device to change, may not be NULL
+ * @param timeout_ms timeout in milliseconds, 0 for no timeout
+ */
+BS_API void bs_set_timeout(bs_device_t* device, unsigned int timeout_ms)
+    BS_NONULL;
+
+/**
+ * Get the default request timeout, see bs_set_timeout().
+ * @param device device to check, may not be NULL
+ * @return timeout in milliseconds, 0 for no timeout
+ */
+BS_API unsigned int bs_get_timeout(bs_device_t* device) BS_NONULL;
+
+/**
+ * Number of requests on device that have failed with BS_ERROR_TIMEOUT
+ * since it was opened.
+ * @param device device to check, may not be NULL
+ * @return number of timed out requests
+ */
+BS_API unsigned long bs_timeouts(bs_device_t* device) BS_NONULL;
+
+/**
+ * Get the request counters of device, or the sum for all devices, closed
+ * ones included. Counting is cheap and always on. The counters are read one
+ * by one while other threads might be updating them, so they might not
+ * agree exactly with each other.
+ * @param device device to get counters of, NULL for all devices
+ * @param stats receives the counters, may not be NULL
+ */
+BS_API void bs_stats(bs_device_t* device, bs_stats_t* stats)
+    BS_NONULL_ARGS(2);
+
+/**
+ * Set the request counters of device to zero, see bs_stats(). Resetting
+ * a device does not change the sum for all devices, and the other way
+ * around. Does not affect bs_timeouts().
+ * @param device device to reset counters of, NULL for all devices
+ */
+BS_API void bs_stats_reset(bs_device_t* device);
+
+/**
+ * Start writing every request sent to any device to a trace file, with its
+ * payload, result and timing, for bs_replay(). Requests are written by a
+ * background thread from a buffer of buffer bytes, requests that do not fit
+ * in the buffer are dropped, see bs_trace_dropped().
+ * @param path file to write, replaced if it exists, may not be NULL
+ * @param buffer buffer size in bytes, 0 for the default of 1 MiB
+ * @param error if non-null, set to error if there was one, BS_ERROR_BUSY
+ *              if already tracing
+ * @return false in case of error
+ */
+BS_API bool bs_trace_start(const char* path, size_t buffer,
+                           bs_error_t* error) BS_NONULL_ARGS(1);
+
+/**
+ * Stop tracing, returns when everything in the buffer is written.
+ * Does nothing if not tracing.
+ * @param error if non-null, set to error if there was one
+ * @return false if not all requests could be written to the file
+ */
+BS_API bool bs_trace_stop(bs_error_t* error);
+
+/**
+ * Number of requests dropped since the last bs_trace_start() because the
+ * buffer was full.
+ * @return number of requests not in the trace
+ */
+BS_API uint64_t bs_trace_dropped(void);
+
+/**
+ * Send the requests in a trace file written by bs_trace_start() to device,
+ * in the order they were sent. A request is never sent before the requests
+ * that had completed before it when recorded, with timed it is also not
+ * sent before it was, relative to the first request. Otherwise it is sent
+ * as soon as possible.
+ * The requests bypass the library, so the shadow cache is invalidated and
+ * the mode is unknown afterwards if the trace set it. Must not be used with
+ * the mailbox running.
+ * @param device device to send to, may not be NULL
+ * @param path trace file, may not be NULL
+ * @param serial only replay requests recorded for the device with this
+ *               serial, NULL for all
+ * @param timed keep the time between requests
+ * @param callback called as each request completes, may be NULL
+ * @param userdata given to callback
+ * @param error if non-null, set to error if there was one,
+ *              BS_ERROR_INVALID_PARAM if path is not a trace file. Failed
+ *              requests are reported to callback, not here
+ * @return false in case of error
+ */
+BS_API bool bs_replay(bs_device_t* device, const char* path,
+                      const char* serial, bool timed,
+                      bs_replay_callback_t callback, void* userdata,
+                      bs_error_t* error) BS_NONULL_ARGS(1, 2);
+
+/**
+ * Wait for all pending requests on device to complete.
+ * @param device device to wait for, may not be NULL
+ * @return false if there was an error waiting, see bs_error()
+ */
+BS_API bool bs_flush(bs_device_t* device) BS_NONULL;
+
+/**
+ * Handle events for all open devices, calling the callbacks of any
+ * asynchronous requests that have completed.
+ * @param timeout_ms maximum time to wait for an event in milliseconds,
+ *                   0 to not wait at all and negative to wait until there is
+ *                   an event
+ * @param error if non-null, set to error if there was one
+ * @return false if there was an error
+ */
+BS_API bool bs_handle_events(int timeout_ms, bs_error_t* error);
+
+/**
+ * Get the file descriptors to poll to run libbs from another event loop.
+ * When any of them are ready, or the time given by bs_get_next_timeout()
+ * has passed, call bs_handle_events() with a zero timeout. Together with the
+ * asynchronous requests this lets devices be driven without ever blocking.
+ * bs_init() must have been called, the file descriptors are valid until
+ * bs_shutdown() but more might be added, see bs_set_pollfd_notifiers().
+ * Emulated devices have no file descriptors, they only use timeouts.
+ * @param count set to the number of file descriptors, may not be NULL
+ * @param error if non-null, set to error if there was one
+ * @return array of count file descriptors, free with free(), or NULL in case
+ *         of error
+ */
+BS_API bs_pollfd_t* bs_get_pollfds(size_t* count, bs_error_t* error)
+    BS_NONULL_ARGS(1) BS_MALLOC;
+
+/**
+ * Set functions to call when the file descriptors returned by
+ * bs_get_pollfds() change. bs_init() must have been called.
+ * @param added called when a file descriptor is added, may be NULL
+ * @param removed called when a file descriptor is removed, may be NULL
+ * @param userdata given to added and removed
+ */
+BS_API void bs_set_pollfd_notifiers(bs_pollfd_added_t added,
+                                    bs_pollfd_removed_t removed,
+                                    void* userdata);
+
+/**
+ * Time until bs_handle_events() must be called even if no file descriptor
+ * is ready, see bs_get_pollfds().
+ * @return timeout in milliseconds, 0 if bs_handle_events() should be called
+ *         right away or -1 if there is no timeout
+ */
+BS_API int bs_get_next_timeout(void);
+
+/**
+ * Enable or disable background reconnect, enabled by default.
+ * When a device is lost with background reconnect enabled, the failing call
+ * returns with BS_ERROR_DISCONNECTED and a thread owned by the device tries
+ * to find it again, first at the USB port it was last seen on. It retries
+ * with an increasing delay until the device is back or closed. Until then
+ * all requests fail with BS_ERROR_DISCONNECTED without touching the bus, see
+ * bs_connection().
+ * With background reconnect disabled the failing call tries to reconnect
+ * once, blocking, and repeats the request if successful.
+ * Asynchronous requests pending when the device was lost must complete,
+ * see bs_handle_events(), before the device can be reconnected.
+ * @param device device to change, may not be NULL
+ * @param enable true to reconnect in the background
+ */
+BS_API void bs_set_background_reconnect(bs_device_t* device, bool enable)
+    BS_NONULL;
+
+/**
+ * Check if a device is being reconnected in the background.
+ * @param device device to check, may not be NULL
+ * @return BS_RECONNECTING until the device is back
+ */
+BS_API bs_connection_t bs_connection(bs_device_t* device) BS_NONULL;
+
+/**
+ * Enable or disable mailbox mode on device.
+ * In mailbox mode bs_set() and bs_set_many() never block, they put the frame
+ * in a mailbox and return. A writer thread owned by the device sends the
+ * newest frame in the mailbox to the device, a frame not yet sent when a new
+ * one arrives is dropped. Errors sending frames are only reported through
+ * bs_error() and bs_mailbox_stats().
+ * Other requests are still sent directly and are not ordered with frames in
+ * the mailbox.
+ * Disabling mailbox mode, or closing the device, waits for any frame left in
+ * the mailbox to be sent.
+ * @param device device to change, may not be NULL
+ * @param enable true to enable mailbox mode, false to disable
+ * @return false if there was an error, see bs_error()
+ */
+BS_API bool bs_set_mailbox(bs_device_t* device, bool enable) BS_NONULL;
+
+/**
+ * Get mailbox counters for device. Counters are kept while mailbox mode is
+ * disabled and enabled again.
+ * @param device device to get counters for, may not be NULL
+ * @param stats pointer to receive counters, may not be NULL
+ */
+BS_API void bs_mailbox_stats(bs_device_t* device, bs_mailbox_stats_t* stats)
+    BS_NONULL;
+
+/**
+ * Enable or disable the shadow cache on device.
+ * When enabled the library keeps a copy of the colors the device is showing.
+ * Setting colors the device already shows is then a no-op and getting colors
+ * is answered from the copy when possible. Colors are not read from the
+ * device when the cache is enabled, so colors set by someone else will not
+ * be noticed until the cache is invalidated.
+ * @param device device to change, may not be NULL
+ * @param enable true to enable cache, false to disable
+ */
+BS_API void bs_set_cache(bs_device_t* device, bool enable) BS_NONULL;
+
+/**
+ * Forget all cached colors, forcing the next get to read from the device
+ * and the next set to be sent even if unchanged.
+ * The cache is invalidated automatically when a request fails, the mode is
+ * changed or the device was reconnected.
+ * @param device device to invalidate cache on, may not be NULL
+ */
+BS_API void bs_invalidate_cache(bs_device_t* device) BS_NONULL;
+
 /**
  * Set device mode on BlinkStick Pro.
  * See BS_MODE_* for known modes.
@@ -206,4 +1219,286 @@ BS_API int bs_get_mode(bs_device_t* device) BS_NONULL;
  */
 BS_API uint16_t bs_get_max_leds(bs_device_t* device) BS_NONULL;
 
+/**
+ * Group of devices updated together, see bs_group_new()
+ */
+typedef struct bs_group_t bs_group_t;
+
+/**
+ * Frame for one device in a group, see bs_group_set()
+ */
+typedef struct bs_group_frame_t {
+    size_t count;  /* Number of leds, see bs_set_leds() */
+    const bs_color_t* color;  /* count colors */
+} bs_group_frame_t;
+
+/**
+ * Create a new empty group of devices.
+ * @param error if not NULL, set to the error if any
+ * @return group, free with bs_group_free(), or NULL in case of error
+ */
+BS_API bs_group_t* bs_group_new(bs_error_t* error) BS_MALLOC;
+
+/**
+ * Free group, the devices in the group are not closed.
+ * @param group group to free, may be NULL
+ */
+BS_API void bs_group_free(bs_group_t* group);
+
+/**
+ * Add device to group. The device must not be closed while in the group.
+ * @param group group to add device to, may not be NULL
+ * @param device device to add, may not be NULL
+ * @return false if out of memory
+ */
+BS_API bool bs_group_add(bs_group_t* group, bs_device_t* device) BS_NONULL;
+
+/**
+ * Number of devices in group.
+ * @param group group to check, may not be NULL
+ * @return number of devices
+ */
+BS_API size_t bs_group_size(const bs_group_t* group) BS_NONULL;
+
+/**
+ * Device in group, in the order they were added.
+ * @param group group to get device from, may not be NULL
+ * @param index index of device, must be less than bs_group_size()
+ * @return device
+ */
+BS_API bs_device_t* bs_group_device(const bs_group_t* group, size_t index)
+    BS_NONULL;
+
+/**
+ * Set a frame on each device in group, as bs_set_leds() would.
+ * The reports for all devices are sent before waiting for any of them to
+ * complete so the time taken is close to that of the slowest device.
+ * @param group group to change colors on, may not be NULL
+ * @param frames one frame for each device in group, may not be NULL
+ * @param results if non-null, array of bs_group_size() to receive the result
+ *                for each device
+ * @return false if there was an error on any device
+ */
+BS_API bool bs_group_set(bs_group_t* group, const bs_group_frame_t* frames,
+                         bs_error_t* results) BS_NONULL_ARGS(1, 2);
+
+/**
+ * Set the same frame on all devices in group, see bs_group_set().
+ * @param group group to change colors on, may not be NULL
+ * @param count number of leds to change
+ * @param color count colors, may not be NULL
+ * @param results if non-null, array of bs_group_size() to receive the result
+ *                for each device
+ * @return false if there was an error on any device
+ */
+BS_API bool bs_group_set_all(bs_group_t* group, size_t count,
+                             const bs_color_t* color, bs_error_t* results)
+    BS_NONULL_ARGS(1, 3);
+
+/**
+ * Set a power budget shared by all devices in group, also those added
+ * later, see bs_set_power_budget(). bs_group_set() scales all devices by the
+ * same factor so the frame keeps its look. The budget of a device is not
+ * used while it is in a group with a budget.
+ * @param group group to change, may not be NULL
+ * @param power budget, copied, or NULL to remove
+ * @return false if out of memory
+ */
+BS_API bool bs_group_set_power_budget(bs_group_t* group,
+                                      const bs_power_t* power)
+    BS_NONULL_ARGS(1);
+
+/**
+ * Estimated current of the leds of all devices in group, see
+ * bs_group_set_power_budget().
+ * @param group group to check, may not be NULL
+ * @return current in mA, 0 if group has no budget
+ */
+BS_API uint32_t bs_group_power_estimate(const bs_group_t* group) BS_NONULL;
+
+/**
+ * How colors change from one keyframe to the next, see bs_keyframe_t
+ */
+typedef enum bs_ease_t {
+    BS_EASE_LINEAR = 0, /* Constant speed */
+    BS_EASE_IN, /* Start slow, quadratic */
+    BS_EASE_OUT, /* End slow, quadratic */
+    BS_EASE_IN_OUT, /* Start and end slow, smoothstep */
+    BS_EASE_STEP, /* Keep the color until the next keyframe */
+} bs_ease_t;
+
+/**
+ * Color of a range of leds at a point in time, see bs_animation_add()
+ */
+typedef struct bs_keyframe_t {
+    uint32_t time_ms; /* Time from the start of the animation */
+    bs_color_t color;
+    bs_ease_t ease; /* How to get from this keyframe to the next */
+} bs_keyframe_t;
+
+/**
+ * Timelines of keyframes rendered into frames, see bs_animation_new()
+ */
+typedef struct bs_animation_t bs_animation_t;
+
+/**
+ * Create a new animation for a frame of leds, with no timelines, so all
+ * black.
+ * @param leds number of leds in each frame, may not be 0
+ * @param error if not NULL, set to the error if any
+ * @return animation, free with bs_animation_free(), or NULL in case of error
+ */
+BS_API bs_animation_t* bs_animation_new(uint16_t leds, bs_error_t* error)
+    BS_MALLOC;
+
+/**
+ * Free animation.
+ * @param animation animation to free, may be NULL
+ */
+BS_API void bs_animation_free(bs_animation_t* animation);
+
+/**
+ * Add a timeline that sets count leds starting at offset to the same color.
+ * Before the first keyframe the color is that of the first keyframe, after
+ * the last one that of the last keyframe unless loop is set. A looping
+ * timeline starts over at the time of its last keyframe, end with a copy of
+ * the first keyframe to loop without a jump. Timelines added later are
+ * drawn over earlier ones, leds without a timeline are black.
+ * @param animation animation to change, may not be NULL
+ * @param offset index of first led, offset + count may not be more than the
+ *               leds of animation
+ * @param count number of leds, may not be 0
+ * @param keyframe keyframes, copied and sorted by time, may not be NULL
+ * @param keyframes number of keyframes, may not be 0
+ * @param loop repeat the timeline, the last keyframe may then not be at 0
+ * @param error if not NULL, set to the error if any
+ * @return false in case of error
+ */
+BS_API bool bs_animation_add(bs_animation_t* animation, uint16_t offset,
+                             uint16_t count, const bs_keyframe_t* keyframe,
+                             size_t keyframes, bool loop, bs_error_t* error)
+    BS_NONULL_ARGS(1, 4);
+
+/**
+ * Time of the last keyframe of the timelines that do not loop.
+ * @param animation animation to check, may not be NULL
+ * @return duration in milliseconds, 0 if all timelines loop
+ */
+BS_API uint32_t bs_animation_duration(const bs_animation_t* animation)
+    BS_NONULL;
+
+/**
+ * Render animation at a point in time using integer math only.
+ * @param animation animation to render, may not be NULL
+ * @param time_us time from the start of the animation in microseconds,
+ *                see bs_tick_t
+ * @param frame receives the color of each led of animation, may not be NULL
+ */
+BS_API void bs_animation_render(const bs_animation_t* animation,
+                                uint64_t time_us, bs_color_t* frame)
+    BS_NONULL;
+
+/**
+ * Clock ticking at a fixed frame rate, see bs_clock_new()
+ */
+typedef struct bs_clock_t bs_clock_t;
+
+/**
+ * A frame to render, see bs_clock_wait()
+ */
+typedef struct bs_tick_t {
+    uint64_t frame; /* Frame number, frame 0 is when the clock was created */
+    uint64_t time_us; /* When the frame was due, from frame 0 */
+    uint64_t late_us; /* How long after time_us the wait returned */
+    uint64_t missed; /* Frames skipped since the last tick */
+} bs_tick_t;
+
+/**
+ * Create a clock for rendering fps frames per second. Frame n is due n / fps
+ * seconds after the clock was created, on the monotonic clock, no matter
+ * how long rendering and sending earlier frames took, so there is no drift.
+ * A clock may only be used by one thread at a time.
+ * @param fps frames per second, 1-1000
+ * @param error if not NULL, set to the error if any
+ * @return clock, free with bs_clock_free(), or NULL in case of error
+ */
+BS_API bs_clock_t* bs_clock_new(unsigned int fps, bs_error_t* error)
+    BS_MALLOC;
+
+/**
+ * Free clock.
+ * @param clock clock to free, may be NULL
+ */
+BS_API void bs_clock_free(bs_clock_t* clock);
+
+/**
+ * Wait until the next frame is due. If more than one frame is due, because
+ * the caller fell behind, the frames before the last one are skipped and
+ * counted as missed.
+ * @param clock clock to wait on, may not be NULL
+ * @param tick receives the frame to render, may not be NULL
+ * @param error if not NULL, set to the error if any
+ * @return false in case of error
+ */
+BS_API bool bs_clock_wait(bs_clock_t* clock, bs_tick_t* tick,
+                          bs_error_t* error) BS_NONULL_ARGS(1, 2);
+
+/**
+ * Total number of frames skipped by bs_clock_wait().
+ * @param clock clock to check, may not be NULL
+ * @return missed frames
+ */
+BS_API uint64_t bs_clock_missed(const bs_clock_t* clock) BS_NONULL;
+
+/**
+ * File descriptor that is readable when the next frame is due, for use in
+ * a poll loop. Do not read from it, call bs_clock_wait() when it is
+ * readable, which then returns without waiting.
+ * @param clock clock to check, may not be NULL
+ * @return file descriptor or -1 if not supported on this system
+ */
+BS_API int bs_clock_fd(const bs_clock_t* clock) BS_NONULL;
+
+/**
+ * Effects rendered by bs_effect_render()
+ */
+typedef enum bs_effect_type_t {
+    BS_EFFECT_RAINBOW = 1, /* All hues spread over the leds, rotating */
+    BS_EFFECT_BREATHE, /* All leds fade in to color and out again */
+    BS_EFFECT_CHASE, /* One led in every size lit, moving forward */
+    BS_EFFECT_COMET, /* A led moving forward with a tail of size leds */
+    BS_EFFECT_SPARKLE, /* Random leds flash color and fade out */
+} bs_effect_type_t;
+
+/**
+ * Effect and its settings, see bs_effect_render()
+ */
+typedef struct bs_effect_t {
+    bs_effect_type_t type;
+    /* Length of one cycle, 0 to stand still. For rainbow the time for the
+     * hues to go around once, for breathe one fade in and out, for chase the
+     * time to move size leds, for comet the time to move over all leds and
+     * for sparkle the time a flash takes to fade out */
+    uint32_t period_ms;
+    bs_color_t color; /* Not used by rainbow */
+    /* For rainbow the number of leds with all hues, 0 for all leds. For
+     * chase the distance between lit leds and for comet the length of the
+     * tail, 0 is treated as 1. For sparkle the chance of each led flashing
+     * every period, in 1/1000 */
+    uint16_t size;
+    uint32_t seed; /* Sparkle picks different leds for each seed */
+} bs_effect_t;
+
+/**
+ * Render an effect using integer math and precomputed tables only, the
+ * result is the same for the same time and settings.
+ * @param effect effect to render, may not be NULL
+ * @param time_us time from the start of the effect in microseconds, see
+ *                bs_tick_t
+ * @param frame receives count colors, may not be NULL
+ * @param count number of leds, any number
+ */
+BS_API void bs_effect_render(const bs_effect_t* effect, uint64_t time_us,
+                             bs_color_t* frame, size_t count) BS_NONULL;
+
 #endif /* LIBBS_H */
@@ -0,0 +1,392 @@
+#ifndef LIBBS_PRIVATE_H
+#define LIBBS_PRIVATE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "libbs.h"
+
+#include <libusb.h>
+
+typedef struct bs_transfer_t bs_transfer_t;
+typedef struct bs_transport_t bs_transport_t;
+typedef struct bs_mailbox_t bs_mailbox_t;
+typedef struct bs_reconnect_t bs_reconnect_t;
+typedef struct bs_power_pool_t bs_power_pool_t;
+
+typedef enum {
+    STATS_REQUESTS,
+    STATS_ERRORS,
+    STATS_TIMEOUTS,
+    STATS_BYTES_OUT,
+    STATS_BYTES_IN,
+    STATS_RETRIES,
+    STATS_RECONNECTS,
+    STATS_INTERRUPTED,
+    STATS_LATENCY_US,
+    STATS_COUNTERS,
+} stats_counter_t;
+
+/**
+ * Counters behind bs_stats(), updated without locks.
+ */
+typedef struct stats_t {
+    _Atomic uint64_t counter[STATS_COUNTERS];
+    _Atomic uint64_t latency[BS_STATS_BUCKETS];
+} stats_t;
+
+typedef enum {
+    BS_VERSION_UNKOWN = 0,
+    BS_VERSION_BASIC = 1,
+    BS_VERSION_PRO = 2,
+    BS_VERSION_STRIP_SQUARE = 3,
+} bs_version_t;
+
+struct bs_transfer_t {
+    bs_device_t* device;
+    bs_transfer_t* prev;
+    bs_transfer_t* next;
+    uint8_t request_type;
+    uint8_t request;
+    uint16_t value;
+    uint16_t index;
+    uint16_t length;
+    uint8_t* data;  /* length bytes, owned by the transport */
+    void* priv;  /* Transport data */
+    unsigned int timeout_ms;  /* 0 for no timeout */
+    int64_t start_us;  /* bs_now_us() when submitted */
+    bool owned;  /* Part of a bs_frame_t, not freed when completed */
+    bool async;
+    bs_callback_t callback;
+    void* userdata;
+    int completed;
+    bs_error_t error;
+};
+
+/**
+ * Operations used by the core to talk to a device.
+ * All transports complete transfers by calling transfer_done() from inside
+ * event handling.
+ */
+struct bs_transport_t {
+    /* Allocate transport data for transfer, including t->data */
+    bool (*alloc)(bs_device_t* device, bs_transfer_t* t);
+    /* Free transport data allocated by alloc */
+    void (*free)(bs_transfer_t* t);
+    /* Start transfer, return BS_NO_ERROR if transfer_done() will be called */
+    bs_error_t (*submit)(bs_device_t* device, bs_transfer_t* t);
+    /* Ask for a submitted transfer to be completed as soon as possible */
+    void (*cancel)(bs_device_t* device, bs_transfer_t* t);
+    /* Try to get back a device that was disconnected, no transfers are
+     * pending. Might be called from the background reconnect thread */
+    bool (*reconnect)(bs_device_t* device);
+    /* Release transport data for device, no transfers are pending */
+    void (*close)(bs_device_t* device);
+};
+
+struct bs_device_t {
+    const bs_transport_t* transport;
+    void* priv;  /* Transport data */
+    char* serial;
+    _Atomic bs_error_t last_error;  /* Set by writer and reconnect threads */
+    int mode;  /* Cached mode, -1 if unknown */
+    bs_version_t version;
+    pthread_mutex_t lock;  /* Protects pending requests, mailbox and
+                            * reconnect */
+    bs_mailbox_t* mailbox;  /* NULL if mailbox mode was never enabled */
+    bs_reconnect_t* reconnect;  /* NULL if never reconnected in background */
+    bool background_reconnect;
+    bool closing;  /* In bs_close(), no reconnect thread may be started */
+    bool cache;  /* Shadow cache enabled */
+    uint64_t shadow_valid[3];  /* Bit set for each valid color in shadow */
+    bs_color_t shadow[3][64];  /* Per channel */
+    bs_transfer_t* pending_head;  /* Requests submitted but not completed */
+    size_t pending;
+    size_t max_pending;
+    unsigned int timeout_ms;  /* Default request timeout, 0 for none */
+    unsigned long timeouts;  /* Number of requests that timed out */
+    int64_t last_success_us;  /* bs_now_us() of last successful request */
+    bool correct;  /* Color correction enabled */
+    bs_correction_t correction;
+    uint8_t lut[3][256];  /* Red, green and blue output for each input */
+    bs_power_pool_t* own_power;  /* Set by bs_set_power_budget() */
+    bs_power_pool_t* group_power;  /* Budget of group, used over own_power */
+    uint16_t level[3][64];  /* Sum of color bytes of each led as last sent,
+                             * only tracked while there is a budget */
+    stats_t stats;
+    uint32_t trace_session;  /* Tracing session trace_id belongs to */
+    uint16_t trace_id;  /* Id of device in the trace file */
+};
+
+/* Deadlines are absolute bs_now_us() times or one of these */
+#define DEADLINE_DEFAULT 0  /* Use the device default timeout per request */
+#define DEADLINE_NONE INT64_MAX  /* Never time out */
+
+/**
+ * Reports for setting leds on up to three channels, sent back to back.
+ */
+typedef struct segments_t {
+    size_t count;  /* Number of segments */
+    uint8_t channel[3];
+    uint8_t leds[3];  /* Number of leds in each segment */
+    const bs_color_t* color[3];
+    int64_t deadline;  /* For all segments, set by segments_frame() */
+    bs_error_t error[3];  /* Result of each segment */
+    /* Used while sending */
+    bool send[3];  /* Packed and not already shown according to cache */
+    bs_transfer_t* transfer[3];
+    uint16_t value[3];  /* Report */
+    uint16_t length[3];
+    uint8_t padded[3];  /* Number of leds in report */
+    uint8_t data[3][2 + 64 * 3];
+} segments_t;
+
+/**
+ * Fill in segments for a frame of count leds and result as
+ * bs_set_leds() would. Returns false in case of error.
+ */
+bool segments_frame(bs_device_t* device, size_t count,
+                    const bs_color_t* color, segments_t* segments,
+                    bs_segment_t* result) BS_NONULL;
+
+/**
+ * Start sending segments, must be followed by segments_finish()
+ * Same as segments_pack(), power_limit() for the device and segments_send().
+ * Returns false if any segment failed to start.
+ */
+bool segments_start(bs_device_t* device, segments_t* segments) BS_NONULL;
+
+/**
+ * Fill in the reports of segments, with color correction but no power
+ * limit. Returns false if any segment is invalid.
+ */
+bool segments_pack(bs_device_t* device, segments_t* segments) BS_NONULL;
+
+/**
+ * Start sending segments packed by segments_pack(), must be followed by
+ * segments_finish(). Returns false if any segment failed to start.
+ */
+bool segments_send(bs_device_t* device, segments_t* segments) BS_NONULL;
+
+/**
+ * Wait for segments started with segments_start() to complete.
+ * Returns false if any segment failed.
+ */
+bool segments_finish(bs_device_t* device, segments_t* segments) BS_NONULL;
+
+/**
+ * Create a new device using transport, serial is copied.
+ */
+bs_device_t* device_new(const bs_transport_t* transport, void* priv,
+                        const char* serial, bs_version_t version)
+    BS_NONULL_ARGS(1, 3) BS_MALLOC;
+
+/**
+ * Free the memory used by device, transport data must already be released.
+ */
+void device_free(bs_device_t* device) BS_NONULL;
+
+/**
+ * Allocate and submit a request, data is copied for requests to the device.
+ * Async requests are freed after callback has been called, sync ones must
+ * be waited for and freed by the caller.
+ * Returns NULL and sets device->last_error if the request was not sent.
+ */
+bs_transfer_t* submit_transfer(bs_device_t* device, uint8_t request_type,
+                               uint8_t request, uint16_t value,
+                               uint16_t index, const uint8_t* data,
+                               uint16_t length, bool async,
+                               bs_callback_t callback, void* userdata,
+                               int64_t deadline) BS_NONULL_ARGS(1);
+
+/**
+ * Handle events for device, or all devices if NULL, waiting at most
+ * timeout_us (negative to wait until something happens). If completed is
+ * non-null return as soon as it is set.
+ */
+bs_error_t device_events(bs_device_t* device, int64_t timeout_us,
+                         int* completed);
+
+/**
+ * Cancel all pending requests on device and wait for them to complete,
+ * gives up waiting if handling events fails.
+ */
+void cancel_pending(bs_device_t* device) BS_NONULL;
+
+/**
+ * Set the mode of device as unknown after requests sent outside of
+ * bs_set_mode(), the capability cache entry is removed.
+ */
+void forget_mode(bs_device_t* device) BS_NONULL;
+
+/**
+ * Called by transports when a transfer has completed.
+ * For transfers from the device, t->data must contain the result.
+ */
+void transfer_done(bs_transfer_t* t, bs_error_t error) BS_NONULL;
+
+/**
+ * Convert libusb error code to bs_error_t.
+ */
+bs_error_t error_from_libusb(ssize_t err);
+
+/**
+ * Open device if it is a BlinkStick and read its serial into serial.
+ * Returns NULL if device is not a BlinkStick or in case of error.
+ */
+libusb_device_handle* usb_open_serial(libusb_device* device, char* serial,
+                                      size_t size, bs_error_t* error)
+    BS_NONULL_ARGS(1, 2);
+
+/**
+ * Look up bus and address of the device with serial in the device index,
+ * or any device in the index if serial is NULL.
+ * Returns false if the index is not running, found is set to false if there
+ * is no such device.
+ */
+bool index_lookup(const char* serial, bool* found, uint8_t* bus,
+                  uint8_t* address) BS_NONULL_ARGS(2, 3, 4);
+
+/**
+ * Copy the serials in the device index starting with prefix, or all if
+ * prefix is NULL, to a NULL terminated array. serials is set to NULL if out
+ * of memory.
+ * Returns false if the index is not running.
+ */
+bool index_serials(const char* prefix, char*** serials) BS_NONULL_ARGS(2);
+
+/**
+ * Capabilities of a device as kept in the capability cache.
+ */
+typedef struct bs_caps_t {
+    bs_version_t version;
+    int mode;
+    uint16_t leds;  /* bs_get_max_leds() */
+} bs_caps_t;
+
+/**
+ * Read the capability cache entry for serial, only used if it was written
+ * for a device at the same bus and address.
+ * Returns false if there is no such entry or the cache is disabled.
+ */
+bool caps_load(const char* serial, uint8_t bus, uint8_t address,
+               bs_caps_t* entry) BS_NONULL;
+
+/**
+ * Write the capability cache entry for serial, or remove it if entry is
+ * NULL. If the cache is disabled nothing is written but an entry that
+ * differs from entry is still removed. Errors are ignored.
+ */
+void caps_store(const char* serial, uint8_t bus, uint8_t address,
+                const bs_caps_t* entry) BS_NONULL_ARGS(1);
+
+/**
+ * Current time from a monotonic clock in microseconds.
+ */
+int64_t bs_now_us(void);
+
+/**
+ * Time when the next emulated transfer for device, or any device if NULL,
+ * is due, in bs_now_us() time.
+ * Returns -1 if no emulated transfers are pending.
+ */
+int64_t emulated_next_due(bs_device_t* device);
+
+/**
+ * Complete all emulated transfers for device, or all devices if NULL,
+ * that are due.
+ */
+void emulated_dispatch(bs_device_t* device);
+
+/**
+ * Power budget shared by one or more devices.
+ */
+struct bs_power_pool_t {
+    pthread_mutex_t lock;  /* Protects everything below */
+    bs_power_t config;
+    uint32_t limit;  /* Budget as a sum of color bytes */
+    uint32_t total;  /* Sum of the levels of all devices using the pool */
+};
+
+/**
+ * Leds in a report about to be sent, count leds of three bytes each.
+ */
+typedef struct power_range_t {
+    uint8_t channel;
+    uint8_t index;
+    uint8_t count;
+    uint8_t* data;
+} power_range_t;
+
+bs_power_pool_t* power_pool_new(const bs_power_t* power) BS_NONULL BS_MALLOC;
+void power_pool_free(bs_power_pool_t* pool);
+void power_pool_configure(bs_power_pool_t* pool, const bs_power_t* power)
+    BS_NONULL;
+
+/**
+ * Change the budgets of device, moving its levels from the pool it used to
+ * the one it uses now. Either may be NULL.
+ */
+void power_switch(bs_device_t* device, bs_power_pool_t* own,
+                  bs_power_pool_t* group) BS_NONULL_ARGS(1);
+
+/**
+ * Fill in ranges, room for three, for the segments about to be sent.
+ * Returns number of ranges.
+ */
+size_t power_ranges(const segments_t* segments, power_range_t* ranges)
+    BS_NONULL;
+
+/**
+ * Add the levels last sent to, and requested for, the leds in ranges.
+ * The lock of the pool device uses must be held.
+ */
+void power_sums(bs_device_t* device, const power_range_t* ranges,
+                size_t count, uint32_t* old, uint32_t* requested) BS_NONULL;
+
+/**
+ * Scale, 16.16 fixed point, that fits requested in pool when replacing old.
+ * pool->lock must be held.
+ */
+uint32_t power_scale(const bs_power_pool_t* pool, uint32_t old,
+                     uint32_t requested) BS_NONULL;
+
+/**
+ * Scale ranges and remember their levels as sent, returns the new level.
+ * The lock of the pool device uses must be held.
+ */
+uint32_t power_apply(bs_device_t* device, power_range_t* ranges,
+                     size_t count, uint32_t scale) BS_NONULL;
+
+/**
+ * Scale ranges to fit in the budget of device, if any.
+ */
+void power_limit(bs_device_t* device, power_range_t* ranges, size_t count)
+    BS_NONULL;
+
+/**
+ * Estimated current of the devices using pool, in mA.
+ */
+uint32_t power_estimate(bs_power_pool_t* pool) BS_NONULL;
+
+void stats_init(stats_t* stats) BS_NONULL;
+
+/**
+ * Add value to counter of device, may be NULL, and of all devices.
+ */
+void stats_add(bs_device_t* device, stats_counter_t counter, uint64_t value);
+
+/**
+ * Count a completed request, called by transfer_done().
+ */
+void stats_request(bs_device_t* device, const bs_transfer_t* t,
+                   bs_error_t error) BS_NONULL;
+
+/**
+ * Write a completed request to the trace file if tracing, called by
+ * transfer_done().
+ */
+void trace_request(bs_device_t* device, const bs_transfer_t* t,
+                   bs_error_t error) BS_NONULL;
+
+#endif /* LIBBS_PRIVATE_H */
@@ -0,0 +1,120 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <pthread.h>
+#include <string.h>
+
+#include "libbs_private.h"
+
+#if HAVE_X86_SIMD
+# include <immintrin.h>
+#elif defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
+
+/* The kernels treat colors as packed RGB bytes */
+typedef char color_is_three_bytes[sizeof(bs_color_t) == 3 ? 1 : -1];
+
+/* Going between RGB and GRB only swaps the first two bytes of each led, so
+ * the same kernel both packs and unpacks. All kernels handle dst == src. */
+typedef void (*swap_kernel_t)(uint8_t* dst, const uint8_t* src, size_t count);
+
+static void swap_scalar(uint8_t* dst, const uint8_t* src, size_t count) {
+    size_t i;
+    for (i = 0; i < count; i++, dst += 3, src += 3) {
+        const uint8_t first = src[0];
+        dst[0] = src[1];
+        dst[1] = first;
+        dst[2] = src[2];
+    }
+}
+
+#if HAVE_X86_SIMD
+/* Five leds and the first byte of the sixth, which is left as is and
+ * written again by the next step */
+# define SWAP_MASK 1, 0, 2, 4, 3, 5, 7, 6, 8, 10, 9, 11, 13, 12, 14, 15
+
+__attribute__((target("ssse3")))
+static void swap_ssse3(uint8_t* dst, const uint8_t* src, size_t count) {
+    const __m128i mask = _mm_setr_epi8(SWAP_MASK);
+    size_t i = 0;
+    /* Each step reads and writes 16 bytes but only moves 5 leds */
+    for (; count - i >= 6; i += 5) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 3));
+        _mm_storeu_si128((__m128i*)(dst + i * 3), _mm_shuffle_epi8(v, mask));
+    }
+    swap_scalar(dst + i * 3, src + i * 3, count - i);
+}
+
+__attribute__((target("avx2")))
+static void swap_avx2(uint8_t* dst, const uint8_t* src, size_t count) {
+    /* Shuffles stay within each 128 bit lane, so each lane gets five leds */
+    const __m256i mask = _mm256_setr_epi8(SWAP_MASK, SWAP_MASK);
+    size_t i = 0;
+    for (; count - i >= 11; i += 10) {
+        const __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(
+                _mm_loadu_si128((const __m128i*)(src + i * 3))),
+            _mm_loadu_si128((const __m128i*)(src + i * 3 + 15)), 1);
+        const __m256i r = _mm256_shuffle_epi8(v, mask);
+        _mm_storeu_si128((__m128i*)(dst + i * 3),
+                         _mm256_castsi256_si128(r));
+        _mm_storeu_si128((__m128i*)(dst + i * 3 + 15),
+                         _mm256_extracti128_si256(r, 1));
+    }
+    swap_scalar(dst + i * 3, src + i * 3, count - i);
+}
+#elif defined(__ARM_NEON)
+static void swap_neon(uint8_t* dst, const uint8_t* src, size_t count) {
+    size_t i = 0;
+    for (; count - i >= 16; i += 16) {
+        uint8x16x3_t v = vld3q_u8(src + i * 3);
+        const uint8x16_t first = v.val[0];
+        v.val[0] = v.val[1];
+        v.val[1] = first;
+        vst3q_u8(dst + i * 3, v);
+    }
+    swap_scalar(dst + i * 3, src + i * 3, count - i);
+}
+#endif
+
+static struct {
+    pthread_once_t once;
+    swap_kernel_t swap;
+    const char* name;
+} kernel = { PTHREAD_ONCE_INIT, swap_scalar, "scalar" };
+
+static void select_kernel(void) {
+#if HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernel.swap = swap_avx2;
+        kernel.name = "avx2";
+    } else if (__builtin_cpu_supports("ssse3")) {
+        kernel.swap = swap_ssse3;
+        kernel.name = "ssse3";
+    }
+#elif defined(__ARM_NEON)
+    kernel.swap = swap_neon;
+    kernel.name = "neon";
+#endif
+}
+
+static swap_kernel_t get_kernel(void) {
+    pthread_once(&kernel.once, select_kernel);
+    return kernel.swap;
+}
+
+void bs_pack_grb(uint8_t* dst, const bs_color_t* src, size_t count) {
+    get_kernel()(dst, (const uint8_t*)src, count);
+}
+
+void bs_unpack_grb(bs_color_t* dst, const uint8_t* src, size_t count) {
+    get_kernel()((uint8_t*)dst, src, count);
+}
+
+const char* bs_pixel_kernel(void) {
+    pthread_once(&kernel.once, select_kernel);
+    return kernel.name;
+}
@@ -0,0 +1,206 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libbs_private.h"
+
+/* Levels are the sum of the three color bytes of a led, current is
+ * estimated as linear in the level. All limiting is done on levels so it
+ * is integer only. */
+
+#define SCALE_ONE (1u << 16)
+
+bs_power_pool_t* power_pool_new(const bs_power_t* power) {
+    bs_power_pool_t* pool = calloc(1, sizeof(bs_power_pool_t));
+    if (!pool) return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    power_pool_configure(pool, power);
+    return pool;
+}
+
+void power_pool_free(bs_power_pool_t* pool) {
+    if (!pool) return;
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+void power_pool_configure(bs_power_pool_t* pool, const bs_power_t* power) {
+    const uint32_t idle = (uint32_t)power->idle_ma * power->leds;
+    uint32_t limit;
+    if (power->led_ma == 0) {
+        limit = UINT32_MAX;
+    } else if (power->budget_ma <= idle) {
+        limit = 0;
+    } else {
+        /* One led color at 255 draws led_ma */
+        limit = (uint64_t)(power->budget_ma - idle) * 255 / power->led_ma;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->config = *power;
+    pool->limit = limit;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Budget used by device */
+static bs_power_pool_t* device_pool(bs_device_t* device) BS_NONULL;
+
+bs_power_pool_t* device_pool(bs_device_t* device) {
+    return device->group_power ? device->group_power : device->own_power;
+}
+
+static uint32_t device_level(bs_device_t* device) BS_NONULL;
+
+uint32_t device_level(bs_device_t* device) {
+    uint32_t sum = 0;
+    size_t c, i;
+    for (c = 0; c < 3; c++) {
+        for (i = 0; i < 64; i++) sum += device->level[c][i];
+    }
+    return sum;
+}
+
+void power_switch(bs_device_t* device, bs_power_pool_t* own,
+                  bs_power_pool_t* group) {
+    bs_power_pool_t* old = device_pool(device);
+    bs_power_pool_t* pool = group ? group : own;
+    uint32_t level;
+    pthread_mutex_lock(&device->lock);
+    device->own_power = own;
+    device->group_power = group;
+    if (pool != old) {
+        /* The cache has colors as requested, not as limited */
+        memset(device->shadow_valid, 0, sizeof(device->shadow_valid));
+    }
+    pthread_mutex_unlock(&device->lock);
+    if (pool == old) return;
+    if (old) {
+        level = device_level(device);
+        pthread_mutex_lock(&old->lock);
+        old->total -= level;
+        pthread_mutex_unlock(&old->lock);
+    } else {
+        /* Levels are not tracked without a budget, nothing known is lit */
+        memset(device->level, 0, sizeof(device->level));
+    }
+    if (pool) {
+        level = device_level(device);
+        pthread_mutex_lock(&pool->lock);
+        pool->total += level;
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+size_t power_ranges(const segments_t* segments, power_range_t* ranges) {
+    size_t i, n = 0;
+    for (i = 0; i < segments->count; i++) {
+        if (!segments->send[i]) continue;
+        ranges[n].channel = segments->channel[i];
+        ranges[n].index = 0;
+        if (segments->value[i] == 1) {
+            /* Single led report, RGB after the report byte */
+            ranges[n].count = 1;
+            ranges[n].data = (uint8_t*)segments->data[i] + 1;
+        } else {
+            /* Padding is sent as black */
+            ranges[n].count = segments->padded[i];
+            ranges[n].data = (uint8_t*)segments->data[i] + 2;
+        }
+        n++;
+    }
+    return n;
+}
+
+void power_sums(bs_device_t* device, const power_range_t* ranges,
+                size_t count, uint32_t* old, uint32_t* requested) {
+    size_t r, i;
+    for (r = 0; r < count; r++) {
+        const uint8_t* data = ranges[r].data;
+        const uint16_t* level = device->level[ranges[r].channel] +
+            ranges[r].index;
+        for (i = 0; i < ranges[r].count; i++, data += 3) {
+            *old += level[i];
+            *requested += data[0] + data[1] + data[2];
+        }
+    }
+}
+
+uint32_t power_scale(const bs_power_pool_t* pool, uint32_t old,
+                     uint32_t requested) {
+    const uint32_t others = pool->total - old;
+    const uint32_t available = pool->limit > others ?
+        pool->limit - others : 0;
+    if (requested <= available) return SCALE_ONE;
+    return (uint32_t)(((uint64_t)available << 16) / requested);
+}
+
+uint32_t power_apply(bs_device_t* device, power_range_t* ranges,
+                     size_t count, uint32_t scale) {
+    uint32_t sum = 0;
+    size_t r, i;
+    for (r = 0; r < count; r++) {
+        uint8_t* data = ranges[r].data;
+        uint16_t* level = device->level[ranges[r].channel] + ranges[r].index;
+        for (i = 0; i < ranges[r].count; i++, data += 3) {
+            if (scale < SCALE_ONE) {
+                /* Rounds down so the result stays within budget */
+                data[0] = (data[0] * scale) >> 16;
+                data[1] = (data[1] * scale) >> 16;
+                data[2] = (data[2] * scale) >> 16;
+            }
+            level[i] = data[0] + data[1] + data[2];
+            sum += level[i];
+        }
+    }
+    return sum;
+}
+
+void power_limit(bs_device_t* device, power_range_t* ranges, size_t count) {
+    bs_power_pool_t* pool = device_pool(device);
+    uint32_t old = 0, requested = 0, sent;
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    power_sums(device, ranges, count, &old, &requested);
+    sent = power_apply(device, ranges, count,
+                       power_scale(pool, old, requested));
+    pool->total += sent - old;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+uint32_t power_estimate(bs_power_pool_t* pool) {
+    uint32_t ma;
+    pthread_mutex_lock(&pool->lock);
+    ma = (uint32_t)pool->config.idle_ma * pool->config.leds +
+        (uint32_t)((uint64_t)pool->total * pool->config.led_ma / 255);
+    pthread_mutex_unlock(&pool->lock);
+    return ma;
+}
+
+bool bs_set_power_budget(bs_device_t* device, const bs_power_t* power) {
+    bs_power_pool_t* own = device->own_power;
+    if (power) {
+        if (own) {
+            power_pool_configure(own, power);
+            return true;
+        }
+        own = power_pool_new(power);
+        if (!own) {
+            device->last_error = BS_ERROR_NO_MEM;
+            return false;
+        }
+        power_switch(device, own, device->group_power);
+        return true;
+    }
+    if (own) {
+        power_switch(device, NULL, device->group_power);
+        power_pool_free(own);
+    }
+    return true;
+}
+
+uint32_t bs_power_estimate(bs_device_t* device) {
+    bs_power_pool_t* pool = device_pool(device);
+    return pool ? power_estimate(pool) : 0;
+}
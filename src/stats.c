@@ -0,0 +1,89 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <string.h>
+
+#include "libbs_private.h"
+
+/* Counters are only ever added to, and read one at a time, so relaxed
+ * atomics are enough and requests never wait for a lock to count. */
+
+static stats_t global;  /* All devices, zero initialized */
+
+void stats_init(stats_t* stats) {
+    size_t i;
+    for (i = 0; i < STATS_COUNTERS; i++) atomic_init(&stats->counter[i], 0);
+    for (i = 0; i < BS_STATS_BUCKETS; i++) atomic_init(&stats->latency[i], 0);
+}
+
+static void add(stats_t* stats, stats_counter_t counter, uint64_t value) {
+    atomic_fetch_add_explicit(&stats->counter[counter], value,
+                              memory_order_relaxed);
+}
+
+void stats_add(bs_device_t* device, stats_counter_t counter,
+               uint64_t value) {
+    if (device) add(&device->stats, counter, value);
+    add(&global, counter, value);
+}
+
+/* Histogram bucket for a request that took us microseconds */
+static size_t bucket(uint64_t us) {
+    size_t i = 0;
+    while (i < BS_STATS_BUCKETS - 1 && (us >> i) != 0) i++;
+    return i;
+}
+
+void stats_request(bs_device_t* device, const bs_transfer_t* t,
+                   bs_error_t error) {
+    const int64_t now = bs_now_us();
+    const uint64_t us = now > t->start_us ? now - t->start_us : 0;
+    const size_t i = bucket(us);
+    stats_add(device, STATS_REQUESTS, 1);
+    if (error == BS_NO_ERROR) {
+        stats_add(device, (t->request_type & LIBUSB_ENDPOINT_IN) ?
+                  STATS_BYTES_IN : STATS_BYTES_OUT, t->length);
+    } else if (error != BS_ERROR_CANCELLED) {
+        stats_add(device, STATS_ERRORS, 1);
+        if (error == BS_ERROR_TIMEOUT) stats_add(device, STATS_TIMEOUTS, 1);
+    }
+    stats_add(device, STATS_LATENCY_US, us);
+    atomic_fetch_add_explicit(&device->stats.latency[i], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&global.latency[i], 1, memory_order_relaxed);
+}
+
+void bs_stats(bs_device_t* device, bs_stats_t* stats) {
+    stats_t* src = device ? &device->stats : &global;
+    uint64_t counter[STATS_COUNTERS];
+    size_t i;
+    for (i = 0; i < STATS_COUNTERS; i++) {
+        counter[i] = atomic_load_explicit(&src->counter[i],
+                                          memory_order_relaxed);
+    }
+    stats->requests = counter[STATS_REQUESTS];
+    stats->errors = counter[STATS_ERRORS];
+    stats->timeouts = counter[STATS_TIMEOUTS];
+    stats->bytes_out = counter[STATS_BYTES_OUT];
+    stats->bytes_in = counter[STATS_BYTES_IN];
+    stats->retries = counter[STATS_RETRIES];
+    stats->reconnects = counter[STATS_RECONNECTS];
+    stats->interrupted = counter[STATS_INTERRUPTED];
+    stats->latency_us = counter[STATS_LATENCY_US];
+    for (i = 0; i < BS_STATS_BUCKETS; i++) {
+        stats->latency[i] = atomic_load_explicit(&src->latency[i],
+                                                 memory_order_relaxed);
+    }
+}
+
+void bs_stats_reset(bs_device_t* device) {
+    stats_t* stats = device ? &device->stats : &global;
+    size_t i;
+    for (i = 0; i < STATS_COUNTERS; i++) {
+        atomic_store_explicit(&stats->counter[i], 0, memory_order_relaxed);
+    }
+    for (i = 0; i < BS_STATS_BUCKETS; i++) {
+        atomic_store_explicit(&stats->latency[i], 0, memory_order_relaxed);
+    }
+}
@@ -0,0 +1,175 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libbs.h"
+#include "extra_compiler_stuff.h"
+
+/* Stress test for the thread safety promised in libbs.h. Each worker
+ * thread drives its own emulated device, mixing blocking and asynchronous
+ * sets, and reads every frame back to check it. At the same time one
+ * thread handles events for all devices, completing requests of the
+ * workers, and one keeps reading the state that may be read from any
+ * thread. The last worker's device fails now and then with a disconnect so
+ * the background reconnect thread runs as well. */
+
+#define WORKERS 8
+#define ROUNDS 300
+#define LEDS 64
+
+typedef struct worker_t {
+    pthread_t thread;
+    bs_device_t* device;
+    bool flaky;  /* Device fails some requests, only check what succeeds */
+    unsigned int seed;
+    unsigned long async;  /* Asynchronous sets started */
+    atomic_ulong completed;  /* Asynchronous sets completed */
+    unsigned long checked;
+    unsigned long mismatch;
+} worker_t;
+
+static struct {
+    worker_t worker[WORKERS];
+    atomic_bool done;
+} glob;
+
+static void set_done(bs_device_t* device UNUSED, bs_error_t error UNUSED,
+                     void* userdata) {
+    worker_t* worker = userdata;
+    atomic_fetch_add(&worker->completed, 1);
+}
+
+static void fill(worker_t* worker, bs_color_t* color) {
+    size_t i;
+    for (i = 0; i < LEDS; i++) {
+        color[i].red = rand_r(&worker->seed);
+        color[i].green = rand_r(&worker->seed);
+        color[i].blue = rand_r(&worker->seed);
+    }
+}
+
+/* Set a frame, blocking or not depending on round. Returns false if the
+ * frame could not be set */
+static bool set_frame(worker_t* worker, unsigned int round,
+                      const bs_color_t* color) {
+    if (round % 2 == 0) return bs_set_many(worker->device, LEDS, color);
+    while (!bs_set_many_async(worker->device, LEDS, color, set_done,
+                              worker)) {
+        if (bs_error(worker->device) != BS_ERROR_BUSY) return false;
+        bs_flush(worker->device);
+    }
+    worker->async++;
+    return bs_flush(worker->device);
+}
+
+static void* worker_thread(void* arg) {
+    worker_t* worker = arg;
+    bs_color_t color[LEDS], got[LEDS];
+    unsigned int round;
+    for (round = 0; round < ROUNDS; round++) {
+        fill(worker, color);
+        while (worker->flaky &&
+               bs_connection(worker->device) == BS_RECONNECTING) {
+            bs_handle_events(1, NULL);
+        }
+        if (!set_frame(worker, round, color)) {
+            if (!worker->flaky) worker->mismatch++;
+            continue;
+        }
+        if (!bs_get_many(worker->device, LEDS, got)) {
+            if (!worker->flaky) worker->mismatch++;
+            continue;
+        }
+        worker->checked++;
+        if (memcmp(color, got, sizeof(color)) != 0) worker->mismatch++;
+    }
+    bs_flush(worker->device);
+    return NULL;
+}
+
+static void* events_thread(void* arg UNUSED) {
+    while (!atomic_load(&glob.done)) bs_handle_events(1, NULL);
+    return NULL;
+}
+
+static void* observer_thread(void* arg UNUSED) {
+    unsigned long sum = 0;
+    while (!atomic_load(&glob.done)) {
+        size_t i;
+        for (i = 0; i < WORKERS; i++) {
+            bs_device_t* device = glob.worker[i].device;
+            sum += bs_error(device) + bs_pending(device) +
+                bs_connection(device);
+        }
+    }
+    return (void*)sum;
+}
+
+static bool open_workers(void) {
+    size_t i;
+    for (i = 0; i < WORKERS; i++) {
+        worker_t* worker = glob.worker + i;
+        bs_emulated_config_t config;
+        bs_error_t error;
+        memset(&config, 0, sizeof(config));
+        config.type = BS_EMULATED_PRO;
+        config.latency_us = 100;
+        worker->flaky = i == WORKERS - 1;
+        if (worker->flaky) {
+            config.fail_permille = 20;
+            config.fail_error = BS_ERROR_DISCONNECTED;
+            config.seed = 1;
+        }
+        worker->seed = i + 1;
+        atomic_init(&worker->completed, 0);
+        worker->device = bs_open_emulated(&config, &error);
+        if (!worker->device) {
+            fprintf(stderr, "Error opening emulated device: %s\n",
+                    bs_error_str(error));
+            return false;
+        }
+        if (!bs_set_mode(worker->device, BS_MODE_MULTI)) {
+            fprintf(stderr, "Error setting mode: %s\n",
+                    bs_error_str(bs_error(worker->device)));
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(void) {
+    pthread_t events, observer;
+    bool ok = true;
+    size_t i;
+    atomic_init(&glob.done, false);
+    if (!open_workers()) return EXIT_FAILURE;
+    pthread_create(&events, NULL, events_thread, NULL);
+    pthread_create(&observer, NULL, observer_thread, NULL);
+    for (i = 0; i < WORKERS; i++) {
+        pthread_create(&glob.worker[i].thread, NULL, worker_thread,
+                       glob.worker + i);
+    }
+    for (i = 0; i < WORKERS; i++) pthread_join(glob.worker[i].thread, NULL);
+    atomic_store(&glob.done, true);
+    pthread_join(events, NULL);
+    pthread_join(observer, NULL);
+    for (i = 0; i < WORKERS; i++) {
+        worker_t* worker = glob.worker + i;
+        const unsigned long completed = atomic_load(&worker->completed);
+        printf("worker %lu: %lu frames checked, %lu wrong, "
+               "%lu of %lu async completed\n", (unsigned long)i,
+               worker->checked, worker->mismatch, completed, worker->async);
+        if (worker->mismatch > 0 || completed != worker->async ||
+            worker->checked == 0) {
+            ok = false;
+        }
+        bs_close(worker->device);
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
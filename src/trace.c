@@ -0,0 +1,483 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extra_compiler_stuff.h"
+#include "libbs_private.h"
+
+/* Trace file format, all numbers little endian:
+ *   header   "BSTRACE" and a version byte
+ *   device   u8 TRACE_DEVICE, u16 id, u8 length, serial
+ *   request  u8 TRACE_REQUEST, u16 id, u64 start, u32 duration,
+ *            u8 request_type, u8 request, u16 value, u16 index, u16 length,
+ *            u8 error, u16 size, size bytes of payload
+ * A device record comes before the first request of that device. start is
+ * microseconds from bs_trace_start() to submit, duration from submit to
+ * completion. The payload is the data sent, or the data received if the
+ * request was from the device and succeeded.
+ *
+ * Requests are encoded into a ring buffer while holding a lock for no more
+ * than a copy, a thread writes the ring to the file. If the writer falls
+ * behind, requests that do not fit are dropped and counted instead of
+ * slowing down the caller. */
+
+static const uint8_t trace_magic[8] = { 'B', 'S', 'T', 'R', 'A', 'C', 'E', 1 };
+
+#define TRACE_DEVICE 1
+#define TRACE_REQUEST 2
+#define TRACE_DEVICE_SIZE 4  /* Without serial */
+#define TRACE_REQUEST_SIZE 26  /* Without payload */
+#define TRACE_DEFAULT_BUFFER (1024 * 1024)
+#define TRACE_MIN_BUFFER 1024
+
+static struct {
+    pthread_mutex_t lock;  /* Protects everything below but enabled */
+    pthread_cond_t cond;  /* Signalled when there is data or on stop */
+    atomic_bool enabled;  /* Checked for every request without the lock */
+    bool running;  /* Started and not yet stopped */
+    bool stop;  /* Writer should finish, set until it has */
+    bool failed;  /* Writing to the file failed */
+    FILE* fh;
+    pthread_t thread;
+    uint8_t* ring;
+    size_t size, tail, used;  /* Ring buffer, tail is first unwritten */
+    uint32_t session;  /* Increased by every bs_trace_start() */
+    uint16_t next_id;  /* Next device id */
+    int64_t start_us;
+    uint64_t dropped;
+} trace = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false, false,
+            false, false, NULL, 0, NULL, 0, 0, 0, 0, 0, 0, 0 };
+
+static void put16(uint8_t* data, uint16_t value) {
+    data[0] = value & 0xff;
+    data[1] = value >> 8;
+}
+
+static void put32(uint8_t* data, uint32_t value) {
+    put16(data, value & 0xffff);
+    put16(data + 2, value >> 16);
+}
+
+static void put64(uint8_t* data, uint64_t value) {
+    put32(data, value & 0xffffffff);
+    put32(data + 4, value >> 32);
+}
+
+static uint16_t get16(const uint8_t* data) {
+    return data[0] | (data[1] << 8);
+}
+
+static uint32_t get32(const uint8_t* data) {
+    return get16(data) | ((uint32_t)get16(data + 2) << 16);
+}
+
+static uint64_t get64(const uint8_t* data) {
+    return get32(data) | ((uint64_t)get32(data + 4) << 32);
+}
+
+/* Append len bytes to the ring, there must be room. trace.lock must be
+ * held */
+static void ring_put(const uint8_t* data, size_t len) BS_NONULL;
+
+void ring_put(const uint8_t* data, size_t len) {
+    size_t head = (trace.tail + trace.used) % trace.size;
+    size_t n = len < trace.size - head ? len : trace.size - head;
+    memcpy(trace.ring + head, data, n);
+    memcpy(trace.ring, data + n, len - n);
+    trace.used += len;
+}
+
+void trace_request(bs_device_t* device, const bs_transfer_t* t,
+                   bs_error_t error) {
+    uint8_t record[TRACE_REQUEST_SIZE], header[TRACE_DEVICE_SIZE];
+    const int64_t now = bs_now_us();
+    const bool in = (t->request_type & LIBUSB_ENDPOINT_IN) != 0;
+    const uint16_t size = in && error != BS_NO_ERROR ? 0 : t->length;
+    size_t serial = 0, need = sizeof(record) + size;
+    if (!atomic_load_explicit(&trace.enabled, memory_order_relaxed)) return;
+    record[0] = TRACE_REQUEST;
+    put32(record + 11, now > t->start_us ? now - t->start_us : 0);
+    record[15] = t->request_type;
+    record[16] = t->request;
+    put16(record + 17, t->value);
+    put16(record + 19, t->index);
+    put16(record + 21, t->length);
+    record[23] = error;
+    put16(record + 24, size);
+    pthread_mutex_lock(&trace.lock);
+    if (!trace.running) {
+        pthread_mutex_unlock(&trace.lock);
+        return;
+    }
+    if (device->trace_session != trace.session) {
+        serial = strlen(device->serial);
+        if (serial > 0xff) serial = 0xff;
+        need += sizeof(header) + serial;
+    }
+    if (trace.size - trace.used < need ||
+        (serial > 0 && trace.next_id == UINT16_MAX)) {
+        trace.dropped++;
+        pthread_mutex_unlock(&trace.lock);
+        return;
+    }
+    if (device->trace_session != trace.session) {
+        device->trace_session = trace.session;
+        device->trace_id = trace.next_id++;
+        header[0] = TRACE_DEVICE;
+        put16(header + 1, device->trace_id);
+        header[3] = serial;
+        ring_put(header, sizeof(header));
+        ring_put((const uint8_t*)device->serial, serial);
+    }
+    put16(record + 1, device->trace_id);
+    put64(record + 3, t->start_us > trace.start_us ?
+          t->start_us - trace.start_us : 0);
+    ring_put(record, sizeof(record));
+    if (size > 0) ring_put(t->data, size);
+    pthread_cond_signal(&trace.cond);
+    pthread_mutex_unlock(&trace.lock);
+}
+
+static void* trace_run(void* arg UNUSED) {
+    pthread_mutex_lock(&trace.lock);
+    while (true) {
+        size_t n;
+        bool ok;
+        while (trace.used == 0 && !trace.stop) {
+            pthread_cond_wait(&trace.cond, &trace.lock);
+        }
+        if (trace.used == 0) break;
+        /* Producers only write after tail + used, so the part being written
+         * to the file can be read without the lock */
+        n = trace.size - trace.tail;
+        if (n > trace.used) n = trace.used;
+        pthread_mutex_unlock(&trace.lock);
+        ok = fwrite(trace.ring + trace.tail, 1, n, trace.fh) == n;
+        pthread_mutex_lock(&trace.lock);
+        if (!ok) trace.failed = true;
+        trace.tail = (trace.tail + n) % trace.size;
+        trace.used -= n;
+    }
+    pthread_mutex_unlock(&trace.lock);
+    return NULL;
+}
+
+/* Allocate the ring and create the trace file, trace.lock must be held */
+static bs_error_t trace_open(const char* path, size_t buffer) BS_NONULL;
+
+bs_error_t trace_open(const char* path, size_t buffer) {
+    trace.ring = malloc(buffer);
+    if (!trace.ring) return BS_ERROR_NO_MEM;
+    trace.fh = fopen(path, "wb");
+    if (!trace.fh) {
+        const bs_error_t error = errno == EACCES ? BS_ERROR_ACCESS :
+            BS_ERROR_IO;
+        free(trace.ring);
+        return error;
+    }
+    if (fwrite(trace_magic, 1, sizeof(trace_magic), trace.fh) !=
+        sizeof(trace_magic)) {
+        fclose(trace.fh);
+        remove(path);
+        free(trace.ring);
+        return BS_ERROR_IO;
+    }
+    trace.size = buffer;
+    trace.tail = trace.used = 0;
+    return BS_NO_ERROR;
+}
+
+bool bs_trace_start(const char* path, size_t buffer, bs_error_t* error) {
+    bs_error_t err;
+    if (buffer == 0) buffer = TRACE_DEFAULT_BUFFER;
+    if (buffer < TRACE_MIN_BUFFER) {
+        if (error) *error = BS_ERROR_INVALID_PARAM;
+        return false;
+    }
+    pthread_mutex_lock(&trace.lock);
+    if (trace.running || trace.stop) {
+        pthread_mutex_unlock(&trace.lock);
+        if (error) *error = BS_ERROR_BUSY;
+        return false;
+    }
+    err = trace_open(path, buffer);
+    if (err != BS_NO_ERROR) {
+        pthread_mutex_unlock(&trace.lock);
+        if (error) *error = err;
+        return false;
+    }
+    trace.failed = false;
+    trace.session++;
+    trace.next_id = 0;
+    trace.dropped = 0;
+    trace.start_us = bs_now_us();
+    if (pthread_create(&trace.thread, NULL, trace_run, NULL)) {
+        fclose(trace.fh);
+        remove(path);
+        free(trace.ring);
+        pthread_mutex_unlock(&trace.lock);
+        if (error) *error = BS_ERROR_NO_MEM;
+        return false;
+    }
+    trace.running = true;
+    atomic_store_explicit(&trace.enabled, true, memory_order_relaxed);
+    pthread_mutex_unlock(&trace.lock);
+    return true;
+}
+
+bool bs_trace_stop(bs_error_t* error) {
+    bool ok;
+    pthread_mutex_lock(&trace.lock);
+    if (!trace.running) {
+        pthread_mutex_unlock(&trace.lock);
+        return true;
+    }
+    atomic_store_explicit(&trace.enabled, false, memory_order_relaxed);
+    trace.running = false;
+    trace.stop = true;
+    pthread_cond_signal(&trace.cond);
+    pthread_mutex_unlock(&trace.lock);
+    /* Writer empties the ring before it returns */
+    pthread_join(trace.thread, NULL);
+    pthread_mutex_lock(&trace.lock);
+    ok = !trace.failed;
+    ok = fclose(trace.fh) == 0 && ok;
+    trace.fh = NULL;
+    free(trace.ring);
+    trace.ring = NULL;
+    trace.stop = false;
+    pthread_mutex_unlock(&trace.lock);
+    if (!ok && error) *error = BS_ERROR_IO;
+    return ok;
+}
+
+uint64_t bs_trace_dropped(void) {
+    uint64_t dropped;
+    pthread_mutex_lock(&trace.lock);
+    dropped = trace.dropped;
+    pthread_mutex_unlock(&trace.lock);
+    return dropped;
+}
+
+/* A request being replayed */
+typedef struct replay_request_t replay_request_t;
+
+typedef struct replay_t {
+    bs_replay_callback_t callback;
+    void* userdata;
+    replay_request_t* pending;  /* Submitted and not completed */
+} replay_t;
+
+struct replay_request_t {
+    replay_t* replay;
+    replay_request_t* next;
+    uint64_t end_us;  /* start + duration in the trace */
+    int64_t submit_us;
+    bs_replay_t info;
+};
+
+static void replay_done(bs_device_t* device UNUSED, bs_error_t error,
+                        void* userdata) {
+    replay_request_t* request = userdata;
+    replay_t* replay = request->replay;
+    replay_request_t** ptr;
+    const int64_t now = bs_now_us();
+    if (!replay) {
+        /* Given up on by bs_replay() */
+        free(request);
+        return;
+    }
+    ptr = &replay->pending;
+    while (*ptr != request) ptr = &(*ptr)->next;
+    *ptr = request->next;
+    request->info.latency_us = now > request->submit_us ?
+        now - request->submit_us : 0;
+    request->info.error = error;
+    if (replay->callback) replay->callback(&request->info, replay->userdata);
+    free(request);
+}
+
+/* Read the next record of interest from fh into info and data, room for
+ * 0xffff bytes. Device records are remembered in serials, the ids of
+ * devices matching serial, or all if NULL, are set in match.
+ * Returns false at the end of the trace, error is set if it is not a
+ * proper end. */
+static bool replay_read(FILE* fh, const char* serial, uint8_t* match,
+                        bs_replay_t* info, uint8_t* data, bs_error_t* error)
+    BS_NONULL_ARGS(1, 3, 4, 5, 6);
+
+bool replay_read(FILE* fh, const char* serial, uint8_t* match,
+                 bs_replay_t* info, uint8_t* data, bs_error_t* error) {
+    uint8_t record[TRACE_REQUEST_SIZE];
+    char name[256];
+    uint16_t id, size;
+    while (true) {
+        if (fread(record, 1, 1, fh) != 1) break;
+        if (record[0] == TRACE_DEVICE) {
+            if (fread(record + 1, 1, TRACE_DEVICE_SIZE - 1, fh) !=
+                TRACE_DEVICE_SIZE - 1 ||
+                fread(name, 1, record[3], fh) != record[3]) {
+                break;
+            }
+            name[record[3]] = '\0';
+            id = get16(record + 1);
+            if (!serial || strcmp(serial, name) == 0) {
+                match[id / 8] |= 1 << (id % 8);
+            } else {
+                match[id / 8] &= ~(1 << (id % 8));
+            }
+            continue;
+        }
+        if (record[0] != TRACE_REQUEST) {
+            *error = BS_ERROR_INVALID_PARAM;
+            return false;
+        }
+        if (fread(record + 1, 1, TRACE_REQUEST_SIZE - 1, fh) !=
+            TRACE_REQUEST_SIZE - 1) {
+            break;
+        }
+        size = get16(record + 24);
+        if (fread(data, 1, size, fh) != size) break;
+        id = get16(record + 1);
+        if ((match[id / 8] & (1 << (id % 8))) == 0) continue;
+        info->start_us = get64(record + 3);
+        info->recorded_us = get32(record + 11);
+        info->request_type = record[15];
+        info->request = record[16];
+        info->value = get16(record + 17);
+        info->index = get16(record + 19);
+        info->length = get16(record + 21);
+        info->recorded_error = record[23] <= BS_ERROR_CANCELLED ?
+            (bs_error_t)record[23] : BS_ERROR_UNKNOWN;
+        if ((info->request_type & LIBUSB_ENDPOINT_IN) == 0 &&
+            size != info->length) {
+            *error = BS_ERROR_INVALID_PARAM;
+            return false;
+        }
+        return true;
+    }
+    /* A trace cut short, by a crash say, is replayed up to where it ends */
+    if (ferror(fh)) *error = BS_ERROR_IO;
+    return false;
+}
+
+/* Handle events until no pending request ended before start in the trace,
+ * and it is at least due */
+static bs_error_t replay_wait(bs_device_t* device, replay_t* replay,
+                              uint64_t start, int64_t due) BS_NONULL;
+
+bs_error_t replay_wait(bs_device_t* device, replay_t* replay,
+                       uint64_t start, int64_t due) {
+    while (true) {
+        const replay_request_t* request = replay->pending;
+        const int64_t now = bs_now_us();
+        bs_error_t error;
+        while (request && request->end_us > start) request = request->next;
+        if (request) {
+            error = device_events(device, -1, NULL);
+        } else if (now < due) {
+            error = device_events(device, due - now, NULL);
+        } else {
+            return BS_NO_ERROR;
+        }
+        if (error != BS_NO_ERROR) return error;
+    }
+}
+
+bool bs_replay(bs_device_t* device, const char* path, const char* serial,
+               bool timed, bs_replay_callback_t callback, void* userdata,
+               bs_error_t* error) {
+    uint8_t magic[sizeof(trace_magic)], match[0x10000 / 8];
+    uint8_t* data;
+    replay_t replay;
+    bs_replay_t info;
+    bs_error_t err = BS_NO_ERROR;
+    int64_t base = 0;
+    bool first = true, mode = false;
+    FILE* fh = fopen(path, "rb");
+    if (!fh) {
+        if (error) *error = errno == EACCES ? BS_ERROR_ACCESS : BS_ERROR_IO;
+        return false;
+    }
+    if (fread(magic, 1, sizeof(magic), fh) != sizeof(magic) ||
+        memcmp(magic, trace_magic, sizeof(magic)) != 0) {
+        fclose(fh);
+        if (error) *error = BS_ERROR_INVALID_PARAM;
+        return false;
+    }
+    data = malloc(0xffff);
+    if (!data) {
+        fclose(fh);
+        if (error) *error = BS_ERROR_NO_MEM;
+        return false;
+    }
+    memset(match, 0, sizeof(match));
+    replay.callback = callback;
+    replay.userdata = userdata;
+    replay.pending = NULL;
+    while (replay_read(fh, serial, match, &info, data, &err)) {
+        replay_request_t* request;
+        if (first) {
+            /* Timed replay starts with the first request, not the trace */
+            base = bs_now_us() - (int64_t)info.start_us;
+            first = false;
+        }
+        /* A request is never sent before one that completed before it was
+         * sent when recorded, it might have been waiting for it */
+        err = replay_wait(device, &replay, info.start_us,
+                          timed ? base + (int64_t)info.start_us : 0);
+        if (err != BS_NO_ERROR) break;
+        request = malloc(sizeof(replay_request_t));
+        if (!request) {
+            err = BS_ERROR_NO_MEM;
+            break;
+        }
+        request->replay = &replay;
+        request->end_us = info.start_us + info.recorded_us;
+        request->info = info;
+        request->submit_us = bs_now_us();
+        request->next = replay.pending;
+        replay.pending = request;
+        if ((info.request_type & LIBUSB_ENDPOINT_IN) == 0 &&
+            info.value == 4) {
+            mode = true;
+        }
+        if (!submit_transfer(device, info.request_type, info.request,
+                             info.value, info.index, data, info.length,
+                             true, replay_done, request, DEADLINE_DEFAULT)) {
+            /* Reported like any other failed request */
+            replay_done(device, device->last_error, request);
+        }
+    }
+    fclose(fh);
+    free(data);
+    /* Wait for the rest even after an error, they point to replay. If
+     * events fail they may never complete, cancel them and wait for what
+     * the cancel completes */
+    while (replay.pending) {
+        bs_error_t tmp = device_events(device, -1, NULL);
+        if (tmp == BS_NO_ERROR) continue;
+        if (err == BS_NO_ERROR) err = tmp;
+        cancel_pending(device);
+        break;
+    }
+    /* Left to free themselves if they ever complete */
+    while (replay.pending) {
+        replay_request_t* request = replay.pending;
+        replay.pending = request->next;
+        request->replay = NULL;
+    }
+    /* Whatever the device shows, and maybe its mode, is now unknown */
+    bs_invalidate_cache(device);
+    if (mode) forget_mode(device);
+    if (err != BS_NO_ERROR) {
+        if (error) *error = err;
+        return false;
+    }
+    return true;
+}
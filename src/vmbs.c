@@ -15,6 +15,7 @@
 # include <getopt.h>
 #endif
 #if HAVE_PULSEAUDIO
+# include <poll.h>
 # include <pulse/pulseaudio.h>
 #else
 # include <unistd.h>
@@ -35,6 +36,12 @@ static bool init(bs_device_t* dev);
 static bool run(bs_device_t* dev);
 static void clear(bs_device_t* dev);
 
+#if !HAVE_PULSEAUDIO
+/* Frame rate and time from 0 to max of the fallback volume sweep */
+# define FALLBACK_FPS 25
+# define FALLBACK_SWEEP_MS 5000
+#endif
+
 static bool run_capture(bs_device_t* dev, bs_color_t* table,
                         const bs_color_t* blue_table,
                         const bs_color_t* normal_table);
@@ -46,7 +53,16 @@ int main(int argc, char** argv) {
     if (!handle_args(argc, argv, &exitcode)) {
         return exitcode;
     }
-        if (glob.serial) {
+    /* Saves asking the device for its mode every time */
+    bs_set_caps_cache(true);
+#if HAVE_PULSEAUDIO
+    /* libbs is driven from the pulseaudio main loop, see run_capture() */
+    if (!bs_init(&error)) {
+        fprintf(stderr, "Error initializing libbs: %s\n", bs_error_str(error));
+        return EXIT_FAILURE;
+    }
+#endif
+    if (glob.serial) {
         dev = bs_open_matching_serial(glob.serial, &error);
     } else {
         dev = bs_open_first(&error);
@@ -58,16 +74,30 @@ int main(int argc, char** argv) {
             fprintf(stderr, "Error opening BlinkStick: %s\n",
                     bs_error_str(error));
         }
-        return EXIT_FAILURE;
+        exitcode = EXIT_FAILURE;
+        goto shutdown;
     }
 
     if (!init(dev)) {
         bs_close(dev);
-        return EXIT_FAILURE;
+        exitcode = EXIT_FAILURE;
+        goto shutdown;
+    }
+#if !HAVE_PULSEAUDIO
+    /* Never block on the device, only the latest value is interesting
+     * anyway */
+    if (!bs_set_mailbox(dev, true)) {
+        fprintf(stderr, "Unable to enable mailbox mode: %s\n",
+                bs_error_str(bs_error(dev)));
     }
+#endif
     exitcode = run(dev) ? EXIT_SUCCESS : EXIT_FAILURE;
     clear(dev);
     bs_close(dev);
+shutdown:
+#if HAVE_PULSEAUDIO
+    bs_shutdown();
+#endif
     return exitcode;
 }
 
@@ -279,9 +309,9 @@ static void calc_normal(bs_color_t* table) {
     }
 }
 
-static bool set_value(bs_device_t* dev, double value, bs_color_t* table,
-                      const bs_color_t* blue_table,
-                      const bs_color_t* normal_table) {
+static void fill_value(double value, bs_color_t* table,
+                       const bs_color_t* blue_table,
+                       const bs_color_t* normal_table) {
     if (glob.leds == 1) {
         if (value <= 0.0) {
             *table = blue;
@@ -289,7 +319,7 @@ static bool set_value(bs_device_t* dev, double value, bs_color_t* table,
             *table = green;
             scale(table, value);
         }
-        return bs_set(dev, *table);
+        return;
     }
     if (value <= 0.0) {
         memcpy(table, blue_table, sizeof(bs_color_t) * glob.leds);
@@ -302,8 +332,17 @@ static bool set_value(bs_device_t* dev, double value, bs_color_t* table,
             scale(table + high - 1, 1.0 - high + fill);
         }
     }
+}
+
+#if !HAVE_PULSEAUDIO
+static bool set_value(bs_device_t* dev, double value, bs_color_t* table,
+                      const bs_color_t* blue_table,
+                      const bs_color_t* normal_table) {
+    fill_value(value, table, blue_table, normal_table);
+    if (glob.leds == 1) return bs_set(dev, *table);
     return bs_set_many(dev, glob.leds, table);
 }
+#endif
 
 static void do_quit(int signum UNUSED) {
     glob.quit = true;
@@ -336,6 +375,12 @@ void clear(bs_device_t* dev) {
 }
 
 #if HAVE_PULSEAUDIO
+typedef struct pulse_fd_t {
+    struct pulse_fd_t* next;
+    int fd;
+    pa_io_event* event;
+} pulse_fd_t;
+
 typedef struct pulse_data_t {
     pa_mainloop* loop;
     pa_mainloop_api* loop_api;
@@ -344,13 +389,142 @@ typedef struct pulse_data_t {
     bs_color_t* table;
     const bs_color_t* blue_table;
     const bs_color_t* normal_table;
+    pulse_fd_t* fds;  /* libbs file descriptors watched by the loop */
+    pa_time_event* timer;  /* NULL if libbs has no timeout */
+    bool busy;  /* A frame is being sent */
+    bool dirty;  /* table changed while busy */
 } pulse_data_t;
 
+static void handle_libbs(pulse_data_t* data);
+
+static void libbs_io_cb(pa_mainloop_api* api UNUSED, pa_io_event* event UNUSED,
+                        int fd UNUSED, pa_io_event_flags_t events UNUSED,
+                        void* userdata) {
+    handle_libbs(userdata);
+}
+
+static void libbs_time_cb(pa_mainloop_api* api UNUSED,
+                          pa_time_event* event UNUSED,
+                          const struct timeval* tv UNUSED, void* userdata) {
+    handle_libbs(userdata);
+}
+
+static void update_timer(pulse_data_t* data) {
+    const int timeout = bs_get_next_timeout();
+    if (data->timer) {
+        data->loop_api->time_free(data->timer);
+        data->timer = NULL;
+    }
+    if (timeout >= 0) {
+        struct timeval tv;
+        pa_gettimeofday(&tv);
+        pa_timeval_add(&tv, (pa_usec_t)timeout * PA_USEC_PER_MSEC);
+        data->timer = data->loop_api->time_new(data->loop_api, &tv,
+                                               libbs_time_cb, data);
+    }
+}
+
+void handle_libbs(pulse_data_t* data) {
+    bs_handle_events(0, NULL);
+    update_timer(data);
+}
+
+static void pollfd_added(int fd, short events, void* userdata) {
+    pulse_data_t* data = userdata;
+    pulse_fd_t* pfd = malloc(sizeof(pulse_fd_t));
+    pa_io_event_flags_t flags = PA_IO_EVENT_NULL;
+    if (!pfd) return;
+    if (events & POLLIN) flags |= PA_IO_EVENT_INPUT;
+    if (events & POLLOUT) flags |= PA_IO_EVENT_OUTPUT;
+    pfd->fd = fd;
+    pfd->event = data->loop_api->io_new(data->loop_api, fd, flags,
+                                        libbs_io_cb, data);
+    pfd->next = data->fds;
+    data->fds = pfd;
+}
+
+static void pollfd_removed(int fd, void* userdata) {
+    pulse_data_t* data = userdata;
+    pulse_fd_t** pos;
+    for (pos = &data->fds; *pos; pos = &(*pos)->next) {
+        if ((*pos)->fd == fd) {
+            pulse_fd_t* pfd = *pos;
+            *pos = pfd->next;
+            data->loop_api->io_free(pfd->event);
+            free(pfd);
+            break;
+        }
+    }
+}
+
+static bool start_libbs(pulse_data_t* data) {
+    bs_error_t error;
+    size_t i, count;
+    bs_pollfd_t* fds = bs_get_pollfds(&count, &error);
+    if (!fds) {
+        fprintf(stderr, "Unable to get libbs file descriptors: %s\n",
+                bs_error_str(error));
+        return false;
+    }
+    for (i = 0; i < count; i++) {
+        pollfd_added(fds[i].fd, fds[i].events, data);
+    }
+    free(fds);
+    bs_set_pollfd_notifiers(pollfd_added, pollfd_removed, data);
+    update_timer(data);
+    return true;
+}
+
+static void stop_libbs(pulse_data_t* data) {
+    /* sent_cb() must not be called after data is gone */
+    data->dirty = false;
+    while (data->busy) {
+        bs_handle_events(100, NULL);
+    }
+    bs_set_pollfd_notifiers(NULL, NULL, NULL);
+    while (data->fds) {
+        pollfd_removed(data->fds->fd, data);
+    }
+    if (data->timer) {
+        data->loop_api->time_free(data->timer);
+        data->timer = NULL;
+    }
+}
+
+static void send_table(pulse_data_t* data);
+
+static void sent_cb(bs_device_t* dev UNUSED, bs_error_t error UNUSED,
+                    void* userdata) {
+    pulse_data_t* data = userdata;
+    data->busy = false;
+    if (data->dirty) send_table(data);
+}
+
+/* Never block the capture callbacks on the device, if a frame is already
+ * being sent only the latest value is sent when it is done */
+void send_table(pulse_data_t* data) {
+    if (data->busy) {
+        data->dirty = true;
+        return;
+    }
+    data->dirty = false;
+    if (glob.leds == 1) {
+        data->busy = bs_set_async(data->dev, *data->table, sent_cb, data);
+    } else {
+        data->busy = bs_set_many_async(data->dev, glob.leds, data->table,
+                                       sent_cb, data);
+    }
+    update_timer(data);
+}
+
+static void send_value(pulse_data_t* data, double value) {
+    fill_value(value, data->table, data->blue_table, data->normal_table);
+    send_table(data);
+}
+
 static void stream_suspended_cb(pa_stream* stream, void* userdata) {
     if (pa_stream_is_suspended(stream)) {
-        pulse_data_t* data = userdata;
-        set_value(data->dev, 0, data->table, data->blue_table,
-                  data->normal_table);
+        send_value(userdata, 0);
     }
 }
 
@@ -373,8 +547,7 @@ static void stream_read_cb(pa_stream* stream, size_t length, void* userdata) {
     if (value < 0.0) value = 0.0;
     if (value > 1.0) value = 1.0;
 
-    set_value(data->dev, value,
-              data->table, data->blue_table, data->normal_table);
+    send_value(data, value);
 }
 
 static void source_info_cb(pa_context* ctx, const pa_source_info* info, int eol,
@@ -469,6 +642,11 @@ bool run_capture(bs_device_t* dev, bs_color_t* table,
         pa_mainloop_free(data.loop);
         return false;
     }
+    if (!start_libbs(&data)) {
+        pa_context_unref(ctx);
+        pa_mainloop_free(data.loop);
+        return false;
+    }
 
     ret = true;
     while (!glob.quit) {
@@ -487,27 +665,39 @@ bool run_capture(bs_device_t* dev, bs_color_t* table,
             fputs("No output found\n", stderr);
         }
     }
+    stop_libbs(&data);
     pa_context_unref(ctx);
     pa_mainloop_free(data.loop);
     return ret;
 #else
-    /* Fallback, just slowly go from 0 to max and back again */
-    unsigned char value = 1;
-    bool down = true;
+    /* Fallback, just go from 0 to max and back again */
+    bs_clock_t* clock;
+    bs_tick_t tick;
+    bs_error_t error;
+    bool ret = true;
+    clock = bs_clock_new(FALLBACK_FPS, &error);
+    if (!clock) {
+        fprintf(stderr, "Unable to create frame clock: %s\n",
+                bs_error_str(error));
+        return false;
+    }
     while (!glob.quit) {
-        if (value == 255 || value == 0) {
-            down = !down;
-        }
-        if (down) {
-            value--;
-        } else {
-            value++;
+        uint64_t pos;
+        if (!bs_clock_wait(clock, &tick, &error)) {
+            fprintf(stderr, "Error waiting for frame: %s\n",
+                    bs_error_str(error));
+            ret = false;
+            break;
         }
-        if (!set_value(dev, value / 255.0, table, blue_table, normal_table)) {
-            return false;
+        pos = (tick.time_us / 1000) % (2 * FALLBACK_SWEEP_MS);
+        if (pos > FALLBACK_SWEEP_MS) pos = 2 * FALLBACK_SWEEP_MS - pos;
+        if (!set_value(dev, (double)pos / FALLBACK_SWEEP_MS, table,
+                       blue_table, normal_table)) {
+            ret = false;
+            break;
         }
-        sleep(1);
     }
-    return true;
+    bs_clock_free(clock);
+    return ret;
 #endif  /* FALLBACK */
 }